@@ -16,7 +16,8 @@ for dir in /etc/keepassxc-unlock/*; do
   mkdir -p $backup_dir
   for conf in $dir/*; do
     conf_name=`basename $conf .conf`
-    { head -3 $conf; tail -n+4 $conf | systemd-creds --name=$conf_name decrypt - -; } | \
+    { sed '/^PASSWORD:$/q' $conf; sed '1,/^PASSWORD:$/d' $conf | \
+        systemd-creds --name=$conf_name decrypt - -; } | \
       gpg -r "$1" -o - --encrypt - > $backup_dir/$conf_name.gpg
   done
 done
@@ -11,8 +11,13 @@ fg_reset='\033[00m'
 sbin_files="keepassxc-unlock-setup"
 musl_suffix="-$(uname -m)-static"
 musl_files="keepassxc-login-monitor$musl_suffix keepassxc-unlock$musl_suffix"
-src_files="src/login-monitor.c src/unlock.c src/common.c src/common.h src/Makefile"
-service_files="systemd/keepassxc-login-monitor.service systemd/keepassxc-unlock@.service"
+src_files="src/login-monitor.c src/unlock.c src/common.c src/common.h src/config.c src/config.h
+  src/credentials.c src/credentials.h src/secrets.c src/secrets.h src/stats.c src/stats.h
+  src/Makefile"
+service_files="systemd/keepassxc-login-monitor.service systemd/keepassxc-unlock-daemon.service"
+# template service used by the older versions of the login monitor
+old_service_files="keepassxc-unlock@.service"
+dbus_policy_file="systemd/org.keepassxc.Unlock.conf"
 doc_files="README.md LICENSE"
 base_url="https://github.com/sumwale/keepassxc-unlock/blob/main"
 base_release_url="https://github.com/sumwale/keepassxc-unlock/releases/latest/download"
@@ -49,7 +54,12 @@ tmp_dir=$(mktemp -d)
 trap "/bin/rm -rf $tmp_dir" 0 1 2 3 4 5 6 11 12 15
 
 echo -e "${fg_orange}Fetching executables and installing in /usr/local/sbin$fg_reset"
-sudo systemctl stop keepassxc-login-monitor.service 2>/dev/null || /bin/true
+sudo systemctl stop keepassxc-login-monitor.service keepassxc-unlock-daemon.service 2>/dev/null ||
+  /bin/true
+# the login monitor starts the services for the existing sessions afresh once it is restarted
+for unit in $(sudo systemctl -q list-units 'keepassxc-unlock@*.service' | awk '{ print $1 }'); do
+  sudo systemctl stop "$unit" || /bin/true
+done
 for file in $sbin_files; do
   $get_cmd $tmp_dir/$(basename $file) "$base_url/$file?raw=true"
 done
@@ -76,13 +86,26 @@ for file in $service_files; do
 done
 sudo install -t /etc/systemd/system -m 0644 -o root -g root $tmp_dir/*
 rm -f $tmp_dir/*
+for file in $old_service_files; do
+  sudo rm -f /etc/systemd/system/$file
+done
+
+echo -e "${fg_orange}Fetching D-Bus policy file and installing in /etc/dbus-1/system.d$fg_reset"
+$get_cmd $tmp_dir/$(basename $dbus_policy_file) "$base_url/$dbus_policy_file?raw=true"
+sudo install -D -t /etc/dbus-1/system.d -m 0644 -o root -g root $tmp_dir/*
+rm -f $tmp_dir/*
 
 echo -e "${fg_orange}Reloading systemd daemon$fg_reset"
 sudo systemctl daemon-reload
 
-echo -e "${fg_orange}Enabling and starting login monitor service$fg_reset"
-sudo systemctl enable keepassxc-login-monitor.service
-sudo systemctl start keepassxc-login-monitor.service
+if systemctl -q is-enabled keepassxc-unlock-daemon.service 2>/dev/null; then
+  echo -e "${fg_orange}Starting multi-user unlock daemon service$fg_reset"
+  sudo systemctl start keepassxc-unlock-daemon.service
+else
+  echo -e "${fg_orange}Enabling and starting login monitor service$fg_reset"
+  sudo systemctl enable keepassxc-login-monitor.service
+  sudo systemctl start keepassxc-login-monitor.service
+fi
 
 echo -e "${fg_cyan}Fetching LICENSE and doc files and installing in /usr/local/share/doc$fg_reset"
 for file in $doc_files; do
@@ -91,38 +114,6 @@ done
 sudo install -D -t /usr/local/share/doc/keepassxc-unlock -m 0644 -o root -g root $tmp_dir/*
 rm -f $tmp_dir/*
 
-echo
-echo -e "${fg_orange}Start user-specific auto-unlock service? This will only work if"
-echo "this is an upgrade and KDBX databases have already been registered using"
-echo "keepassxc-unlock-setup previously and KeePassXC is running in the current session."
-echo -en "${fg_cyan}Proceed? (y/N) $fg_reset"
-set +e
-read -r resp < /dev/tty
-set -e
-if [ "$resp" = y -o "$resp" = Y ]; then
-  # find the session path for this session, write to session.env and start the service
-  uid=$(id -u)
-  session_id=$(dbus-send --system --print-reply --type=method_call \
-    --dest=org.freedesktop.login1 /org/freedesktop/login1/session/auto \
-    org.freedesktop.DBus.Properties.Get string:org.freedesktop.login1.Session string:Id | \
-    sed -n 's/.*string "\([0-9]\+\).*/\1/p')
-  if [ -n "$session_id" ]; then
-    session_path=$(dbus-send --system --print-reply --type=method_call \
-      --dest=org.freedesktop.login1 /org/freedesktop/login1 \
-      org.freedesktop.login1.Manager.GetSession "string:$session_id" | \
-      sed -n 's/.*object path "\([^"]*\).*/\1/p')
-    if [ -n "$session_path" ]; then
-      echo "SESSION_PATH=$session_path" | sudo tee /etc/keepassxc-unlock/$uid/session.env
-      service_name=keepassxc-unlock@$uid.service
-      echo -e "${fg_orange}Starting $service_name$fg_reset"
-      sudo systemctl stop $service_name 2>/dev/null || /bin/true
-      sudo systemctl start $service_name || /bin/true
-    else
-      echo -e "${fg_red}Failed to determine current session's path$fg_reset"
-    fi
-  fi
-fi
-
 echo
 echo -e "${fg_green}Installation complete."
 echo
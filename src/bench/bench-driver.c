@@ -0,0 +1,358 @@
+#include <gio/gio.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "common.h"
+
+// Driver of the benchmark harness that triggers logins or screen unlocks on the mock logind and
+// measures the time taken till the last database is opened in the mock KeePassXC. It also
+// measures the startup of the auto-unlock programs till they are reachable on the system bus.
+
+#define BENCH_LOGIN_INTERFACE "org.keepassxc.UnlockBench.Login"
+#define BENCH_KP_INTERFACE "org.keepassxc.UnlockBench.KeePassXC"
+#define BENCH_SYSTEMD_INTERFACE "org.keepassxc.UnlockBench.Systemd"
+#define KP_DBUS_INTERFACE "org.keepassxc.KeePassXC.MainWindow"
+#define BENCH_WAIT_SECS 30    // deadline for all the databases to be opened after a trigger
+
+/// @brief Holds the state of the benchmark driver
+typedef struct {
+  GDBusConnection *system_conn;     // connection to the private system bus
+  GDBusConnection *session_conn;    // connection to the private session bus
+  guint num_dbs;                    // number of databases expected to be opened per trigger
+  guint num_opened;                 // number of databases opened since the last trigger
+  gint64 last_opened;               // monotonic time in microseconds of the last open
+  bool timed_out;                   // `true` if the deadline passed before all databases opened
+} bench_state;
+
+/// @brief Holds the state of the `startup` scenario
+typedef struct {
+  const char *bus_name;    // the well-known name owned by the program once it has started
+  bool name_owned;         // `true` if `bus_name` currently has an owner
+  bool timed_out;          // `true` if the deadline passed before the awaited change of owner
+} startup_state;
+
+/// @brief Show usage of this program
+/// @param script_name name of the invoking script as obtained from `argv[0]`
+void show_usage(const char *script_name) {
+  printf("\nUsage: %s <login|unlock> <ITERATIONS> <NUM_DBS> <USER_ID> <DISPLAY>\n", script_name);
+  printf("       %s startup <ITERATIONS> <BUS_NAME> <PROGRAM> [ARGS...]\n", script_name);
+  printf("\nTrigger logins or screen unlocks on the mock logind and report the latency till the\n");
+  printf("last `openDatabase` call of the configured databases completes, or start a program\n");
+  printf("repeatedly and report the latency till it owns the given name on the system bus\n\n");
+  fflush(stdout);
+}
+
+/// @brief Callback for `DatabaseOpened` signal of the mock KeePassXC.
+void handle_database_opened(GDBusConnection *conn, const gchar *sender_name,
+    const gchar *object_path, const gchar *interface_name, const gchar *signal_name,
+    GVariant *parameters, gpointer user_data) {
+  bench_state *state = (bench_state *)user_data;
+  gint64 timestamp = 0;
+  g_variant_get(parameters, "(&sx)", NULL, &timestamp);
+  state->num_opened++;
+  if (timestamp > state->last_opened) state->last_opened = timestamp;
+}
+
+gboolean handle_wait_timeout(gpointer user_data) {
+  ((bench_state *)user_data)->timed_out = true;
+  return G_SOURCE_REMOVE;
+}
+
+/// @brief Wait for all the databases to be opened after a trigger.
+/// @param state pointer to the `bench_state`
+/// @param trigger_time monotonic time in microseconds of the trigger
+/// @return the latency in milliseconds, or a negative value if the deadline passed
+double wait_for_databases(bench_state *state, gint64 trigger_time) {
+  state->timed_out = false;
+  guint timeout_id = g_timeout_add_seconds(BENCH_WAIT_SECS, handle_wait_timeout, state);
+  while (state->num_opened < state->num_dbs && !state->timed_out) {
+    g_main_context_iteration(NULL, TRUE);
+  }
+  if (state->timed_out) {
+    print_error("Only %u of %u database(s) were opened within %d secs\n", state->num_opened,
+        state->num_dbs, BENCH_WAIT_SECS);
+    return -1.0;
+  }
+  g_source_remove(timeout_id);
+  return (double)(state->last_opened - trigger_time) / 1000.0;
+}
+
+/// @brief Callback for `NameOwnerChanged` signal of the bus for the name awaited by `startup`.
+void handle_name_owner_changed(GDBusConnection *conn, const gchar *sender_name,
+    const gchar *object_path, const gchar *interface_name, const gchar *signal_name,
+    GVariant *parameters, gpointer user_data) {
+  startup_state *state = (startup_state *)user_data;
+  const gchar *name = NULL, *new_owner = NULL;
+  g_variant_get(parameters, "(&s&s&s)", &name, NULL, &new_owner);
+  if (g_strcmp0(name, state->bus_name) == 0) state->name_owned = new_owner[0] != '\0';
+}
+
+gboolean handle_startup_timeout(gpointer user_data) {
+  ((startup_state *)user_data)->timed_out = true;
+  return G_SOURCE_REMOVE;
+}
+
+/// @brief Wait for the awaited name to be owned or released.
+/// @param state pointer to the `startup_state`
+/// @param owned `true` to wait for the name to be owned else for it to be released
+/// @return `true` if the name reached the given state before the deadline else `false`
+bool wait_for_name_owner(startup_state *state, bool owned) {
+  state->timed_out = false;
+  guint timeout_id = g_timeout_add_seconds(BENCH_WAIT_SECS, handle_startup_timeout, state);
+  while (state->name_owned != owned && !state->timed_out) g_main_context_iteration(NULL, TRUE);
+  if (state->timed_out) {
+    print_error("'%s' was not %s within %d secs\n", state->bus_name,
+        owned ? "owned" : "released", BENCH_WAIT_SECS);
+    return false;
+  }
+  g_source_remove(timeout_id);
+  return true;
+}
+
+/// @brief Start a program repeatedly and measure the time till it owns a name on the system bus,
+///        which includes loading its libraries, connecting to the bus and its initial calls.
+///        The program is terminated after each start and its name released before the next one.
+/// @param system_conn connection to the private system bus
+/// @param iterations number of starts to be measured
+/// @param bus_name the well-known name owned by the program once it has started
+/// @param argv NULL terminated command-line of the program
+/// @param samples array of `double` to which the latencies in milliseconds are appended
+/// @return the number of starts that failed
+guint measure_startup(GDBusConnection *system_conn, guint iterations, const char *bus_name,
+    char **argv, GArray *samples) {
+  startup_state state = {bus_name, false, false};
+  guint subscription_id = g_dbus_connection_signal_subscribe(system_conn, "org.freedesktop.DBus",
+      "org.freedesktop.DBus", "NameOwnerChanged", "/org/freedesktop/DBus", bus_name,
+      G_DBUS_SIGNAL_FLAGS_NONE, handle_name_owner_changed, &state, NULL);
+  // make sure that the match is in place before the first start
+  GVariant *result = g_dbus_connection_call_sync(system_conn, "org.freedesktop.DBus",
+      "/org/freedesktop/DBus", "org.freedesktop.DBus", "GetId", NULL, NULL,
+      G_DBUS_CALL_FLAGS_NONE, DBUS_CALL_WAIT, NULL, NULL);
+  if (result) g_variant_unref(result);
+
+  guint failures = 0;
+  for (guint i = 0; i < iterations; i++) {
+    GError *error = NULL;
+    GPid pid = 0;
+    gint64 start_time = g_get_monotonic_time();
+    if (!g_spawn_async(NULL, argv, NULL,
+            G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+            NULL, NULL, &pid, &error)) {
+      print_error("Failed to start '%s': %s\n", argv[0], error ? error->message : "(null)");
+      g_clear_error(&error);
+      failures += iterations - i;
+      break;
+    }
+    if (wait_for_name_owner(&state, true)) {
+      double latency = (double)(g_get_monotonic_time() - start_time) / 1000.0;
+      g_array_append_val(samples, latency);
+    } else {
+      failures++;
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    g_spawn_close_pid(pid);
+    // the next instance cannot own the name till the bus has released it from this one
+    if (!wait_for_name_owner(&state, false)) {
+      failures += iterations - i - 1;
+      break;
+    }
+  }
+  g_dbus_connection_signal_unsubscribe(system_conn, subscription_id);
+  return failures;
+}
+
+/// @brief Call a method on the system bus.
+/// @return the result which should be released with `g_variant_unref()`, or NULL on failure
+GVariant *call_system(bench_state *state, const gchar *dest, const gchar *path,
+    const gchar *interface, const gchar *method, GVariant *params) {
+  GError *error = NULL;
+  GVariant *result = g_dbus_connection_call_sync(state->system_conn, dest, path, interface,
+      method, params, NULL, G_DBUS_CALL_FLAGS_NONE, DBUS_CALL_WAIT, NULL, &error);
+  if (!result) {
+    print_error("Failed to call %s.%s: %s\n", interface, method, error ? error->message : "(null)");
+    g_clear_error(&error);
+  }
+  return result;
+}
+
+/// @brief Start a new session on the mock logind and return its path.
+gchar *add_session(bench_state *state, guint32 user_id, const gchar *display, guint32 leader) {
+  GVariant *result = call_system(state, LOGIN_OBJECT_NAME, LOGIN_OBJECT_PATH,
+      BENCH_LOGIN_INTERFACE, "AddSession",
+      g_variant_new("(ussu)", user_id, "x11", display, leader));
+  if (!result) return NULL;
+  gchar *session_path = NULL;
+  g_variant_get(result, "(o)", &session_path);
+  g_variant_unref(result);
+  return session_path;
+}
+
+/// @brief End a session on the mock logind and wait for the unlock service started for it to exit.
+void remove_session(bench_state *state, const gchar *session_path) {
+  GVariant *result = call_system(state, LOGIN_OBJECT_NAME, LOGIN_OBJECT_PATH,
+      BENCH_LOGIN_INTERFACE, "RemoveSession", g_variant_new("(o)", session_path));
+  if (result) g_variant_unref(result);
+  // the next login of the user can start the service only after the previous one has stopped
+  for (int i = 0; i < 1000; i++) {
+    guint32 num_units = 0;
+    result = call_system(state, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+        BENCH_SYSTEMD_INTERFACE, "GetUnitCount", NULL);
+    if (!result) return;
+    g_variant_get(result, "(u)", &num_units);
+    g_variant_unref(result);
+    if (num_units == 0) return;
+    g_usleep(5000);
+  }
+}
+
+/// @brief Set the `LockedHint` of a session on the mock logind.
+void set_locked_hint(bench_state *state, const gchar *session_path, bool locked) {
+  GVariant *result = call_system(state, LOGIN_OBJECT_NAME, LOGIN_OBJECT_PATH,
+      BENCH_LOGIN_INTERFACE, "SetLockedHint", g_variant_new("(ob)", session_path, locked));
+  if (result) g_variant_unref(result);
+}
+
+/// @brief Lock all the databases in the mock KeePassXC like it does on a screen lock.
+void lock_all_databases(bench_state *state) {
+  GVariant *result = g_dbus_connection_call_sync(state->session_conn, KP_DBUS_INTERFACE,
+      "/keepassxc", KP_DBUS_INTERFACE, "lockAllDatabases", NULL, NULL, G_DBUS_CALL_FLAGS_NONE,
+      DBUS_CALL_WAIT, NULL, NULL);
+  if (result) g_variant_unref(result);
+}
+
+/// @brief Get the process ID of the mock KeePassXC which also acts as the session leader.
+guint32 get_kp_process_id(bench_state *state) {
+  guint32 pid = 0;
+  GVariant *result = g_dbus_connection_call_sync(state->session_conn, "org.freedesktop.DBus", "/",
+      "org.freedesktop.DBus", "GetConnectionUnixProcessID",
+      g_variant_new("(s)", KP_DBUS_INTERFACE), NULL, G_DBUS_CALL_FLAGS_NONE, DBUS_CALL_WAIT, NULL,
+      NULL);
+  if (result) {
+    g_variant_get(result, "(u)", &pid);
+    g_variant_unref(result);
+  }
+  return pid;
+}
+
+gint compare_doubles(gconstpointer a, gconstpointer b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/// @brief Get a percentile of sorted samples using the nearest-rank method.
+double percentile(GArray *samples, double pct) {
+  guint rank = (guint)(pct / 100.0 * samples->len + 0.999999);
+  if (rank == 0) rank = 1;
+  return g_array_index(samples, double, rank - 1);
+}
+
+/// @brief Print the latency summary of the samples.
+void report(const char *scenario, GArray *samples, guint failures) {
+  if (samples->len == 0) {
+    printf("%-8s no successful iterations (%u failed)\n", scenario, failures);
+    return;
+  }
+  g_array_sort(samples, compare_doubles);
+  double sum = 0;
+  for (guint i = 0; i < samples->len; i++) sum += g_array_index(samples, double, i);
+  printf("%-8s n=%-4u failed=%-3u min=%8.2f p50=%8.2f p95=%8.2f p99=%8.2f max=%8.2f "
+         "mean=%8.2f (ms)\n",
+      scenario, samples->len, failures, g_array_index(samples, double, 0),
+      percentile(samples, 50), percentile(samples, 95), percentile(samples, 99),
+      g_array_index(samples, double, samples->len - 1), sum / samples->len);
+  fflush(stdout);
+}
+
+
+int main(int argc, char *argv[]) {
+  bool startup = argc >= 5 && strcmp(argv[1], "startup") == 0;
+  if (!startup &&
+      (argc != 6 || (strcmp(argv[1], "login") != 0 && strcmp(argv[1], "unlock") != 0))) {
+    show_usage(argv[0]);
+    return 1;
+  }
+  bool login = strcmp(argv[1], "login") == 0;
+  guint iterations = (guint)strtoul(argv[2], NULL, 10);
+
+  GError *error = NULL;
+  if (startup) {
+    GDBusConnection *system_conn = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+    if (!system_conn) {
+      print_error("Failed to connect to the bench system bus: %s\n",
+          error ? error->message : "(null)");
+      g_clear_error(&error);
+      return 1;
+    }
+    GArray *samples = g_array_new(FALSE, FALSE, sizeof(double));
+    guint failures = measure_startup(system_conn, iterations, argv[3], &argv[4], samples);
+    report(argv[1], samples, failures);
+    g_array_unref(samples);
+    g_object_unref(system_conn);
+    return failures == 0 ? 0 : 1;
+  }
+
+  guint32 user_id = (guint32)strtoul(argv[4], NULL, 10);
+  const char *display = argv[5];
+  bench_state state = {NULL, NULL, (guint)strtoul(argv[3], NULL, 10), 0, 0, false};
+  state.system_conn = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+  if (state.system_conn) state.session_conn = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+  if (!state.session_conn) {
+    print_error("Failed to connect to the bench buses: %s\n", error ? error->message : "(null)");
+    g_clear_error(&error);
+    return 1;
+  }
+  g_dbus_connection_signal_subscribe(state.session_conn, NULL, BENCH_KP_INTERFACE,
+      "DatabaseOpened", "/keepassxc", NULL, G_DBUS_SIGNAL_FLAGS_NONE, handle_database_opened,
+      &state, NULL);
+  guint32 leader = get_kp_process_id(&state);
+
+  GArray *samples = g_array_new(FALSE, FALSE, sizeof(double));
+  guint failures = 0;
+  gchar *session_path = NULL;
+  const char *locked_ms_env = g_getenv("BENCH_LOCKED_MS");
+  guint64 locked_ms = locked_ms_env ? g_ascii_strtoull(locked_ms_env, NULL, 10) : 10;
+  if (!login) {
+    // the session is started once and only the screen unlocks are measured
+    state.num_opened = 0;
+    session_path = add_session(&state, user_id, display, leader);
+    if (!session_path || wait_for_databases(&state, g_get_monotonic_time()) < 0) return 1;
+  }
+  for (guint i = 0; i < iterations; i++) {
+    if (login) {
+      state.num_opened = 0;
+      gint64 trigger_time = g_get_monotonic_time();
+      session_path = add_session(&state, user_id, display, leader);
+      double latency = session_path ? wait_for_databases(&state, trigger_time) : -1.0;
+      if (session_path) remove_session(&state, session_path);
+      g_clear_pointer(&session_path, g_free);
+      if (latency < 0) {
+        failures++;
+      } else {
+        g_array_append_val(samples, latency);
+      }
+    } else {
+      lock_all_databases(&state);
+      set_locked_hint(&state, session_path, true);
+      // keep the screen locked for a while like a real screen lock
+      g_usleep(locked_ms * 1000);
+      state.num_opened = 0;
+      gint64 trigger_time = g_get_monotonic_time();
+      set_locked_hint(&state, session_path, false);
+      double latency = wait_for_databases(&state, trigger_time);
+      if (latency < 0) {
+        failures++;
+      } else {
+        g_array_append_val(samples, latency);
+      }
+    }
+  }
+  if (session_path) remove_session(&state, session_path);
+  g_free(session_path);
+
+  report(argv[1], samples, failures);
+  g_array_unref(samples);
+  g_object_unref(state.session_conn);
+  g_object_unref(state.system_conn);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+#include <gio/gio.h>
+
+#include "common.h"
+
+// Mock of the D-Bus API of KeePassXC for the benchmark harness which records the
+// `openDatabase` calls and announces their completion with the `DatabaseOpened` signal. Changes
+// to the lock state of the databases are announced with `databaseUnlocked`/`databaseLocked`.
+
+#define KP_DBUS_INTERFACE "org.keepassxc.KeePassXC.MainWindow"
+#define BENCH_KP_INTERFACE "org.keepassxc.UnlockBench.KeePassXC"
+
+static const gchar KP_XML[] =
+    "<node>"
+    " <interface name='" KP_DBUS_INTERFACE "'>"
+    "  <method name='openDatabase'>"
+    "   <arg name='fileName' type='s' direction='in'/><arg name='pw' type='s' direction='in'/>"
+    "   <arg name='keyFile' type='s' direction='in'/>"
+    "  </method>"
+    "  <method name='lockAllDatabases'/>"
+    "  <signal name='databaseUnlocked'><arg name='fileName' type='s'/></signal>"
+    "  <signal name='databaseLocked'><arg name='fileName' type='s'/></signal>"
+    " </interface>"
+    " <interface name='" BENCH_KP_INTERFACE "'>"
+    "  <signal name='DatabaseOpened'>"
+    "   <arg name='fileName' type='s'/><arg name='timestamp' type='x'/>"
+    "  </signal>"
+    " </interface>"
+    "</node>";
+
+static guint open_delay_ms = 0;           // simulated time taken by KeePassXC to open a database
+static GHashTable *open_dbs = NULL;       // set of the paths of the unlocked databases
+
+/// @brief Holds an `openDatabase` call whose reply is delayed
+typedef struct {
+  GDBusConnection *conn;               // connection on which the call was received
+  GDBusMethodInvocation *invocation;   // the pending call
+  gchar *kdbx_file;                    // path of the database
+} open_call;
+
+/// @brief Reply to a delayed `openDatabase` call and announce it to the benchmark driver.
+gboolean complete_open_call(gpointer user_data) {
+  open_call *call = (open_call *)user_data;
+  g_hash_table_add(open_dbs, g_strdup(call->kdbx_file));
+  g_dbus_method_invocation_return_value(call->invocation, NULL);
+  g_dbus_connection_emit_signal(call->conn, NULL, "/keepassxc", KP_DBUS_INTERFACE,
+      "databaseUnlocked", g_variant_new("(s)", call->kdbx_file), NULL);
+  g_dbus_connection_emit_signal(call->conn, NULL, "/keepassxc", BENCH_KP_INTERFACE,
+      "DatabaseOpened", g_variant_new("(sx)", call->kdbx_file, g_get_monotonic_time()), NULL);
+  g_free(call->kdbx_file);
+  g_free(call);
+  return G_SOURCE_REMOVE;
+}
+
+void handle_kp_method_call(GDBusConnection *conn, const gchar *sender, const gchar *object_path,
+    const gchar *interface_name, const gchar *method_name, GVariant *parameters,
+    GDBusMethodInvocation *invocation, gpointer user_data) {
+  if (g_strcmp0(method_name, "lockAllDatabases") == 0) {
+    GHashTableIter iter;
+    gpointer kdbx_file;
+    g_hash_table_iter_init(&iter, open_dbs);
+    while (g_hash_table_iter_next(&iter, &kdbx_file, NULL)) {
+      g_dbus_connection_emit_signal(conn, NULL, "/keepassxc", KP_DBUS_INTERFACE, "databaseLocked",
+          g_variant_new("(s)", (const char *)kdbx_file), NULL);
+    }
+    g_hash_table_remove_all(open_dbs);
+    g_dbus_method_invocation_return_value(invocation, NULL);
+    return;
+  }
+  open_call *call = g_new0(open_call, 1);
+  call->conn = conn;
+  call->invocation = invocation;
+  g_variant_get(parameters, "(sss)", &call->kdbx_file, NULL, NULL);
+  if (open_delay_ms == 0) {
+    complete_open_call(call);
+  } else {
+    g_timeout_add(open_delay_ms, complete_open_call, call);
+  }
+}
+
+static const GDBusInterfaceVTable kp_vtable = {handle_kp_method_call, NULL, NULL, {0}};
+
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) open_delay_ms = (guint)strtoul(argv[1], NULL, 10);
+  open_dbs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  GError *error = NULL;
+  GDBusConnection *conn = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+  if (!conn) {
+    print_error("Failed to connect to session bus: %s\n", error ? error->message : "(null)");
+    return 1;
+  }
+  GDBusNodeInfo *node_info = g_dbus_node_info_new_for_xml(KP_XML, &error);
+  g_dbus_connection_register_object(conn, "/keepassxc",
+      g_dbus_node_info_lookup_interface(node_info, KP_DBUS_INTERFACE), &kp_vtable, NULL, NULL,
+      NULL);
+  GVariant *result = g_dbus_connection_call_sync(conn, "org.freedesktop.DBus",
+      "/org/freedesktop/DBus", "org.freedesktop.DBus", "RequestName",
+      g_variant_new("(su)", KP_DBUS_INTERFACE, 0), NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+  if (!result) {
+    print_error("Failed to own %s: %s\n", KP_DBUS_INTERFACE, error ? error->message : "(null)");
+    return 1;
+  }
+  g_variant_unref(result);
+
+  GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+  g_main_loop_run(loop);
+  return 0;
+}
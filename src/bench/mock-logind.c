@@ -0,0 +1,204 @@
+#include <gio/gio.h>
+
+#include "common.h"
+
+// Mock of `org.freedesktop.login1` for the benchmark harness whose sessions are created and
+// changed by the benchmark driver through the `org.keepassxc.UnlockBench.Login` interface.
+
+#define BENCH_LOGIN_INTERFACE "org.keepassxc.UnlockBench.Login"
+
+static const gchar LOGIN_XML[] =
+    "<node>"
+    " <interface name='org.freedesktop.login1.Manager'>"
+    "  <method name='ListSessions'><arg type='a(susso)' direction='out'/></method>"
+    "  <method name='GetSession'>"
+    "   <arg type='s' direction='in'/><arg type='o' direction='out'/>"
+    "  </method>"
+    "  <signal name='SessionNew'><arg type='s'/><arg type='o'/></signal>"
+    "  <signal name='SessionRemoved'><arg type='s'/><arg type='o'/></signal>"
+    " </interface>"
+    " <interface name='" BENCH_LOGIN_INTERFACE "'>"
+    "  <method name='AddSession'>"
+    "   <arg name='uid' type='u' direction='in'/><arg name='type' type='s' direction='in'/>"
+    "   <arg name='display' type='s' direction='in'/><arg name='leader' type='u' direction='in'/>"
+    "   <arg name='path' type='o' direction='out'/>"
+    "  </method>"
+    "  <method name='RemoveSession'><arg name='path' type='o' direction='in'/></method>"
+    "  <method name='SetLockedHint'>"
+    "   <arg name='path' type='o' direction='in'/><arg name='locked' type='b' direction='in'/>"
+    "  </method>"
+    "  <method name='SetActive'>"
+    "   <arg name='path' type='o' direction='in'/><arg name='active' type='b' direction='in'/>"
+    "  </method>"
+    " </interface>"
+    " <interface name='" LOGIN_SESSION_INTERFACE "'>"
+    "  <property name='Id' type='s' access='read'/>"
+    "  <property name='User' type='(uo)' access='read'/>"
+    "  <property name='Type' type='s' access='read'/>"
+    "  <property name='Display' type='s' access='read'/>"
+    "  <property name='Remote' type='b' access='read'/>"
+    "  <property name='Active' type='b' access='read'/>"
+    "  <property name='LockedHint' type='b' access='read'/>"
+    "  <property name='Leader' type='u' access='read'/>"
+    " </interface>"
+    "</node>";
+
+/// @brief State of a mock session
+typedef struct {
+  gchar *id;                  // the session ID
+  gchar *path;                // D-Bus object path of the session
+  guint32 user_id;            // numeric ID of the session owner
+  gchar *type;                // `x11`, `wayland`, `tty` etc
+  gchar *display;             // the `Display` property
+  guint32 leader;             // process ID of the session leader
+  bool active;                // the `Active` property
+  bool locked;                // the `LockedHint` property
+  guint registration_id;      // ID of the registered D-Bus object
+} mock_session;
+
+static GDBusNodeInfo *node_info = NULL;
+static GHashTable *sessions = NULL;    // map of session path to `mock_session`
+static guint next_session_id = 1;
+
+void mock_session_free(gpointer data) {
+  mock_session *session = (mock_session *)data;
+  g_free(session->id);
+  g_free(session->path);
+  g_free(session->type);
+  g_free(session->display);
+  g_free(session);
+}
+
+GVariant *handle_session_get_property(GDBusConnection *conn, const gchar *sender,
+    const gchar *object_path, const gchar *interface_name, const gchar *property_name,
+    GError **error, gpointer user_data) {
+  mock_session *session = (mock_session *)user_data;
+  if (g_strcmp0(property_name, "Id") == 0) return g_variant_new_string(session->id);
+  if (g_strcmp0(property_name, "User") == 0) {
+    gchar user_path[64];
+    snprintf(user_path, sizeof(user_path), "/org/freedesktop/login1/user/_%u", session->user_id);
+    return g_variant_new("(uo)", session->user_id, user_path);
+  }
+  if (g_strcmp0(property_name, "Type") == 0) return g_variant_new_string(session->type);
+  if (g_strcmp0(property_name, "Display") == 0) return g_variant_new_string(session->display);
+  if (g_strcmp0(property_name, "Remote") == 0) return g_variant_new_boolean(FALSE);
+  if (g_strcmp0(property_name, "Active") == 0) return g_variant_new_boolean(session->active);
+  if (g_strcmp0(property_name, "LockedHint") == 0) return g_variant_new_boolean(session->locked);
+  if (g_strcmp0(property_name, "Leader") == 0) return g_variant_new_uint32(session->leader);
+  return NULL;
+}
+
+static const GDBusInterfaceVTable session_vtable = {NULL, handle_session_get_property, NULL, {0}};
+
+/// @brief Emit `PropertiesChanged` for a single boolean property of a session.
+void emit_session_property(GDBusConnection *conn, mock_session *session, const gchar *name,
+    bool value) {
+  GVariantBuilder changed;
+  g_variant_builder_init(&changed, G_VARIANT_TYPE("a{sv}"));
+  g_variant_builder_add(&changed, "{sv}", name, g_variant_new_boolean(value));
+  g_dbus_connection_emit_signal(conn, NULL, session->path, "org.freedesktop.DBus.Properties",
+      "PropertiesChanged",
+      g_variant_new("(sa{sv}as)", LOGIN_SESSION_INTERFACE, &changed, NULL), NULL);
+}
+
+void handle_login_method_call(GDBusConnection *conn, const gchar *sender,
+    const gchar *object_path, const gchar *interface_name, const gchar *method_name,
+    GVariant *parameters, GDBusMethodInvocation *invocation, gpointer user_data) {
+  if (g_strcmp0(method_name, "ListSessions") == 0) {
+    GVariantBuilder list;
+    g_variant_builder_init(&list, G_VARIANT_TYPE("a(susso)"));
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, sessions);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+      mock_session *session = (mock_session *)value;
+      g_variant_builder_add(
+          &list, "(susso)", session->id, session->user_id, "bench", "seat0", session->path);
+    }
+    g_dbus_method_invocation_return_value(invocation, g_variant_new("(a(susso))", &list));
+  } else if (g_strcmp0(method_name, "GetSession") == 0) {
+    const gchar *id = NULL;
+    g_variant_get(parameters, "(&s)", &id);
+    gchar *path = g_strdup_printf("%s/_%s", LOGIN_SESSION_PATH_NAMESPACE, id);
+    if (g_hash_table_contains(sessions, path)) {
+      g_dbus_method_invocation_return_value(invocation, g_variant_new("(o)", path));
+    } else {
+      g_dbus_method_invocation_return_dbus_error(
+          invocation, "org.freedesktop.login1.NoSuchSession", id);
+    }
+    g_free(path);
+  } else if (g_strcmp0(method_name, "AddSession") == 0) {
+    mock_session *session = g_new0(mock_session, 1);
+    g_variant_get(parameters, "(ussu)", &session->user_id, &session->type, &session->display,
+        &session->leader);
+    session->id = g_strdup_printf("%u", next_session_id++);
+    session->path = g_strdup_printf("%s/_%s", LOGIN_SESSION_PATH_NAMESPACE, session->id);
+    session->active = true;
+    session->registration_id = g_dbus_connection_register_object(conn, session->path,
+        g_dbus_node_info_lookup_interface(node_info, LOGIN_SESSION_INTERFACE), &session_vtable,
+        session, NULL, NULL);
+    g_hash_table_insert(sessions, session->path, session);
+    g_dbus_method_invocation_return_value(invocation, g_variant_new("(o)", session->path));
+    g_dbus_connection_emit_signal(conn, NULL, LOGIN_OBJECT_PATH, LOGIN_MANAGER_INTERFACE,
+        "SessionNew", g_variant_new("(so)", session->id, session->path), NULL);
+  } else {
+    const gchar *path = NULL;
+    gboolean flag = FALSE;
+    if (g_strcmp0(method_name, "RemoveSession") == 0) {
+      g_variant_get(parameters, "(&o)", &path);
+    } else {
+      g_variant_get(parameters, "(&ob)", &path, &flag);
+    }
+    mock_session *session = g_hash_table_lookup(sessions, path);
+    if (!session) {
+      g_dbus_method_invocation_return_dbus_error(
+          invocation, "org.freedesktop.login1.NoSuchSession", path);
+      return;
+    }
+    if (g_strcmp0(method_name, "RemoveSession") == 0) {
+      g_dbus_connection_unregister_object(conn, session->registration_id);
+      g_dbus_connection_emit_signal(conn, NULL, LOGIN_OBJECT_PATH, LOGIN_MANAGER_INTERFACE,
+          "SessionRemoved", g_variant_new("(so)", session->id, session->path), NULL);
+      g_hash_table_remove(sessions, path);
+    } else if (g_strcmp0(method_name, "SetLockedHint") == 0) {
+      session->locked = flag;
+      emit_session_property(conn, session, "LockedHint", flag);
+    } else {
+      session->active = flag;
+      emit_session_property(conn, session, "Active", flag);
+    }
+    g_dbus_method_invocation_return_value(invocation, NULL);
+  }
+}
+
+static const GDBusInterfaceVTable login_vtable = {handle_login_method_call, NULL, NULL, {0}};
+
+
+int main(int argc, char *argv[]) {
+  GError *error = NULL;
+  GDBusConnection *conn = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+  if (!conn) {
+    print_error("Failed to connect to system bus: %s\n", error ? error->message : "(null)");
+    return 1;
+  }
+  node_info = g_dbus_node_info_new_for_xml(LOGIN_XML, &error);
+  sessions = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, mock_session_free);
+  g_dbus_connection_register_object(conn, LOGIN_OBJECT_PATH,
+      g_dbus_node_info_lookup_interface(node_info, LOGIN_MANAGER_INTERFACE), &login_vtable, NULL,
+      NULL, NULL);
+  g_dbus_connection_register_object(conn, LOGIN_OBJECT_PATH,
+      g_dbus_node_info_lookup_interface(node_info, BENCH_LOGIN_INTERFACE), &login_vtable, NULL,
+      NULL, NULL);
+  GVariant *result = g_dbus_connection_call_sync(conn, "org.freedesktop.DBus",
+      "/org/freedesktop/DBus", "org.freedesktop.DBus", "RequestName",
+      g_variant_new("(su)", LOGIN_OBJECT_NAME, 0), NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+  if (!result) {
+    print_error("Failed to own %s: %s\n", LOGIN_OBJECT_NAME, error ? error->message : "(null)");
+    return 1;
+  }
+  g_variant_unref(result);
+
+  GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+  g_main_loop_run(loop);
+  return 0;
+}
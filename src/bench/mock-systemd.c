@@ -0,0 +1,166 @@
+#include <gio/gio.h>
+
+#include "common.h"
+
+// Mock of `org.freedesktop.systemd1` for the benchmark harness which runs the transient units
+// started by the login monitor as plain child processes.
+
+#define SYSTEMD_OBJECT_NAME "org.freedesktop.systemd1"
+#define SYSTEMD_OBJECT_PATH "/org/freedesktop/systemd1"
+#define SYSTEMD_MANAGER_INTERFACE "org.freedesktop.systemd1.Manager"
+#define BENCH_SYSTEMD_INTERFACE "org.keepassxc.UnlockBench.Systemd"
+
+static const gchar SYSTEMD_XML[] =
+    "<node>"
+    " <interface name='" SYSTEMD_MANAGER_INTERFACE "'>"
+    "  <method name='Subscribe'/>"
+    "  <method name='StartTransientUnit'>"
+    "   <arg name='name' type='s' direction='in'/><arg name='mode' type='s' direction='in'/>"
+    "   <arg name='properties' type='a(sv)' direction='in'/>"
+    "   <arg name='aux' type='a(sa(sv))' direction='in'/>"
+    "   <arg name='job' type='o' direction='out'/>"
+    "  </method>"
+    "  <signal name='JobRemoved'>"
+    "   <arg type='u'/><arg type='o'/><arg type='s'/><arg type='s'/>"
+    "  </signal>"
+    " </interface>"
+    " <interface name='" BENCH_SYSTEMD_INTERFACE "'>"
+    "  <method name='GetUnitCount'><arg name='count' type='u' direction='out'/></method>"
+    " </interface>"
+    "</node>";
+
+static GHashTable *units = NULL;    // map of running unit name to its `GSubprocess`
+static guint next_job_id = 1;
+
+/// @brief Holds a queued job which is completed from the main loop like systemd does
+typedef struct {
+  GDBusConnection *conn;    // connection on which the job was requested
+  guint32 id;               // ID of the job
+  gchar *path;              // object path of the job
+  gchar *unit_name;         // name of the unit being started
+  gchar *result;            // result of the job
+} mock_job;
+
+gboolean complete_job(gpointer user_data) {
+  mock_job *job = (mock_job *)user_data;
+  g_dbus_connection_emit_signal(job->conn, NULL, SYSTEMD_OBJECT_PATH, SYSTEMD_MANAGER_INTERFACE,
+      "JobRemoved", g_variant_new("(uoss)", job->id, job->path, job->unit_name, job->result),
+      NULL);
+  g_free(job->path);
+  g_free(job->unit_name);
+  g_free(job->result);
+  g_free(job);
+  return G_SOURCE_REMOVE;
+}
+
+/// @brief Forget a unit once its process exits, like `CollectMode=inactive-or-failed` does.
+void handle_unit_exit(GObject *source, GAsyncResult *res, gpointer user_data) {
+  gchar *unit_name = (gchar *)user_data;
+  g_subprocess_wait_finish(G_SUBPROCESS(source), res, NULL);
+  g_hash_table_remove(units, unit_name);
+  g_free(unit_name);
+}
+
+void handle_systemd_method_call(GDBusConnection *conn, const gchar *sender,
+    const gchar *object_path, const gchar *interface_name, const gchar *method_name,
+    GVariant *parameters, GDBusMethodInvocation *invocation, gpointer user_data) {
+  if (g_strcmp0(method_name, "Subscribe") == 0) {
+    g_dbus_method_invocation_return_value(invocation, NULL);
+    return;
+  } else if (g_strcmp0(method_name, "GetUnitCount") == 0) {
+    g_dbus_method_invocation_return_value(
+        invocation, g_variant_new("(u)", g_hash_table_size(units)));
+    return;
+  }
+  const gchar *unit_name = NULL;
+  GVariant *props = NULL;
+  g_variant_get(parameters, "(&s&s@a(sv)@a(sa(sv)))", &unit_name, NULL, &props, NULL);
+  if (g_hash_table_contains(units, unit_name)) {
+    g_dbus_method_invocation_return_dbus_error(
+        invocation, "org.freedesktop.systemd1.UnitExists", unit_name);
+    g_variant_unref(props);
+    return;
+  }
+
+  // run the first command of `ExecStart` with the given `Environment`
+  GSubprocessLauncher *launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_NONE);
+  gchar **argv = NULL;
+  GVariantIter iter;
+  const gchar *key = NULL;
+  GVariant *value = NULL;
+  g_variant_iter_init(&iter, props);
+  while (g_variant_iter_loop(&iter, "(&sv)", &key, &value)) {
+    if (g_strcmp0(key, "ExecStart") == 0 && !argv) {
+      GVariantIter *exec_iter = NULL;
+      g_variant_get(value, "a(sasb)", &exec_iter);
+      g_variant_iter_next(exec_iter, "(&s^asb)", NULL, &argv, NULL);
+      g_variant_iter_free(exec_iter);
+    } else if (g_strcmp0(key, "Environment") == 0) {
+      gchar **env = NULL;
+      g_variant_get(value, "^as", &env);
+      for (gchar **env_ptr = env; *env_ptr; env_ptr++) {
+        gchar *sep = strchr(*env_ptr, '=');
+        if (!sep) continue;
+        *sep = '\0';
+        g_subprocess_launcher_setenv(launcher, *env_ptr, sep + 1, TRUE);
+      }
+      g_strfreev(env);
+    }
+  }
+  g_variant_unref(props);
+
+  mock_job *job = g_new0(mock_job, 1);
+  job->conn = conn;
+  job->id = next_job_id++;
+  job->path = g_strdup_printf("%s/job/%u", SYSTEMD_OBJECT_PATH, job->id);
+  job->unit_name = g_strdup(unit_name);
+  GError *error = NULL;
+  GSubprocess *process =
+      argv ? g_subprocess_launcher_spawnv(launcher, (const gchar *const *)argv, &error) : NULL;
+  if (process) {
+    g_hash_table_insert(units, g_strdup(unit_name), process);
+    g_subprocess_wait_async(process, NULL, handle_unit_exit, g_strdup(unit_name));
+    job->result = g_strdup("done");
+  } else {
+    print_error("Failed to start '%s': %s\n", unit_name, error ? error->message : "(null)");
+    g_clear_error(&error);
+    job->result = g_strdup("failed");
+  }
+  g_strfreev(argv);
+  g_object_unref(launcher);
+  g_dbus_method_invocation_return_value(invocation, g_variant_new("(o)", job->path));
+  g_idle_add(complete_job, job);
+}
+
+static const GDBusInterfaceVTable systemd_vtable = {handle_systemd_method_call, NULL, NULL, {0}};
+
+
+int main(int argc, char *argv[]) {
+  GError *error = NULL;
+  GDBusConnection *conn = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+  if (!conn) {
+    print_error("Failed to connect to system bus: %s\n", error ? error->message : "(null)");
+    return 1;
+  }
+  GDBusNodeInfo *node_info = g_dbus_node_info_new_for_xml(SYSTEMD_XML, &error);
+  units = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+  g_dbus_connection_register_object(conn, SYSTEMD_OBJECT_PATH,
+      g_dbus_node_info_lookup_interface(node_info, SYSTEMD_MANAGER_INTERFACE), &systemd_vtable,
+      NULL, NULL, NULL);
+  g_dbus_connection_register_object(conn, SYSTEMD_OBJECT_PATH,
+      g_dbus_node_info_lookup_interface(node_info, BENCH_SYSTEMD_INTERFACE), &systemd_vtable,
+      NULL, NULL, NULL);
+  GVariant *result = g_dbus_connection_call_sync(conn, "org.freedesktop.DBus",
+      "/org/freedesktop/DBus", "org.freedesktop.DBus", "RequestName",
+      g_variant_new("(su)", SYSTEMD_OBJECT_NAME, 0), NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+      &error);
+  if (!result) {
+    print_error("Failed to own %s: %s\n", SYSTEMD_OBJECT_NAME, error ? error->message : "(null)");
+    return 1;
+  }
+  g_variant_unref(result);
+
+  GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+  g_main_loop_run(loop);
+  return 0;
+}
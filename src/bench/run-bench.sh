@@ -0,0 +1,257 @@
+#!/bin/bash
+
+set -e
+set -o pipefail
+
+SCRIPT="$(basename "${BASH_SOURCE[0]}")"
+BENCH_SRC_DIR="$(dirname "$(realpath "${BASH_SOURCE[0]}")")"
+
+function usage() {
+  echo
+  echo "Usage: $SCRIPT <BUILD_DIR>"
+  echo
+  echo "Measure the latency of auto-unlock after logins and screen unlocks using private D-Bus"
+  echo "daemons with mock logind, systemd and KeePassXC services"
+  echo
+  echo "Arguments:"
+  echo "  <BUILD_DIR>     directory having the bench builds of the binaries (from 'make bench')"
+  echo
+  echo "Environment variables:"
+  echo "  BENCH_ITERATIONS      number of logins and screen unlocks measured per mode (default: 50)"
+  echo "  BENCH_DBS             number of KDBX databases configured for auto-unlock (default: 4)"
+  echo "  BENCH_OPEN_DELAY_MS   time taken by the mock KeePassXC to open a database (default: 20)"
+  echo "  BENCH_CREDS_DELAY_MS  time taken by the systemd-creds stub to decrypt (default: 0)"
+  echo "  BENCH_LOCKED_MS       time the screen stays locked before each unlock (default: 10)"
+  echo "  BENCH_BUNDLE          set to 1 to also write the credential bundle of all the databases"
+  echo "  BENCH_STARTUPS        number of starts measured per program for its startup (default: 20)"
+  echo
+}
+
+if [ "$#" -ne 1 ]; then
+  usage
+  exit 1
+fi
+
+if [ $(id -u) -ne 0 ]; then
+  echo "This benchmark must be run as root since the binaries require it"
+  exit 1
+fi
+
+build_dir=$(realpath "$1")
+iterations="${BENCH_ITERATIONS:-50}"
+num_dbs="${BENCH_DBS:-4}"
+open_delay_ms="${BENCH_OPEN_DELAY_MS:-20}"
+startups="${BENCH_STARTUPS:-20}"
+user_id=$(id -u)
+display=:99
+run_dir=$build_dir/run
+conf_dir=$build_dir/etc/$user_id
+dbus_daemon=$(type -p dbus-daemon)
+
+if [ -z "$dbus_daemon" ]; then
+  echo "dbus-daemon is required to run the benchmark"
+  exit 1
+fi
+
+pids=()
+function cleanup() {
+  if [ "${#pids[@]}" -gt 0 ]; then
+    kill "${pids[@]}" 2>/dev/null || true
+    wait "${pids[@]}" 2>/dev/null || true
+  fi
+  pids=()
+}
+trap cleanup EXIT
+
+# start a private bus of given type listening on a unix socket
+function start_bus() {
+  local bus_type=$1 socket=$2
+  cat > "$run_dir/$bus_type.conf" << EOF
+<!DOCTYPE busconfig PUBLIC "-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN"
+ "http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd">
+<busconfig>
+  <type>$bus_type</type>
+  <listen>unix:path=$socket</listen>
+  <auth>EXTERNAL</auth>
+  <policy context="default">
+    <allow user="*"/>
+    <allow own="*"/>
+    <allow send_destination="*"/>
+    <allow receive_sender="*"/>
+  </policy>
+</busconfig>
+EOF
+  rm -f "$socket"
+  "$dbus_daemon" --config-file="$run_dir/$bus_type.conf" --nofork --nopidfile &
+  pids+=($!)
+  # wait for the bus to come up
+  for i in $(seq 100); do
+    [ -S "$socket" ] && return 0
+    sleep 0.05
+  done
+  echo "Timed out waiting for the $bus_type bus at $socket"
+  exit 1
+}
+
+# wait for a well-known name to be owned on the bus given by its address
+function wait_for_name() {
+  local address=$1 name=$2
+  for i in $(seq 100); do
+    if dbus-send --bus="$address" --print-reply --dest=org.freedesktop.DBus /org/freedesktop/DBus \
+        org.freedesktop.DBus.GetNameOwner string:"$name" >/dev/null 2>&1; then
+      return 0
+    fi
+    sleep 0.05
+  done
+  echo "Timed out waiting for $name on $address"
+  exit 1
+}
+
+# run the login and unlock scenarios against the given auto-unlock program already started, then
+# save the per-phase statistics published by the program on the system bus
+function run_scenarios() {
+  local mode=$1 stats_name=$2 scenario
+  echo
+  echo "== $mode =="
+  for scenario in login unlock; do
+    "$build_dir/bench-driver" $scenario "$iterations" "$num_dbs" "$user_id" "$display" |
+      sed "s/^/$mode /"
+  done
+  dbus-send --system --print-reply --dest="$stats_name" /org/keepassxc/Unlock/Stats \
+    org.freedesktop.DBus.Properties.GetAll string:org.keepassxc.Unlock.Stats \
+    > "$run_dir/$mode-stats.txt" 2>&1 || true
+}
+
+# print the size of a program
+function report_size() {
+  local path=$1
+  awk -v name="$(basename "$path")" -v size=$(stat -c %s "$path") \
+    'BEGIN { printf "%-38s size=%6d KiB\n", name, size / 1024 }'
+}
+
+# print the latencies of starting a program till it owns its statistics name on the system bus,
+# which covers loading its libraries, connecting to the bus and its initial calls; a failure is
+# only reported in the counts so that the remaining programs are still measured
+function report_startup() {
+  local name=$1 stats_name=$2
+  shift 2
+  { "$build_dir/bench-driver" startup "$startups" "$stats_name" "$@" || true; } |
+    awk -v name="$name" '{ printf "%-38s %s\n", name, $0 }'
+}
+
+# print the resident memory of a running program split into its private (anonymous) part and the
+# part mapped from files which is shared with the other processes using the same libraries
+function report_rss() {
+  local name=$1 pid=$2
+  awk -v name="$name" '/^(VmRSS|RssAnon|RssFile):/ { rss[$1] = $2 }
+    END { printf "%-38s rss=%6d KiB  anon=%6d KiB  file=%6d KiB\n", name, rss["VmRSS:"],
+      rss["RssAnon:"], rss["RssFile:"] }' /proc/$pid/status
+}
+
+# run a build of the login monitor through the scenarios and note its resident memory after them
+function run_login_monitor() {
+  local program=$1 mode=$2 pid
+  "$build_dir/$program" > "$run_dir/$mode.log" 2>&1 &
+  pid=$!
+  pids+=($pid)
+  sleep 0.5
+  run_scenarios $mode org.keepassxc.Unlock.LoginMonitor
+  rss_reports+=("$(report_rss $program $pid)")
+  kill $pid
+  wait $pid 2>/dev/null || true
+}
+
+rm -rf "$run_dir" "$build_dir/etc"
+mkdir -p "$run_dir" "$conf_dir"
+chmod 0700 "$build_dir/etc" "$conf_dir"
+
+# database configurations with base64 encoded passwords that are decoded by the systemd-creds stub
+for i in $(seq "$num_dbs"); do
+  conf_file=$conf_dir/bench$i.conf
+  echo "DB=$run_dir/bench$i.kdbx" > "$conf_file"
+  echo "KEY=" >> "$conf_file"
+  echo "PASSWORD:" >> "$conf_file"
+  echo -n "bench-password-$i" | base64 >> "$conf_file"
+done
+# optional credential bundle in the layout written by keepassxc-unlock-setup
+if [ "${BENCH_BUNDLE:-0}" = 1 ]; then
+  {
+    printf 'KXUB1\0'
+    for i in $(seq "$num_dbs"); do
+      printf '%s\0\0%s\0' "$run_dir/bench$i.kdbx" "bench-password-$i"
+    done
+  } | base64 > "$conf_dir/bundle.cred"
+fi
+sha512sum "$build_dir/mock-keepassxc" | awk '{ print $1 }' | tr -d '\n' \
+  > "$conf_dir/keepassxc.sha512"
+chmod 0400 "$conf_dir"/*
+
+system_socket=$run_dir/system-bus
+session_socket=$run_dir/session-bus-$user_id
+start_bus system "$system_socket"
+start_bus session "$session_socket"
+export DBUS_SYSTEM_BUS_ADDRESS=unix:path=$system_socket
+export DBUS_SESSION_BUS_ADDRESS=unix:path=$session_socket
+export PATH="$build_dir:$BENCH_SRC_DIR:$PATH"
+
+"$build_dir/mock-logind" &
+pids+=($!)
+# the unlock services started by the mock systemd log to its output
+"$build_dir/mock-systemd" > "$run_dir/unlock-services.log" 2>&1 &
+pids+=($!)
+DISPLAY=$display "$build_dir/mock-keepassxc" "$open_delay_ms" &
+pids+=($!)
+wait_for_name "$DBUS_SYSTEM_BUS_ADDRESS" org.freedesktop.login1
+wait_for_name "$DBUS_SYSTEM_BUS_ADDRESS" org.freedesktop.systemd1
+wait_for_name "$DBUS_SESSION_BUS_ADDRESS" org.keepassxc.KeePassXC.MainWindow
+
+echo "Running $iterations iteration(s) with $num_dbs database(s), open delay ${open_delay_ms}ms"
+echo "and decryption delay ${BENCH_CREDS_DELAY_MS:-0}ms; latencies are from the trigger till the"
+echo "last database is opened"
+
+# login monitor which starts a transient unlock service for every new session, also with the
+# sd-bus backend when that was built
+rss_reports=()
+run_login_monitor keepassxc-login-monitor login-monitor
+if [ -x "$build_dir/keepassxc-login-monitor-sdbus" ]; then
+  run_login_monitor keepassxc-login-monitor-sdbus login-monitor-sdbus
+fi
+
+# multi-user daemon which handles all the sessions in a single process
+"$build_dir/keepassxc-unlock" --daemon > "$run_dir/daemon.log" 2>&1 &
+daemon_pid=$!
+pids+=($daemon_pid)
+sleep 0.5
+run_scenarios daemon org.keepassxc.Unlock.Daemon
+rss_reports+=("$(report_rss "keepassxc-unlock --daemon" $daemon_pid)")
+kill $daemon_pid
+wait $daemon_pid 2>/dev/null || true
+
+# footprint of the builds where the RSS is taken after the scenarios so that it includes the
+# memory held for the sessions, and the daemon is representative of a keepassxc-unlock instance;
+# the static builds of `make all-static` are reported too when present
+static_programs=()
+for static_program in "$BENCH_SRC_DIR"/../keepassxc-*-"$(uname -m)"-static; do
+  [ -x "$static_program" ] && static_programs+=("$(realpath "$static_program")")
+done
+echo
+echo "== footprint =="
+for program in "$build_dir"/keepassxc-login-monitor* "$build_dir/keepassxc-unlock" \
+    "${static_programs[@]}"; do
+  report_size "$program"
+done
+for program in "$build_dir"/keepassxc-login-monitor* "${static_programs[@]}"; do
+  case "$(basename "$program")" in
+    keepassxc-login-monitor*)
+      report_startup "$(basename "$program")" org.keepassxc.Unlock.LoginMonitor "$program" ;;
+    keepassxc-unlock*)
+      report_startup "$(basename "$program") --daemon" org.keepassxc.Unlock.Daemon "$program" \
+        --daemon ;;
+  esac
+done
+report_startup "keepassxc-unlock --daemon" org.keepassxc.Unlock.Daemon \
+  "$build_dir/keepassxc-unlock" --daemon
+printf '%s\n' "${rss_reports[@]}"
+
+echo
+echo "Logs and statistics of the auto-unlock programs are in $run_dir"
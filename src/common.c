@@ -1,8 +1,17 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <glob.h>
+#include <poll.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "stats.h"
+
+#define ENVIRON_CHUNK_SIZE 4096    // size of the chunks in which a process environment is read
+#define MAX_ENV_NAME_SIZE 256      // longer names of environment variables are never matched
+#define CGROUP_FILE_SIZE 4096      // bytes read from /proc/<pid>/cgroup which is normally a line
 
 bool user_has_db_configs(guint32 user_id) {
   char conf_pattern[128];
@@ -17,42 +26,36 @@ bool user_has_db_configs(guint32 user_id) {
   return has_configs;
 }
 
-bool session_valid_for_unlock(GDBusConnection *connection, const gchar *session_path,
-    guint32 check_uid, guint32 *out_uid_ptr, bool *is_wayland_ptr, gchar **display_ptr) {
-  GError *error = NULL;
-  // get all properties of the session
-  GVariant *session_props = g_dbus_connection_call_sync(connection, LOGIN_OBJECT_NAME, session_path,
-      "org.freedesktop.DBus.Properties", "GetAll",
-      g_variant_new("(s)", "org.freedesktop.login1.Session"), NULL, G_DBUS_CALL_FLAGS_NONE,
-      DBUS_CALL_WAIT, NULL, &error);
-  if (!session_props) {
-    print_error(
-        "Failed to get properties for '%s': %s\n", session_path, error ? error->message : "(null)");
-    g_clear_error(&error);
-    return false;
-  }
-
-  // parse the properties to check if the session is valid
+/// @brief Parse the properties of a session and check if auto-unlock can be attempted for it
+///        (see `session_valid_for_unlock()`) except for the check of the owner.
+/// @param session_props result of `GetAll` call on `org.freedesktop.login1.Session` interface
+/// @param uid_ptr pointer to `guint32` which is filled with session owner's user ID
+/// @param is_wayland_ptr pointer to `bool` which (if non-NULL) is filled with `true` when session
+///                       type is `wayland` else with `false` when it is `x11`
+/// @param display_ptr pointer to `gchar*` string that is filled with the value of `Display`
+///                    property if non-NULL; this should be released with `g_free()` after use
+/// @param id_ptr pointer to `gchar*` string that is filled with the value of `Id` property if
+///               non-NULL; this should be released with `g_free()` after use
+/// @param leader_ptr pointer to `guint32` which (if non-NULL) is filled with the `Leader` property
+/// @return `true` if auto-unlock can be attempted for the session else `false`
+bool parse_session_properties(GVariant *session_props, guint32 *uid_ptr, bool *is_wayland_ptr,
+    gchar **display_ptr, gchar **id_ptr, guint32 *leader_ptr) {
   GVariantIter *iter = NULL;
   g_variant_get(session_props, "(a{sv})", &iter);
 
-  bool user_match = false, has_supported_type = false, is_remote = false, is_active = false;
+  bool has_user = false, has_supported_type = false, is_remote = false, is_active = false;
   const char *key = NULL;
   GVariant *value = NULL;
   while (g_variant_iter_loop(iter, "{&sv}", &key, &value)) {
     if (g_strcmp0(key, "User") == 0) {
-      user_match = true;
-      guint32 user_id = 0;
-      g_variant_get(value, "(uo)", &user_id, NULL);
-      if (out_uid_ptr) {
-        *out_uid_ptr = user_id;
-      } else if (check_uid != user_id) {
-        print_error("Session not valid due to mismatch in given user ID %u from actual owner %u\n",
-            check_uid, user_id);
-        user_match = false;
-      }
+      has_user = true;
+      g_variant_get(value, "(uo)", uid_ptr, NULL);
     } else if (g_strcmp0(key, "Display") == 0) {
       if (display_ptr) g_variant_get(value, "s", display_ptr);
+    } else if (g_strcmp0(key, "Id") == 0) {
+      if (id_ptr) g_variant_get(value, "s", id_ptr);
+    } else if (g_strcmp0(key, "Leader") == 0) {
+      if (leader_ptr) *leader_ptr = g_variant_get_uint32(value);
     } else if (g_strcmp0(key, "Remote") == 0) {
       is_remote = g_variant_get_boolean(value);
     } else if (g_strcmp0(key, "Type") == 0) {
@@ -65,43 +68,252 @@ bool session_valid_for_unlock(GDBusConnection *connection, const gchar *session_
     }
   }
   g_variant_iter_free(iter);
-  g_variant_unref(session_props);
 
   // a session is a target for auto-unlock if it is of a supported type, not remote, and active
-  if (user_match && has_supported_type && !is_remote && is_active) {
+  if (has_user && has_supported_type && !is_remote && is_active) {
     return true;
   } else {
-    if (display_ptr && *display_ptr) g_free(*display_ptr);
+    if (display_ptr && *display_ptr) {
+      g_free(*display_ptr);
+      *display_ptr = NULL;
+    }
+    if (id_ptr) g_clear_pointer(id_ptr, g_free);
     return false;
   }
 }
 
-gchar *get_process_env_var(guint32 pid, const char *env_var) {
+bool session_valid_for_unlock(dbus_conn *connection, const gchar *session_path,
+    guint32 check_uid, guint32 *out_uid_ptr, bool *is_wayland_ptr, gchar **display_ptr,
+    gchar **id_ptr, guint32 *leader_ptr) {
+  gchar *error_message = NULL;
+  // get all properties of the session
+  GVariant *session_props = dbus_call_sync(connection, LOGIN_OBJECT_NAME, session_path,
+      "org.freedesktop.DBus.Properties", "GetAll",
+      g_variant_new("(s)", LOGIN_SESSION_INTERFACE), "(a{sv})", LOGIN_CALL_WAIT, &error_message);
+  if (!session_props) {
+    print_error("Failed to get properties for '%s': %s\n", session_path, error_message);
+    g_free(error_message);
+    return false;
+  }
+
+  // parse the properties to check if the session is valid
+  guint32 user_id = 0;
+  bool valid = parse_session_properties(
+      session_props, &user_id, is_wayland_ptr, display_ptr, id_ptr, leader_ptr);
+  g_variant_unref(session_props);
+  if (valid) {
+    if (out_uid_ptr) {
+      *out_uid_ptr = user_id;
+    } else if (check_uid != user_id) {
+      print_error("Session not valid due to mismatch in given user ID %u from actual owner %u\n",
+          check_uid, user_id);
+      if (display_ptr) g_clear_pointer(display_ptr, g_free);
+      if (id_ptr) g_clear_pointer(id_ptr, g_free);
+      valid = false;
+    }
+  }
+  return valid;
+}
+
+/// @brief Holds the `user_data` passed to `handle_session_properties_reply` callback
+typedef struct {
+  gchar *session_path;                // path of the session being checked
+  session_check_callback callback;    // the callback to be invoked with the result
+  gpointer user_data;                 // custom user data passed through to `callback`
+  gint64 start_time;                  // monotonic time in microseconds when the check started
+} session_check_request;
+
+/// @brief Callback for completion of the asynchronous `GetAll` call on a session.
+/// @param session_props the properties of the session, or NULL if the call failed
+/// @param error_name D-Bus name of the error if the call failed (ignored)
+/// @param error_message message of the error if the call failed
+/// @param user_data pointer to the `session_check_request`
+void handle_session_properties_reply(GVariant *session_props, const char *error_name,
+    const char *error_message, gpointer user_data) {
+  session_check_request *request = (session_check_request *)user_data;
+  stats_record("session_check", request->start_time, session_props != NULL);
+  guint32 user_id = 0, leader_pid = 0;
+  bool valid = false, is_wayland = false;
+  gchar *display = NULL, *session_id = NULL;
+  if (session_props) {
+    valid = parse_session_properties(
+        session_props, &user_id, &is_wayland, &display, &session_id, &leader_pid);
+  } else {
+    print_error("Failed to get properties for '%s': %s\n", request->session_path, error_message);
+  }
+  request->callback(request->session_path, valid, user_id, is_wayland, display, session_id,
+      leader_pid, request->user_data);
+  g_free(display);
+  g_free(session_id);
+  g_free(request->session_path);
+  g_free(request);
+}
+
+void session_valid_for_unlock_async(dbus_conn *connection, const gchar *session_path,
+    session_check_callback callback, gpointer user_data) {
+  session_check_request *request = g_new(session_check_request, 1);
+  request->session_path = g_strdup(session_path);
+  request->callback = callback;
+  request->user_data = user_data;
+  request->start_time = g_get_monotonic_time();
+  dbus_call(connection, LOGIN_OBJECT_NAME, session_path, "org.freedesktop.DBus.Properties",
+      "GetAll", g_variant_new("(s)", LOGIN_SESSION_INTERFACE), "(a{sv})", LOGIN_CALL_WAIT,
+      handle_session_properties_reply, request);
+}
+
+int get_env_setting(const char *env_var, int default_value, int min_value, int max_value) {
+  const char *value = getenv(env_var);
+  if (!value || *value == '\0') return default_value;
+  char *value_end = NULL;
+  long result = strtol(value, &value_end, 10);
+  if (*value_end != '\0') {
+    print_error("Ignoring invalid value '%s' for %s\n", value, env_var);
+    return default_value;
+  }
+  return (int)CLAMP(result, min_value, max_value);
+}
+
+bool get_process_env_vars(guint32 pid, const char *const *env_vars, gchar **values) {
+  guint num_vars = g_strv_length((gchar **)env_vars);
+  for (guint i = 0; i < num_vars; i++) values[i] = NULL;
   gchar env_file[128];
   snprintf(env_file, sizeof(env_file), "/proc/%u/environ", pid);
+  int fd = open(env_file, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    print_error("\033[1;33mFailed to open file '%s': \033[00m", env_file);
+    perror(NULL);
+    return false;
+  }
 
-  // since the size of initial process environment is limited to ARG_MAX, its safe to read the
-  // entire file in one go
-  gchar *env = NULL;
-  gsize env_len = 0;
-  GError *error = NULL;
-  if (!g_file_get_contents(env_file, &env, &env_len, &error)) {
-    print_error("Failed to read file '%s': %s\n", env_file, error ? error->message : "(null)");
-    g_clear_error(&error);
-    return NULL;
+  // strings are null separated in /proc/<pid>/environ and can span the chunks that are read, so
+  // the name of the current string is accumulated till its '=' is seen, and then its value is
+  // either copied (if the name is one of `env_vars`) or skipped till the terminating null
+  char buffer[ENVIRON_CHUNK_SIZE], name[MAX_ENV_NAME_SIZE];
+  size_t name_len = 0;
+  bool skipping = false;
+  int matched = -1;    // index in `env_vars` of the current string, or -1 if not matched (yet)
+  GString *value = NULL;
+  guint num_found = 0;
+  ssize_t len = 0;
+  while (num_found < num_vars && (len = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (len == -1) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    for (char *ptr = buffer, *end = buffer + len; ptr < end && num_found < num_vars;) {
+      char *terminator = memchr(ptr, '\0', end - ptr);
+      char *part_end = terminator ? terminator : end;
+      if (matched != -1) {
+        g_string_append_len(value, ptr, part_end - ptr);
+      } else if (!skipping) {
+        char *separator = memchr(ptr, '=', part_end - ptr);
+        size_t name_part_len = (separator ? separator : part_end) - ptr;
+        if (name_len + name_part_len >= sizeof(name)) {
+          skipping = true;
+        } else {
+          memcpy(name + name_len, ptr, name_part_len);
+          name_len += name_part_len;
+          if (separator) {
+            name[name_len] = '\0';
+            // the first occurrence of a variable wins like in `getenv()`
+            for (guint i = 0; i < num_vars && matched == -1; i++) {
+              if (!values[i] && strcmp(name, env_vars[i]) == 0) matched = (int)i;
+            }
+            if (matched != -1) {
+              value = g_string_new_len(separator + 1, part_end - separator - 1);
+            } else {
+              skipping = true;
+            }
+          }
+        }
+      }
+      if (!terminator) break;
+      // end of the current string
+      if (matched != -1) {
+        values[matched] = g_string_free(value, FALSE);
+        num_found++;
+        matched = -1;
+      }
+      name_len = 0;
+      skipping = false;
+      ptr = terminator + 1;
+    }
   }
-  // strings are null separated in /proc/<pid>/environ, so use strlen to skip over
-  size_t var_len = strlen(env_var);
-  gchar *env_ptr = env, *env_end = env + env_len, *var_value = NULL;
-  while (env_ptr < env_end) {
-    size_t current_len = strlen(env_ptr);
-    if (current_len > var_len && strncmp(env_ptr, env_var, var_len) == 0 &&
-        env_ptr[var_len] == '=') {
-      var_value = g_strndup(env_ptr + var_len + 1, current_len - var_len - 1);
+  if (len == -1) {
+    print_error("\033[1;33mFailed to read file '%s': \033[00m", env_file);
+    perror(NULL);
+  }
+  close(fd);
+  // the last string may lack the terminating null
+  if (matched != -1) values[matched] = g_string_free(value, FALSE);
+  if (len == -1) {
+    for (guint i = 0; i < num_vars; i++) g_clear_pointer(&values[i], g_free);
+    return false;
+  }
+  return true;
+}
+
+gchar *get_process_session_id(guint32 pid, guint32 *uid_ptr) {
+  gchar cgroup_file[128];
+  snprintf(cgroup_file, sizeof(cgroup_file), "/proc/%u/cgroup", pid);
+  int fd = open(cgroup_file, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return NULL;
+  char buffer[CGROUP_FILE_SIZE];
+  size_t total = 0;
+  ssize_t len;
+  while (total < sizeof(buffer) - 1 &&
+         (len = read(fd, buffer + total, sizeof(buffer) - 1 - total)) != 0) {
+    if (len == -1) {
+      if (errno == EINTR) continue;
       break;
     }
-    env_ptr += current_len + 1;
+    total += (size_t)len;
   }
-  g_free(env);
-  return var_value;
+  close(fd);
+  buffer[total] = '\0';
+
+  // each line is `<hierarchy>:<controllers>:<path>` where logind places the processes of a
+  // session in `/user.slice/user-<uid>.slice/session-<id>.scope` (or its children) of the unified
+  // or `name=systemd` ones; the scope is matched only right under the slice of the user since the
+  // user can create cgroups of any name in the sub-trees delegated to it (like `user@.service`)
+  gchar *session_id = NULL;
+  gchar **lines = g_strsplit(buffer, "\n", -1);
+  for (gchar **line = lines; *line && !session_id; line++) {
+    const char *path = strchr(*line, ':');
+    if (path) path = strchr(path + 1, ':');
+    if (!path || !g_str_has_prefix(path + 1, "/user.slice/user-")) continue;
+    const char *uid_str = path + 1 + strlen("/user.slice/user-");
+    gchar *uid_end = NULL;
+    guint64 uid = g_ascii_strtoull(uid_str, &uid_end, 10);
+    if (!g_ascii_isdigit(*uid_str) || uid > G_MAXUINT32 ||
+        !g_str_has_prefix(uid_end, ".slice/session-")) {
+      continue;
+    }
+    const char *scope = uid_end + strlen(".slice/session-");
+    const char *scope_end = strchr(scope, '/');
+    size_t scope_len = scope_end ? (size_t)(scope_end - scope) : strlen(scope);
+    if (scope_len > strlen(".scope") &&
+        strncmp(scope + scope_len - strlen(".scope"), ".scope", strlen(".scope")) == 0) {
+      session_id = g_strndup(scope, scope_len - strlen(".scope"));
+      *uid_ptr = (guint32)uid;
+    }
+  }
+  g_strfreev(lines);
+  return session_id;
+}
+
+int open_process_fd(guint32 pid) {
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, (pid_t)pid, 0);
+#else
+  return -1;
+#endif
+}
+
+bool process_fd_alive(int pidfd) {
+  // a pidfd becomes readable once the process exits
+  struct pollfd poll_fd = {.fd = pidfd, .events = POLLIN, .revents = 0};
+  int ready;
+  while ((ready = poll(&poll_fd, 1, 0)) == -1 && errno == EINTR) {}
+  return ready == 0;
 }
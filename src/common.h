@@ -7,16 +7,25 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <gio/gio.h>
+#include "dbus.h"
 
 #define PRODUCT_VERSION "0.9.3"
 
+// the paths below can be overridden at build time, e.g. by the `bench` target of the Makefile
+#ifndef KP_CONFIG_DIR
 #define KP_CONFIG_DIR "/etc/keepassxc-unlock"
+#endif
+#ifndef SESSION_BUS_ADDRESS_FORMAT
+#define SESSION_BUS_ADDRESS_FORMAT "unix:path=/run/user/%u/bus"    // formatted with the user ID
+#endif
 
 #define LOGIN_OBJECT_NAME "org.freedesktop.login1"
 #define LOGIN_OBJECT_PATH "/org/freedesktop/login1"
 #define LOGIN_MANAGER_INTERFACE "org.freedesktop.login1.Manager"
+#define LOGIN_SESSION_INTERFACE "org.freedesktop.login1.Session"
+#define LOGIN_SESSION_PATH_NAMESPACE "/org/freedesktop/login1/session"
 #define DBUS_CALL_WAIT 60000    // in milliseconds
+#define LOGIN_CALL_WAIT 10000    // deadline for queries to logind in milliseconds
 
 #define print_info(...)                                                                            \
   {                                                                                                \
@@ -37,7 +46,7 @@ extern bool user_has_db_configs(guint32 user_id);
 /// @brief Check if auto-unlock should be attempted for a session with given path
 ///        (of the form `/org/freedesktop/login1/session/...`). The checks performed include
 ///        the type which must be `x11` or `wayland`, should be active and should not be remote.
-/// @param connection the `GBusConnection` object for the system D-Bus
+/// @param connection the connection to the system D-Bus
 /// @param session_path path of the session to check
 /// @param check_uid check this against the session owner's numeric ID if `out_uid_ptr` is NULL
 /// @param out_uid_ptr pointer to `guint32` which is filled with session owner's user ID if non-NULL
@@ -45,16 +54,79 @@ extern bool user_has_db_configs(guint32 user_id);
 ///                       type is `wayland` else with `false` when it is `x11`
 /// @param display_ptr pointer to `gchar*` string that is filled with the value of `Display`
 ///                    property if non-NULL; this should be released with `g_free()` after use
+/// @param id_ptr pointer to `gchar*` string that is filled with the value of `Id` property if
+///               non-NULL; this should be released with `g_free()` after use
+/// @param leader_ptr pointer to `guint32` which (if non-NULL) is filled with the process ID of the
+///                   session leader from the `Leader` property
 /// @return `true` if auto-unlock can be attempted for the session else `false`
-extern bool session_valid_for_unlock(GDBusConnection *connection, const gchar *session_path,
-    guint32 check_uid, guint32 *out_uid_ptr, bool *is_wayland_ptr, gchar **display_ptr);
+extern bool session_valid_for_unlock(dbus_conn *connection, const gchar *session_path,
+    guint32 check_uid, guint32 *out_uid_ptr, bool *is_wayland_ptr, gchar **display_ptr,
+    gchar **id_ptr, guint32 *leader_ptr);
 
-/// @brief Get value of an environment variable for a given process.
+/// @brief Callback invoked with the result of `session_valid_for_unlock_async()`.
+/// @param session_path path of the session that was checked
+/// @param valid `true` if auto-unlock can be attempted for the session else `false`
+/// @param user_id numeric ID of the session owner (valid only if `valid` is `true`)
+/// @param is_wayland `true` if the session type is `wayland` else `false` if it is `x11`
+/// @param display value of the `Display` property of the session which is owned by the caller
+/// @param session_id value of the `Id` property of the session which is owned by the caller
+/// @param leader_pid process ID of the session leader from the `Leader` property, or 0 if unknown
+/// @param user_data the `user_data` passed to `session_valid_for_unlock_async()`
+typedef void (*session_check_callback)(const gchar *session_path, bool valid, guint32 user_id,
+    bool is_wayland, const gchar *display, const gchar *session_id, guint32 leader_pid,
+    gpointer user_data);
+
+/// @brief Asynchronous version of `session_valid_for_unlock()` which does not block the main loop
+///        while logind is queried. The session owner is returned to the callback for checking.
+/// @param connection the connection to the system D-Bus
+/// @param session_path path of the session to check
+/// @param callback the function to be invoked from the main loop with the result
+/// @param user_data custom user data passed through to `callback`
+extern void session_valid_for_unlock_async(dbus_conn *connection, const gchar *session_path,
+    session_check_callback callback, gpointer user_data);
+
+/// @brief Get an integer tunable from the environment of this process (normally set using
+///        `Environment=` in the systemd service).
+/// @param env_var name of the environment variable
+/// @param default_value value to be returned if the variable is not set or is not a valid integer
+/// @param min_value minimum allowed value, smaller values are clamped to this
+/// @param max_value maximum allowed value, larger values are clamped to this
+/// @return value of the environment variable clamped to [`min_value`, `max_value`], else
+///         `default_value` if absent or invalid
+extern int get_env_setting(const char *env_var, int default_value, int min_value, int max_value);
+
+/// @brief Get the values of a set of environment variables of a given process in a single read
+///        through `/proc/<pid>/environ` using a fixed-size buffer. Only the values of the given
+///        variables are copied, and the read stops as soon as all of them have been found.
 /// @param pid the ID of the process
-/// @param env_var the environment variable to be read
-/// @return value of the environment variable which should be released with `g_free()` after use,
-///         else NULL in case of an error or if the variable was not found
-extern gchar *get_process_env_var(guint32 pid, const char *env_var);
+/// @param env_vars NULL terminated array of the names of the environment variables to be read
+/// @param values array having as many elements as `env_vars` that is filled with the values of the
+///               corresponding variables, or NULL for the ones not found; each non-NULL value
+///               should be released with `g_free()` after use
+/// @return `true` if the environment of the process was read else `false` in case of an error
+///         (which is logged) in which case all of `values` are NULL
+extern bool get_process_env_vars(guint32 pid, const char *const *env_vars, gchar **values);
+
+/// @brief Get the ID of the logind session of a process from its
+///        `/user.slice/user-<uid>.slice/session-<id>.scope` cgroup in `/proc/<pid>/cgroup` which
+///        takes a single small read.
+/// @param pid the ID of the process
+/// @param uid_ptr pointer to `guint32` that is filled with the user ID of the slice of the session
+/// @return the session ID which should be released with `g_free()` after use, else NULL if the
+///         process is not in any session (e.g. started by the user's service manager) or is gone
+extern gchar *get_process_session_id(guint32 pid, guint32 *uid_ptr);
+
+/// @brief Open a pidfd for a process using `pidfd_open()` which keeps referring to the same
+///        process even if its ID gets reused after it exits.
+/// @param pid the ID of the process
+/// @return the close-on-exec pidfd that should be closed after use, or -1 if the process does not
+///         exist or the kernel does not support pidfds
+extern int open_process_fd(guint32 pid);
+
+/// @brief Check if the process referred to by a pidfd is still running.
+/// @param pidfd the pidfd of the process
+/// @return `true` if the process has not exited else `false`
+extern bool process_fd_alive(int pidfd);
 
 
 #endif /* !_KEEPASSXC_UNLOCK_COMMON_H_ */
@@ -0,0 +1,407 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <glib-unix.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "secrets.h"
+
+#define CONF_SUFFIX ".conf"
+#define INOTIFY_BUFFER_SIZE 4096
+#define MAX_DB_PRIORITY 1000    // priorities of the databases are clamped to +/- this
+#define STALE_CONFIG_RELOAD_SECS 10    // minimum interval between reads of an unwatched directory
+#define CONFIG_WATCH_EVENTS                                                                        \
+  (IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |              \
+      IN_DELETE_SELF | IN_MOVE_SELF)
+
+// all the configuration directories are watched by a single inotify instance which is created on
+// first use and kept for the life of the process, since the number of instances is limited per
+// user (`fs.inotify.max_user_instances`) and root shares the limit with systemd and others
+static int config_inotify_fd = -1;
+static GHashTable *config_watches = NULL;    // map of the watch descriptor to its `user_config`
+
+db_config *db_config_ref(db_config *config) {
+  return g_rc_box_acquire(config);
+}
+
+/// @brief Release the fields of the `db_config` when its last reference is released.
+void db_config_clear(gpointer data) {
+  db_config *config = (db_config *)data;
+  g_free(config->name);
+  g_free(config->kdbx_file);
+  g_free(config->key_file);
+  g_free(config->encrypted_passwd);
+}
+
+void db_config_unref(db_config *config) {
+  g_rc_box_release_full(config, db_config_clear);
+}
+
+/// @brief Open a file in the configuration directory for reading.
+/// @param config pointer to the `user_config`
+/// @param file_name name of the file in the configuration directory
+/// @return the opened `FILE` else NULL if it could not be opened
+FILE *open_config_file(user_config *config, const char *file_name) {
+  int fd = openat(config->dir_fd, file_name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return NULL;
+  FILE *file = fdopen(fd, "r");
+  if (!file) close(fd);
+  return file;
+}
+
+/// @brief Parse a KDBX database configuration file.
+/// @param config pointer to the `user_config`
+/// @param file_name name of the configuration file (`<name>.conf`)
+/// @return a new `db_config` else NULL if the file is missing or invalid
+db_config *parse_db_config(user_config *config, const char *file_name) {
+  FILE *file = open_config_file(config, file_name);
+  if (!file) return NULL;
+
+  char line[PATH_MAX];
+  char kdbx_file[PATH_MAX] = {0};
+  char key_file[PATH_MAX] = {0};
+  gint64 priority = 0;
+  // holds the encrypted password which follows the line having PASSWORD:
+  GString *encrypted_passwd = g_string_new(NULL);
+  while (fgets(line, sizeof(line), file)) {
+    if (strncmp(line, "DB=", 3) == 0) {
+      strncpy(kdbx_file, line + 3, sizeof(kdbx_file) - 1);
+      kdbx_file[strcspn(kdbx_file, "\n")] = '\0';
+    } else if (strncmp(line, "KEY=", 4) == 0) {
+      strncpy(key_file, line + 4, sizeof(key_file) - 1);
+      key_file[strcspn(key_file, "\n")] = '\0';
+    } else if (strncmp(line, "PRIORITY=", 9) == 0) {
+      priority = CLAMP(g_ascii_strtoll(line + 9, NULL, 10), -MAX_DB_PRIORITY, MAX_DB_PRIORITY);
+    } else if (strncmp(line, "PASSWORD:", 9) != 0) {
+      // password starts after the line having PASSWORD:
+      do {
+        g_string_append(encrypted_passwd, line);
+      } while (fgets(line, sizeof(line), file));
+      break;
+    }
+  }
+  fclose(file);
+
+  if (*kdbx_file == '\0' || encrypted_passwd->len == 0) {
+    print_error("Skipping invalid KDBX unlock configuration file '%s/%s'\n", config->conf_dir,
+        file_name);
+    g_string_free(encrypted_passwd, TRUE);
+    return NULL;
+  }
+  db_config *db = g_rc_box_new0(db_config);
+  db->name = g_strndup(file_name, strlen(file_name) - strlen(CONF_SUFFIX));
+  db->kdbx_file = g_strdup(kdbx_file);
+  db->key_file = g_strdup(key_file);
+  db->encrypted_passwd = g_string_free(encrypted_passwd, FALSE);
+  db->priority = (int)priority;
+  return db;
+}
+
+/// @brief Check if two parsed KDBX database configurations have the same contents.
+/// @param a pointer to the first `db_config`, or NULL
+/// @param b pointer to the second `db_config`, or NULL
+/// @return `true` if both are NULL or have the same contents else `false`
+bool db_config_equal(const db_config *a, const db_config *b) {
+  if (!a || !b) return a == b;
+  return a->priority == b->priority && g_strcmp0(a->kdbx_file, b->kdbx_file) == 0 &&
+         g_strcmp0(a->key_file, b->key_file) == 0 &&
+         g_strcmp0(a->encrypted_passwd, b->encrypted_passwd) == 0;
+}
+
+/// @brief Replace a string held by the `user_config` only if its contents changed, so that the
+///        pointers returned earlier by the `user_config_get_*` functions stay valid otherwise.
+/// @param field pointer to the string field of the `user_config`
+/// @param value the new value which is taken over by this function, or NULL
+/// @return `true` if the value changed else `false`
+bool update_config_string(gchar **field, gchar *value) {
+  if (g_strcmp0(*field, value) == 0) {
+    g_free(value);
+    return false;
+  }
+  g_free(*field);
+  *field = value;
+  return true;
+}
+
+/// @brief Read the single line of a configuration file holding a recorded digest of KeePassXC.
+/// @param config pointer to the `user_config`
+/// @param file_name name of the file in the configuration directory
+/// @return the line without its terminating newline which should be released with `g_free()`,
+///         or NULL if the file is missing or empty
+gchar *load_kp_digest(user_config *config, const char *file_name) {
+  FILE *file = open_config_file(config, file_name);
+  if (!file) return NULL;
+  // the file is expected to have only one line, so replace terminating newline (if any)
+  char digest[256];
+  gchar *result = NULL;
+  if (fgets(digest, sizeof(digest), file)) {
+    digest[strcspn(digest, "\n")] = '\0';
+    result = g_strdup(digest);
+  }
+  fclose(file);
+  return result;
+}
+
+/// @brief Reload the encrypted credential bundle of the user.
+/// @param config pointer to the `user_config`
+/// @return `true` if the bundle changed (including its addition or removal) else `false`
+bool load_bundle(user_config *config) {
+  FILE *file = open_config_file(config, BUNDLE_FILE_NAME);
+  if (!file) return update_config_string(&config->encrypted_bundle, NULL);
+  GString *encrypted_bundle = g_string_new(NULL);
+  char buffer[4096];
+  size_t len;
+  while ((len = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    g_string_append_len(encrypted_bundle, buffer, (gssize)len);
+  }
+  fclose(file);
+  if (encrypted_bundle->len == 0) {
+    g_string_free(encrypted_bundle, TRUE);
+    return update_config_string(&config->encrypted_bundle, NULL);
+  }
+  return update_config_string(&config->encrypted_bundle, g_string_free(encrypted_bundle, FALSE));
+}
+
+/// @brief Reload a single file of the configuration directory after a change. The cached secrets
+///        are wiped only if the contents actually changed, since a file may be rewritten as is.
+/// @param config pointer to the `user_config`
+/// @param file_name name of the changed file
+void reload_config_file(user_config *config, const char *file_name) {
+  if (g_strcmp0(file_name, KP_SHA512_FILE_NAME) == 0) {
+    update_config_string(&config->kp_sha512, load_kp_digest(config, KP_SHA512_FILE_NAME));
+  } else if (g_strcmp0(file_name, KP_VERITY_FILE_NAME) == 0) {
+    update_config_string(&config->kp_verity, load_kp_digest(config, KP_VERITY_FILE_NAME));
+  } else if (g_strcmp0(file_name, BUNDLE_FILE_NAME) == 0) {
+    // the cached secrets may have come from the previous bundle
+    if (load_bundle(config)) secret_cache_wipe(config->user_id, NULL);
+  } else if (g_str_has_suffix(file_name, CONF_SUFFIX) && strlen(file_name) > strlen(CONF_SUFFIX)) {
+    gchar *name = g_strndup(file_name, strlen(file_name) - strlen(CONF_SUFFIX));
+    db_config *db = parse_db_config(config, file_name);
+    if (db_config_equal(db, g_hash_table_lookup(config->dbs, name))) {
+      if (db) db_config_unref(db);
+    } else {
+      // a secret cached for the previous contents of the file must not outlive them
+      secret_cache_wipe(config->user_id, name);
+      if (db) {
+        g_hash_table_replace(config->dbs, db->name, db);
+      } else {
+        g_hash_table_remove(config->dbs, name);
+      }
+    }
+    g_free(name);
+  }
+}
+
+gboolean handle_config_dir_change(gint fd, GIOCondition condition, gpointer user_data);
+
+/// @brief Start watching the configuration directory using the shared inotify instance.
+/// @param config pointer to the `user_config`
+/// @return `true` if the directory is being watched else `false` (which is logged)
+bool watch_config_dir(user_config *config) {
+  if (config_inotify_fd == -1) {
+    config_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (config_inotify_fd == -1) {
+      print_error("\033[1;33mFailed to create inotify instance: \033[00m");
+      perror(NULL);
+      return false;
+    }
+    config_watches = g_hash_table_new(NULL, NULL);
+    g_unix_fd_add(config_inotify_fd, G_IO_IN, handle_config_dir_change, NULL);
+  }
+  config->watch_wd = inotify_add_watch(config_inotify_fd, config->conf_dir, CONFIG_WATCH_EVENTS);
+  if (config->watch_wd == -1) {
+    print_error("\033[1;33mFailed to watch '%s' for changes: \033[00m", config->conf_dir);
+    perror(NULL);
+    return false;
+  }
+  g_hash_table_insert(config_watches, GINT_TO_POINTER(config->watch_wd), config);
+  return true;
+}
+
+/// @brief Close the directory descriptor of the `user_config` and remove its watch, if any.
+/// @param config pointer to the `user_config`
+void close_config_dir(user_config *config) {
+  if (config->watch_wd != -1) {
+    g_hash_table_remove(config_watches, GINT_TO_POINTER(config->watch_wd));
+    // this fails harmlessly if the kernel has dropped the watch already (e.g. directory deleted)
+    inotify_rm_watch(config_inotify_fd, config->watch_wd);
+    config->watch_wd = -1;
+  }
+  if (config->dir_fd != -1) close(config->dir_fd);
+  config->dir_fd = -1;
+}
+
+/// @brief Parse all the files of the configuration directory, and drop the databases whose files
+///        are gone. Like for the changes reported by inotify, only the changed files wipe secrets.
+/// @param config pointer to the `user_config`
+void read_config_dir(user_config *config) {
+  // the files having fixed names are reloaded even if missing, so that removed ones are cleared
+  reload_config_file(config, KP_SHA512_FILE_NAME);
+  reload_config_file(config, KP_VERITY_FILE_NAME);
+  reload_config_file(config, BUNDLE_FILE_NAME);
+
+  // names of the configuration files of the currently loaded databases that are not found below
+  GHashTable *missing_files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  GHashTableIter iter;
+  gpointer key;
+  g_hash_table_iter_init(&iter, config->dbs);
+  while (g_hash_table_iter_next(&iter, &key, NULL)) {
+    g_hash_table_add(missing_files, g_strconcat((const char *)key, CONF_SUFFIX, NULL));
+  }
+
+  // duplicate the descriptor since `closedir` closes the one used by `fdopendir`
+  int list_fd = config->dir_fd != -1
+                    ? openat(config->dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                    : -1;
+  DIR *dir = list_fd != -1 ? fdopendir(list_fd) : NULL;
+  if (dir) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] != '.' && g_str_has_suffix(entry->d_name, CONF_SUFFIX)) {
+        g_hash_table_remove(missing_files, entry->d_name);
+        reload_config_file(config, entry->d_name);
+      }
+    }
+    closedir(dir);
+  } else if (list_fd != -1) {
+    close(list_fd);
+  }
+
+  // the files of these cannot be opened any longer, so reloading them drops the databases
+  g_hash_table_iter_init(&iter, missing_files);
+  while (g_hash_table_iter_next(&iter, &key, NULL)) {
+    reload_config_file(config, (const char *)key);
+  }
+  g_hash_table_unref(missing_files);
+}
+
+/// @brief (Re)open the configuration directory, start watching it, and parse all the files.
+/// @param config pointer to the `user_config`
+void load_config_dir(user_config *config) {
+  close_config_dir(config);
+  config->stale = true;
+  config->load_time = g_get_monotonic_time();
+
+  config->dir_fd = open(config->conf_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  // watch before reading the files so that no change in between is missed
+  if (config->dir_fd != -1 && watch_config_dir(config)) config->stale = false;
+  // a directory that cannot be opened is read as empty which drops all that was loaded before
+  read_config_dir(config);
+}
+
+/// @brief Read the configuration directory afresh if its watch was lost, but at most once every
+///        `STALE_CONFIG_RELOAD_SECS` so that the lookups of an unlock pass do not keep reading it.
+/// @param config pointer to the `user_config`
+void refresh_stale_config(user_config *config) {
+  if (config->stale &&
+      g_get_monotonic_time() - config->load_time >= STALE_CONFIG_RELOAD_SECS * G_USEC_PER_SEC) {
+    load_config_dir(config);
+  }
+}
+
+/// @brief Callback for inotify events on the configuration directories which reloads only the
+///        changed files, or everything in a directory that went away. All the directories are
+///        reloaded if the events overflowed since the events of any of them may have been lost.
+/// @param fd the shared inotify descriptor
+/// @param condition the condition that triggered the callback
+/// @param user_data unused
+/// @return `G_SOURCE_CONTINUE` always
+gboolean handle_config_dir_change(gint fd, GIOCondition condition, gpointer user_data) {
+  char buffer[INOTIFY_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  // set of the `user_config`s to be reloaded in full once all the pending events have been read
+  GHashTable *reload_configs = g_hash_table_new(NULL, NULL);
+  bool overflow = false;
+  while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+    for (char *ptr = buffer; ptr < buffer + len;) {
+      const struct inotify_event *event = (const struct inotify_event *)ptr;
+      // events of a removed watch (like its `IN_IGNORED`) find no `user_config` and are skipped
+      user_config *config = g_hash_table_lookup(config_watches, GINT_TO_POINTER(event->wd));
+      if (event->mask & IN_Q_OVERFLOW) {
+        overflow = true;
+      } else if (!config || overflow || g_hash_table_contains(reload_configs, config)) {
+        // nothing to do, or the directory is going to be reloaded in full anyway
+      } else if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        g_hash_table_add(reload_configs, config);
+      } else if (event->len > 0) {
+        reload_config_file(config, event->name);
+      }
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  if (overflow) {
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, config_watches);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) g_hash_table_add(reload_configs, value);
+  }
+  // reloading changes `config_watches`, so it is done only after the events have been processed
+  GHashTableIter iter;
+  gpointer key;
+  g_hash_table_iter_init(&iter, reload_configs);
+  while (g_hash_table_iter_next(&iter, &key, NULL)) {
+    user_config *config = (user_config *)key;
+    print_info("Reloading all configuration files in '%s'\n", config->conf_dir);
+    load_config_dir(config);
+  }
+  g_hash_table_unref(reload_configs);
+  return G_SOURCE_CONTINUE;
+}
+
+user_config *user_config_new(uid_t user_id) {
+  user_config *config = g_new0(user_config, 1);
+  config->user_id = user_id;
+  config->conf_dir = g_strdup_printf("%s/%u", KP_CONFIG_DIR, user_id);
+  config->dir_fd = config->watch_wd = -1;
+  config->dbs =
+      g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)db_config_unref);
+  load_config_dir(config);
+  return config;
+}
+
+void user_config_free(user_config *config) {
+  if (!config) return;
+  close_config_dir(config);
+  g_hash_table_unref(config->dbs);
+  g_free(config->kp_sha512);
+  g_free(config->kp_verity);
+  g_free(config->encrypted_bundle);
+  g_free(config->conf_dir);
+  g_free(config);
+}
+
+/// @brief Compare function to sort `db_config` pointers by their names.
+gint compare_db_config_names(gconstpointer a, gconstpointer b) {
+  return g_strcmp0((*(db_config *const *)a)->name, (*(db_config *const *)b)->name);
+}
+
+const char *user_config_get_kp_sha512(user_config *config) {
+  refresh_stale_config(config);
+  return config->kp_sha512;
+}
+
+const char *user_config_get_kp_verity(user_config *config) {
+  refresh_stale_config(config);
+  return config->kp_verity;
+}
+
+const char *user_config_get_bundle(user_config *config) {
+  refresh_stale_config(config);
+  return config->encrypted_bundle;
+}
+
+GPtrArray *user_config_get_dbs(user_config *config) {
+  // the directory is read afresh only if the watch on it was lost
+  refresh_stale_config(config);
+
+  GPtrArray *dbs = g_ptr_array_new_with_free_func((GDestroyNotify)db_config_unref);
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, config->dbs);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    g_ptr_array_add(dbs, db_config_ref((db_config *)value));
+  }
+  g_ptr_array_sort(dbs, compare_db_config_names);
+  return dbs;
+}
@@ -0,0 +1,83 @@
+#ifndef _KEEPASSXC_UNLOCK_CONFIG_H_
+#define _KEEPASSXC_UNLOCK_CONFIG_H_
+
+#include "common.h"
+
+#define KP_SHA512_FILE_NAME "keepassxc.sha512"
+#define KP_VERITY_FILE_NAME "keepassxc.verity"    // optional fs-verity digest of KeePassXC
+#define BUNDLE_FILE_NAME "bundle.cred"    // optional credential bundling all the passwords
+#define BUNDLE_CRED_NAME "keepassxc-unlock-bundle"    // name embedded in the bundle credential
+
+/// @brief Parsed contents of a KDBX database configuration file (`<name>.conf`) which is
+///        reference counted so that an unlock pass can keep using it while the file is reloaded
+typedef struct {
+  gchar *name;                // name of the configuration which is also the credential name
+  gchar *kdbx_file;           // path of the KDBX database
+  gchar *key_file;            // path of the key file, or empty if none
+  gchar *encrypted_passwd;    // the base64 encoded encrypted password following `PASSWORD:`
+  int priority;               // optional `PRIORITY=`; higher ones are unlocked first, default 0
+} db_config;
+
+/// @brief In-memory table of the parsed configuration of a user which is kept up-to-date using
+///        inotify on the user's configuration directory, where a single inotify instance is shared
+///        by all the users of the process
+typedef struct {
+  uid_t user_id;               // numeric ID of the user
+  gchar *conf_dir;             // path of the user's configuration directory
+  int dir_fd;                  // descriptor of `conf_dir` kept open for reloading files
+  int watch_wd;                // watch of `conf_dir` in the shared inotify instance, or -1
+  bool stale;                  // `true` if the watch was lost and everything has to be reloaded
+  gint64 load_time;            // monotonic time of the last read of the whole directory
+  GHashTable *dbs;             // map of configuration name to `db_config`
+  gchar *kp_sha512;            // recorded SHA-512 checksum of KeePassXC, or NULL if missing
+  gchar *kp_verity;            // recorded fs-verity digest of KeePassXC, or NULL if missing
+  gchar *encrypted_bundle;     // the base64 encoded credential bundle, or NULL if missing
+} user_config;
+
+/// @brief Acquire a reference to the `db_config`.
+/// @param config pointer to the `db_config`
+/// @return the same `config` pointer
+extern db_config *db_config_ref(db_config *config);
+
+/// @brief Release a reference to the `db_config` which is freed when the last one is released.
+/// @param config pointer to the `db_config`
+extern void db_config_unref(db_config *config);
+
+/// @brief Parse all the configuration files of a user and start watching the configuration
+///        directory for changes which are applied by the main loop as they happen.
+/// @param user_id numeric ID of the user
+/// @return a new `user_config` that should be released with `user_config_free()` after use
+extern user_config *user_config_new(uid_t user_id);
+
+/// @brief Stop watching the configuration directory and release the `user_config`.
+/// @param config pointer to the `user_config`
+extern void user_config_free(user_config *config);
+
+/// @brief Get the recorded SHA-512 checksum of the KeePassXC executable.
+/// @param config pointer to the `user_config`
+/// @return the checksum as a hexadecimal string owned by `config` which is valid only till the
+///         next return to the main loop, else NULL if it has not been recorded
+extern const char *user_config_get_kp_sha512(user_config *config);
+
+/// @brief Get the recorded fs-verity digest of the KeePassXC executable which is present only if
+///        fs-verity was enabled on the executable when `keepassxc-unlock-setup` was run.
+/// @param config pointer to the `user_config`
+/// @return the digest as `<algorithm>:<hex>` (as printed by `fsverity measure`) owned by `config`
+///         which is valid only till the next return to the main loop, else NULL if not recorded
+extern const char *user_config_get_kp_verity(user_config *config);
+
+/// @brief Get the encrypted credential bundle of the user written by `keepassxc-unlock-setup`
+///        which holds the passwords of all the databases so that they need a single decryption.
+/// @param config pointer to the `user_config`
+/// @return the base64 encoded encrypted bundle owned by `config` which is valid only till the
+///         next return to the main loop, else NULL if there is no bundle
+extern const char *user_config_get_bundle(user_config *config);
+
+/// @brief Get the KDBX database configurations of the user ordered by their names.
+/// @param config pointer to the `user_config`
+/// @return array of referenced `db_config` pointers that should be released with
+///         `g_ptr_array_unref()` after use
+extern GPtrArray *user_config_get_dbs(user_config *config);
+
+
+#endif /* !_KEEPASSXC_UNLOCK_CONFIG_H_ */
@@ -0,0 +1,179 @@
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include "credentials.h"
+
+#define ALIGN8(l) (((l) + 7) & ~(size_t)7)
+#define CRED_ID_SIZE 16
+#define CRED_HEADER_SIZE (CRED_ID_SIZE + 4 * 4)    // ID + key, block, IV and tag sizes
+#define CRED_METADATA_SIZE (8 + 8 + 4)               // timestamp + not_after + name size
+#define CRED_MAX_HOST_SECRET_SIZE 65536
+#define CRED_MACHINE_ID_SIZE 16
+
+// ID of the credentials encrypted with only the host key (`--with-key=host`)
+static const guchar CRED_AES256_GCM_BY_HOST[CRED_ID_SIZE] = {0x5a, 0x1c, 0x6a, 0x86, 0xdf, 0x9d,
+    0x40, 0x96, 0xb1, 0xd5, 0xa6, 0x5e, 0x08, 0x62, 0xf1, 0x9a};
+
+void creds_context_init(creds_context *ctx) {
+  memset(ctx, 0, sizeof(creds_context));
+}
+
+void creds_context_clear(creds_context *ctx) {
+  if (ctx->host_secret) {
+    OPENSSL_cleanse(ctx->host_secret, ctx->host_secret_len);
+    g_free(ctx->host_secret);
+  }
+  memset(ctx, 0, sizeof(creds_context));
+}
+
+/// @brief Read a little-endian 32-bit unsigned integer from the given buffer.
+guint32 read_le32(const guchar *p) {
+  return (guint32)p[0] | ((guint32)p[1] << 8) | ((guint32)p[2] << 16) | ((guint32)p[3] << 24);
+}
+
+/// @brief Read a little-endian 64-bit unsigned integer from the given buffer.
+guint64 read_le64(const guchar *p) {
+  return (guint64)read_le32(p) | ((guint64)read_le32(p + 4) << 32);
+}
+
+/// @brief Load the host secret into the context, if not done already in this unlock pass.
+/// @param ctx the `creds_context` for the current unlock pass
+/// @return `true` if the host secret is available in the context else `false`
+bool load_host_secret(creds_context *ctx) {
+  if (ctx->host_secret_loaded) return ctx->host_secret != NULL;
+  ctx->host_secret_loaded = true;
+
+  gchar *secret = NULL;
+  gsize secret_len = 0;
+  GError *error = NULL;
+  if (!g_file_get_contents(CREDS_HOST_SECRET_FILE, &secret, &secret_len, &error)) {
+    print_error("Failed to read host secret: %s\n", error ? error->message : "(null)");
+    g_clear_error(&error);
+    return false;
+  }
+  // the file starts with the machine ID followed by the actual secret data
+  if (secret_len <= CRED_MACHINE_ID_SIZE || secret_len > CRED_MAX_HOST_SECRET_SIZE) {
+    print_error("Invalid size of host secret file '%s'\n", CREDS_HOST_SECRET_FILE);
+  } else {
+    ctx->host_secret_len = secret_len - CRED_MACHINE_ID_SIZE;
+    ctx->host_secret = g_memdup2(secret + CRED_MACHINE_ID_SIZE, ctx->host_secret_len);
+  }
+  OPENSSL_cleanse(secret, secret_len);
+  g_free(secret);
+  return ctx->host_secret != NULL;
+}
+
+/// @brief Decrypt the AES256-GCM payload of the credential into a newly allocated buffer.
+/// @param key the 256-bit AES key
+/// @param data the full decoded credential
+/// @param aad_len size of the unencrypted headers at the start of `data` that are used as AAD
+/// @param data_len total size of `data` including the trailing tag
+/// @param iv the initialization vector
+/// @param iv_len size of the initialization vector
+/// @param tag_len size of the GCM tag at the end of `data`
+/// @param out_len_ptr pointer to `size_t` that is filled with size of the returned buffer
+/// @return the decrypted data that should be wiped with `OPENSSL_cleanse()` and then released
+///         with `g_free()` after use, else NULL if decryption or authentication failed
+guchar *aes256_gcm_decrypt(const guchar *key, const guchar *data, size_t aad_len, size_t data_len,
+    const guchar *iv, size_t iv_len, size_t tag_len, size_t *out_len_ptr) {
+  size_t cipher_len = data_len - aad_len - tag_len;
+  guchar *plain = g_malloc(cipher_len + 1);
+  int len = 0, final_len = 0;
+  EVP_CIPHER_CTX *cipher_ctx = EVP_CIPHER_CTX_new();
+  bool success = cipher_ctx &&
+                 EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) == 1 &&
+                 EVP_CIPHER_CTX_ctrl(cipher_ctx, EVP_CTRL_GCM_SET_IVLEN, (int)iv_len, NULL) == 1 &&
+                 EVP_DecryptInit_ex(cipher_ctx, NULL, NULL, key, iv) == 1 &&
+                 // all the headers are authenticated as AAD
+                 EVP_DecryptUpdate(cipher_ctx, NULL, &len, data, (int)aad_len) == 1 &&
+                 EVP_DecryptUpdate(cipher_ctx, plain, &len, data + aad_len, (int)cipher_len) == 1 &&
+                 EVP_CIPHER_CTX_ctrl(cipher_ctx, EVP_CTRL_GCM_SET_TAG, (int)tag_len,
+                     (void *)(data + data_len - tag_len)) == 1 &&
+                 EVP_DecryptFinal_ex(cipher_ctx, plain + len, &final_len) == 1;
+  EVP_CIPHER_CTX_free(cipher_ctx);
+  if (!success) {
+    OPENSSL_cleanse(plain, cipher_len + 1);
+    g_free(plain);
+    return NULL;
+  }
+  *out_len_ptr = (size_t)len + final_len;
+  return plain;
+}
+
+cred_decrypt_status decrypt_credential(creds_context *ctx, const char *cred_name,
+    const char *encoded, char *plain_buffer, size_t buffer_size, size_t *plain_len_ptr) {
+  // g_base64_decode skips over the newlines that systemd-creds inserts
+  gsize data_len = 0;
+  guchar *data = g_base64_decode(encoded, &data_len);
+  if (!data) return CRED_UNSUPPORTED;
+
+  // the credential starts with the ID of the encryption scheme followed by the sizes of the key,
+  // block, IV and tag; only the host key based scheme is handled here
+  if (data_len < CRED_HEADER_SIZE ||
+      memcmp(data, CRED_AES256_GCM_BY_HOST, sizeof(CRED_AES256_GCM_BY_HOST)) != 0) {
+    g_free(data);
+    return CRED_UNSUPPORTED;
+  }
+  guint32 key_size = read_le32(data + CRED_ID_SIZE);
+  guint32 block_size = read_le32(data + CRED_ID_SIZE + 4);
+  guint32 iv_size = read_le32(data + CRED_ID_SIZE + 8);
+  guint32 tag_size = read_le32(data + CRED_ID_SIZE + 12);
+  size_t aad_len = ALIGN8((size_t)CRED_HEADER_SIZE + iv_size);
+  if (key_size != 32 || block_size != 1 || iv_size == 0 || iv_size > 32 || tag_size != 16 ||
+      data_len < aad_len + tag_size) {
+    print_error("Unexpected header in encrypted credential '%s'\n", cred_name);
+    g_free(data);
+    return CRED_FAILED;
+  }
+  // systemd-creds needs the same host secret, so it cannot do any better if this fails
+  if (!load_host_secret(ctx)) {
+    g_free(data);
+    return CRED_FAILED;
+  }
+
+  // the AES key is the SHA-256 hash of the host secret
+  guchar key[EVP_MAX_MD_SIZE];
+  unsigned int key_len = 0;
+  size_t plain_len = 0;
+  guchar *plain = NULL;
+  if (EVP_Digest(ctx->host_secret, ctx->host_secret_len, key, &key_len, EVP_sha256(), NULL) == 1) {
+    plain = aes256_gcm_decrypt(key, data, aad_len, data_len, data + CRED_HEADER_SIZE, iv_size,
+        tag_size, &plain_len);
+  }
+  OPENSSL_cleanse(key, sizeof(key));
+  g_free(data);
+  if (!plain) {
+    print_error("Failed to decrypt credential '%s' using the host key\n", cred_name);
+    return CRED_FAILED;
+  }
+
+  // decrypted data starts with the metadata: timestamp, expiry, name size and name
+  bool success = false;
+  size_t meta_len = 0;
+  if (plain_len < CRED_METADATA_SIZE) {
+    print_error("Missing metadata in credential '%s'\n", cred_name);
+  } else {
+    guint64 not_after = read_le64(plain + 8);
+    guint32 name_size = read_le32(plain + 16);
+    meta_len = ALIGN8((size_t)CRED_METADATA_SIZE + name_size);
+    if (meta_len > plain_len) {
+      print_error("Invalid metadata in credential '%s'\n", cred_name);
+    } else if (name_size != 0 &&
+               (strlen(cred_name) != name_size ||
+                   memcmp(plain + CRED_METADATA_SIZE, cred_name, name_size) != 0)) {
+      print_error("Embedded name of credential does not match '%s'\n", cred_name);
+    } else if (not_after != G_MAXUINT64 && (guint64)g_get_real_time() > not_after) {
+      print_error("Credential '%s' has expired\n", cred_name);
+    } else if (plain_len - meta_len >= buffer_size) {
+      print_error("Credential '%s' exceeds %zu characters!\n", cred_name, buffer_size - 1);
+    } else {
+      *plain_len_ptr = plain_len - meta_len;
+      memcpy(plain_buffer, plain + meta_len, *plain_len_ptr);
+      plain_buffer[*plain_len_ptr] = '\0';
+      success = true;
+    }
+  }
+  OPENSSL_cleanse(plain, plain_len);
+  g_free(plain);
+  return success ? CRED_DECRYPTED : CRED_FAILED;
+}
@@ -0,0 +1,47 @@
+#ifndef _KEEPASSXC_UNLOCK_CREDENTIALS_H_
+#define _KEEPASSXC_UNLOCK_CREDENTIALS_H_
+
+#include "common.h"
+
+#define CREDS_HOST_SECRET_FILE "/var/lib/systemd/credential.secret"
+
+/// @brief Holds the state shared by all the credential decryptions of a single unlock pass, so
+///        that the expensive setup (like reading the host key) is done at most once per pass
+typedef struct {
+  guchar *host_secret;        // contents of the host secret file without its machine ID header
+  gsize host_secret_len;      // length of `host_secret` in bytes
+  bool host_secret_loaded;    // `true` if loading `host_secret` has already been attempted
+} creds_context;
+
+/// @brief Result of `decrypt_credential()`
+typedef enum {
+  CRED_DECRYPTED,      // the credential was decrypted
+  CRED_FAILED,         // the credential is of the host key type but could not be decrypted
+  CRED_UNSUPPORTED,    // the credential is of a type not handled natively (e.g. TPM2 sealed)
+} cred_decrypt_status;
+
+/// @brief Initialize the context for a new unlock pass.
+/// @param ctx pointer to the `creds_context` to be initialized
+extern void creds_context_init(creds_context *ctx);
+
+/// @brief Wipe and release all the key material held by the context at the end of an unlock pass.
+/// @param ctx pointer to the `creds_context` to be cleared
+extern void creds_context_clear(creds_context *ctx);
+
+/// @brief Decrypt a systemd credential (as written by `systemd-creds encrypt`) in-process.
+///        Only the credentials encrypted with the host key are handled natively, while others
+///        (e.g. TPM2 sealed ones) return `CRED_UNSUPPORTED` without any error message so that the
+///        caller can fall back to `systemd-creds decrypt`.
+/// @param ctx the `creds_context` for the current unlock pass
+/// @param cred_name expected name of the credential that is embedded in the encrypted data
+/// @param encoded the base64 encoded encrypted credential (embedded newlines are ignored)
+/// @param plain_buffer buffer to be filled with the decrypted credential plus a terminating null
+/// @param buffer_size total size of the passed `plain_buffer`
+/// @param plain_len_ptr pointer to `size_t` that is filled with the length of decrypted credential
+/// @return `CRED_DECRYPTED` if the credential was successfully decrypted, `CRED_UNSUPPORTED` if it
+///         is not encrypted with only the host key, else `CRED_FAILED` (which is logged)
+extern cred_decrypt_status decrypt_credential(creds_context *ctx, const char *cred_name,
+    const char *encoded, char *plain_buffer, size_t buffer_size, size_t *plain_len_ptr);
+
+
+#endif /* !_KEEPASSXC_UNLOCK_CREDENTIALS_H_ */
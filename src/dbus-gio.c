@@ -0,0 +1,142 @@
+#include "common.h"
+
+/// @brief Holds the `user_data` passed to `handle_call_reply` callback
+typedef struct {
+  dbus_reply_callback callback;    // the callback to be invoked with the reply
+  gpointer user_data;              // custom user data passed through to `callback`
+} call_request;
+
+/// @brief Holds the `user_data` passed to `handle_signal` callback
+typedef struct {
+  dbus_signal_callback callback;    // the callback to be invoked for the signal
+  gpointer user_data;               // custom user data passed through to `callback`
+} signal_subscription;
+
+/// @brief Holds the `user_data` passed to `handle_get_property` callback
+typedef struct {
+  dbus_property_getter getter;    // the function that gets the value of a property
+  gpointer user_data;             // custom user data passed through to `getter`
+} exported_properties;
+
+dbus_conn *dbus_connect_system(gchar **error_message) {
+  GError *error = NULL;
+  GDBusConnection *connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+  if (!connection) {
+    *error_message = g_strdup(error ? error->message : "(null)");
+    g_clear_error(&error);
+  }
+  return connection;
+}
+
+void dbus_conn_unref(dbus_conn *conn) {
+  g_object_unref(conn);
+}
+
+/// @brief Callback for completion of an asynchronous call made by `dbus_call()`.
+/// @param source the `GDBusConnection` object for the system D-Bus
+/// @param res the result of the asynchronous call
+/// @param user_data pointer to the `call_request`
+void handle_call_reply(GObject *source, GAsyncResult *res, gpointer user_data) {
+  call_request *request = (call_request *)user_data;
+  GError *error = NULL;
+  GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+  if (reply) {
+    request->callback(reply, NULL, NULL, request->user_data);
+    g_variant_unref(reply);
+  } else {
+    gchar *error_name = error ? g_dbus_error_get_remote_error(error) : NULL;
+    if (error) g_dbus_error_strip_remote_error(error);
+    request->callback(NULL, error_name, error ? error->message : "(null)", request->user_data);
+    g_free(error_name);
+    g_clear_error(&error);
+  }
+  g_free(request);
+}
+
+void dbus_call(dbus_conn *conn, const char *destination, const char *object_path,
+    const char *interface_name, const char *method_name, GVariant *parameters,
+    const char *reply_type, int timeout_ms, dbus_reply_callback callback, gpointer user_data) {
+  call_request *request = NULL;
+  if (callback) {
+    request = g_new(call_request, 1);
+    request->callback = callback;
+    request->user_data = user_data;
+  }
+  g_dbus_connection_call(conn, destination, object_path, interface_name, method_name, parameters,
+      reply_type ? G_VARIANT_TYPE(reply_type) : NULL, G_DBUS_CALL_FLAGS_NONE, timeout_ms, NULL,
+      callback ? handle_call_reply : NULL, request);
+}
+
+GVariant *dbus_call_sync(dbus_conn *conn, const char *destination, const char *object_path,
+    const char *interface_name, const char *method_name, GVariant *parameters,
+    const char *reply_type, int timeout_ms, gchar **error_message) {
+  GError *error = NULL;
+  GVariant *reply = g_dbus_connection_call_sync(conn, destination, object_path, interface_name,
+      method_name, parameters, reply_type ? G_VARIANT_TYPE(reply_type) : NULL,
+      G_DBUS_CALL_FLAGS_NONE, timeout_ms, NULL, &error);
+  if (!reply) {
+    *error_message = g_strdup(error ? error->message : "(null)");
+    g_clear_error(&error);
+  }
+  return reply;
+}
+
+/// @brief Callback for a signal subscribed by `dbus_signal_subscribe()`.
+void handle_signal(GDBusConnection *conn, const gchar *sender_name, const gchar *object_path,
+    const gchar *interface_name, const gchar *signal_name, GVariant *parameters,
+    gpointer user_data) {
+  signal_subscription *subscription = (signal_subscription *)user_data;
+  subscription->callback(object_path, parameters, subscription->user_data);
+}
+
+guint dbus_signal_subscribe(dbus_conn *conn, const char *sender, const char *interface_name,
+    const char *member, const char *object_path, dbus_signal_callback callback,
+    gpointer user_data) {
+  signal_subscription *subscription = g_new(signal_subscription, 1);
+  subscription->callback = callback;
+  subscription->user_data = user_data;
+  return g_dbus_connection_signal_subscribe(conn, sender, interface_name, member, object_path,
+      NULL, G_DBUS_SIGNAL_FLAGS_NONE, handle_signal, subscription, g_free);
+}
+
+void dbus_signal_unsubscribe(dbus_conn *conn, guint subscription_id) {
+  g_dbus_connection_signal_unsubscribe(conn, subscription_id);
+}
+
+/// @brief Get the value of a property exported by `dbus_export_properties()`.
+GVariant *handle_get_property(GDBusConnection *conn, const gchar *sender,
+    const gchar *object_path, const gchar *interface_name, const gchar *property_name,
+    GError **error, gpointer user_data) {
+  exported_properties *properties = (exported_properties *)user_data;
+  GVariant *value = properties->getter(property_name, properties->user_data);
+  if (!value) {
+    g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_PROPERTY, "No such property '%s'",
+        property_name);
+  }
+  return value;
+}
+
+static const GDBusInterfaceVTable properties_vtable = {NULL, handle_get_property, NULL, {0}};
+
+bool dbus_export_properties(dbus_conn *conn, const char *object_path,
+    const char *introspection_xml, const char *interface_name, dbus_property_getter getter,
+    gpointer user_data, gchar **error_message) {
+  GError *error = NULL;
+  GDBusNodeInfo *node_info = g_dbus_node_info_new_for_xml(introspection_xml, &error);
+  guint registration_id = 0;
+  if (node_info) {
+    exported_properties *properties = g_new(exported_properties, 1);
+    properties->getter = getter;
+    properties->user_data = user_data;
+    registration_id = g_dbus_connection_register_object(conn, object_path,
+        g_dbus_node_info_lookup_interface(node_info, interface_name), &properties_vtable,
+        properties, g_free, &error);
+    g_dbus_node_info_unref(node_info);
+  }
+  if (registration_id == 0) {
+    *error_message = g_strdup(error ? error->message : "(null)");
+    g_clear_error(&error);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,679 @@
+#include <errno.h>
+#include <systemd/sd-bus.h>
+
+#include "common.h"
+
+#define PROPERTIES_INTERFACE "org.freedesktop.DBus.Properties"
+#define INTROSPECTABLE_INTERFACE "org.freedesktop.DBus.Introspectable"
+
+/// @brief Connection to the system bus that is dispatched from the GLib main loop
+struct dbus_conn {
+  sd_bus *bus;                  // the sd-bus connection
+  GSource *source;              // the `bus_source` attached to the default main context
+  GHashTable *subscriptions;    // map of subscription ID to the `sd_bus_slot` of its match
+  guint last_subscription_id;   // ID of the last subscription added to `subscriptions`
+};
+
+/// @brief `GSource` that polls the fd of an `sd_bus` and processes it when ready or timed out
+typedef struct {
+  GSource source;      // the parent `GSource`
+  sd_bus *bus;         // the sd-bus connection
+  gpointer fd_tag;     // tag of the polled fd returned by `g_source_add_unix_fd()`
+  int events;          // the events currently polled on the fd
+  gint64 deadline;     // monotonic time in microseconds when the bus should be processed anyway
+} bus_source;
+
+/// @brief Holds the `user_data` passed to `handle_call_reply` and `report_call_failure` callbacks
+typedef struct {
+  gchar *reply_type;               // the expected type of the reply, or NULL to accept any
+  dbus_reply_callback callback;    // the callback to be invoked with the reply
+  gpointer user_data;              // custom user data passed through to `callback`
+  gchar *error_message;            // message of the error if the call could not be sent
+} call_request;
+
+/// @brief Holds the `user_data` passed to `handle_signal` callback
+typedef struct {
+  dbus_signal_callback callback;    // the callback to be invoked for the signal
+  gpointer user_data;               // custom user data passed through to `callback`
+} signal_subscription;
+
+/// @brief Holds the `user_data` passed to `handle_object_message` callback
+typedef struct {
+  const char *introspection_xml;    // introspection data of the object
+  const char *interface_name;       // D-Bus interface of the properties
+  GPtrArray *property_names;        // names of the properties of `interface_name`
+  dbus_property_getter getter;      // the function that gets the value of a property
+  gpointer user_data;               // custom user data passed through to `getter`
+} exported_properties;
+
+/// @brief Update the events to be polled and the timeout from the bus before the main loop polls.
+gboolean bus_source_prepare(GSource *source, gint *timeout) {
+  bus_source *bsource = (bus_source *)source;
+  int events = sd_bus_get_events(bsource->bus);
+  if (events < 0) events = 0;
+  // the poll flags are identical to the `GIOCondition` values on Linux; a modification wakes up
+  // the main context so it is done only when the events change to not poll in a busy loop
+  if (events != bsource->events) {
+    g_source_modify_unix_fd(source, bsource->fd_tag, (GIOCondition)events);
+    bsource->events = events;
+  }
+  *timeout = -1;
+  bsource->deadline = G_MAXINT64;
+  uint64_t until = 0;
+  // the timeout is an absolute CLOCK_MONOTONIC time, the same clock as `g_get_monotonic_time()`
+  if (sd_bus_get_timeout(bsource->bus, &until) <= 0 || until == UINT64_MAX) return FALSE;
+  bsource->deadline = until < (uint64_t)G_MAXINT64 ? (gint64)until : G_MAXINT64;
+  gint64 remaining = bsource->deadline - g_get_monotonic_time();
+  if (remaining <= 0) return TRUE;
+  *timeout = remaining / 1000 < G_MAXINT ? (gint)((remaining + 999) / 1000) : G_MAXINT;
+  return FALSE;
+}
+
+/// @brief Check if the bus needs to be processed after the main loop has polled.
+gboolean bus_source_check(GSource *source) {
+  bus_source *bsource = (bus_source *)source;
+  return g_source_query_unix_fd(source, bsource->fd_tag) != 0 ||
+         g_get_monotonic_time() >= bsource->deadline;
+}
+
+/// @brief Process all the pending messages of the bus which invokes the callbacks for them.
+gboolean bus_source_dispatch(GSource *source, GSourceFunc callback, gpointer user_data) {
+  bus_source *bsource = (bus_source *)source;
+  int r;
+  while ((r = sd_bus_process(bsource->bus, NULL)) > 0) {
+  }
+  // a closed connection terminates the process by `sd_bus_set_exit_on_disconnect()`, so any
+  // other failure is not expected to go away and the process exits like it would with GIO
+  if (r < 0) {
+    print_error("Failed to process the system bus: %s\n", g_strerror(-r));
+    exit(1);
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs bus_source_funcs = {
+    bus_source_prepare, bus_source_check, bus_source_dispatch, NULL, NULL, NULL};
+
+/// @brief Release the `sd_bus_slot` of a subscription which also removes its match.
+void subscription_slot_free(gpointer slot) {
+  sd_bus_slot_unref((sd_bus_slot *)slot);
+}
+
+dbus_conn *dbus_connect_system(gchar **error_message) {
+  sd_bus *bus = NULL;
+  int r = sd_bus_open_system(&bus);
+  if (r < 0) {
+    *error_message = g_strdup(g_strerror(-r));
+    return NULL;
+  }
+  // terminate the process if the bus goes away which is the default of the GIO connections
+  sd_bus_set_exit_on_disconnect(bus, 1);
+
+  dbus_conn *conn = g_new(dbus_conn, 1);
+  conn->bus = bus;
+  conn->source = g_source_new(&bus_source_funcs, sizeof(bus_source));
+  bus_source *bsource = (bus_source *)conn->source;
+  bsource->bus = bus;
+  bsource->fd_tag = g_source_add_unix_fd(conn->source, sd_bus_get_fd(bus), G_IO_IN);
+  bsource->events = G_IO_IN;
+  bsource->deadline = G_MAXINT64;
+  g_source_attach(conn->source, NULL);
+  conn->subscriptions = g_hash_table_new_full(NULL, NULL, NULL, subscription_slot_free);
+  conn->last_subscription_id = 0;
+  return conn;
+}
+
+void dbus_conn_unref(dbus_conn *conn) {
+  g_hash_table_unref(conn->subscriptions);
+  g_source_destroy(conn->source);
+  g_source_unref(conn->source);
+  sd_bus_flush_close_unref(conn->bus);
+  g_free(conn);
+}
+
+/// @brief Append a value to an `sd_bus_message` being built.
+/// @param message the message being built
+/// @param value the value to append
+/// @return a non-negative value on success, else a negative errno
+int append_value(sd_bus_message *message, GVariant *value) {
+  const gchar *type = g_variant_get_type_string(value);
+  union {
+    guint8 y;
+    int b;
+    gint16 n;
+    guint16 q;
+    gint32 i;
+    guint32 u;
+    gint64 x;
+    guint64 t;
+    gdouble d;
+  } basic;
+  switch (type[0]) {
+    case 'y':
+      basic.y = g_variant_get_byte(value);
+      return sd_bus_message_append_basic(message, 'y', &basic);
+    case 'b':
+      basic.b = g_variant_get_boolean(value);
+      return sd_bus_message_append_basic(message, 'b', &basic);
+    case 'n':
+      basic.n = g_variant_get_int16(value);
+      return sd_bus_message_append_basic(message, 'n', &basic);
+    case 'q':
+      basic.q = g_variant_get_uint16(value);
+      return sd_bus_message_append_basic(message, 'q', &basic);
+    case 'i':
+      basic.i = g_variant_get_int32(value);
+      return sd_bus_message_append_basic(message, 'i', &basic);
+    case 'u':
+      basic.u = g_variant_get_uint32(value);
+      return sd_bus_message_append_basic(message, 'u', &basic);
+    case 'x':
+      basic.x = g_variant_get_int64(value);
+      return sd_bus_message_append_basic(message, 'x', &basic);
+    case 't':
+      basic.t = g_variant_get_uint64(value);
+      return sd_bus_message_append_basic(message, 't', &basic);
+    case 'd':
+      basic.d = g_variant_get_double(value);
+      return sd_bus_message_append_basic(message, 'd', &basic);
+    case 's':
+    case 'o':
+    case 'g':
+      return sd_bus_message_append_basic(message, type[0], g_variant_get_string(value, NULL));
+    case 'v':
+    case 'a':
+    case '(':
+    case '{':
+      break;
+    default:    // maybe types and unix fds which are not used by the callers
+      return -EINVAL;
+  }
+
+  int r;
+  if (type[0] == 'v') {
+    GVariant *inner = g_variant_get_variant(value);
+    r = sd_bus_message_open_container(message, 'v', g_variant_get_type_string(inner));
+    if (r >= 0) r = append_value(message, inner);
+    g_variant_unref(inner);
+  } else if (type[0] == 'a') {
+    r = sd_bus_message_open_container(message, 'a', type + 1);
+    for (gsize i = 0, n = g_variant_n_children(value); r >= 0 && i < n; i++) {
+      GVariant *child = g_variant_get_child_value(value, i);
+      r = append_value(message, child);
+      g_variant_unref(child);
+    }
+  } else {
+    // the contents of structures and dictionary entries are given without the brackets
+    gchar *contents = g_strndup(type + 1, strlen(type) - 2);
+    r = sd_bus_message_open_container(message, type[0] == '(' ? 'r' : 'e', contents);
+    g_free(contents);
+    for (gsize i = 0, n = g_variant_n_children(value); r >= 0 && i < n; i++) {
+      GVariant *child = g_variant_get_child_value(value, i);
+      r = append_value(message, child);
+      g_variant_unref(child);
+    }
+  }
+  return r < 0 ? r : sd_bus_message_close_container(message);
+}
+
+int read_values(sd_bus_message *message, GVariantBuilder *builder);
+
+/// @brief Read the next value of an `sd_bus_message` into a `GVariant`.
+/// @param message the message being read
+/// @param type the D-Bus type of the value from `sd_bus_message_peek_type()`
+/// @param contents the type of the contents if the value is a container, else NULL
+/// @param value_ptr pointer to `GVariant*` that is filled with the floating value read
+/// @return a non-negative value on success, else a negative errno
+int read_value(sd_bus_message *message, char type, const char *contents, GVariant **value_ptr) {
+  union {
+    guint8 y;
+    int b;
+    gint16 n;
+    guint16 q;
+    gint32 i;
+    guint32 u;
+    gint64 x;
+    guint64 t;
+    gdouble d;
+    const char *s;
+  } basic;
+  int r;
+  switch (type) {
+    case 'y':
+    case 'b':
+    case 'n':
+    case 'q':
+    case 'i':
+    case 'u':
+    case 'x':
+    case 't':
+    case 'd':
+    case 's':
+    case 'o':
+    case 'g':
+      if ((r = sd_bus_message_read_basic(message, type, &basic)) < 0) return r;
+      break;
+    case 'v':
+    case 'a':
+    case 'r':
+    case 'e':
+      if ((r = sd_bus_message_enter_container(message, type, contents)) < 0) return r;
+      break;
+    default:    // unix fds which are not used by the callers
+      return -EINVAL;
+  }
+
+  switch (type) {
+    case 'y':
+      *value_ptr = g_variant_new_byte(basic.y);
+      return r;
+    case 'b':
+      *value_ptr = g_variant_new_boolean(basic.b);
+      return r;
+    case 'n':
+      *value_ptr = g_variant_new_int16(basic.n);
+      return r;
+    case 'q':
+      *value_ptr = g_variant_new_uint16(basic.q);
+      return r;
+    case 'i':
+      *value_ptr = g_variant_new_int32(basic.i);
+      return r;
+    case 'u':
+      *value_ptr = g_variant_new_uint32(basic.u);
+      return r;
+    case 'x':
+      *value_ptr = g_variant_new_int64(basic.x);
+      return r;
+    case 't':
+      *value_ptr = g_variant_new_uint64(basic.t);
+      return r;
+    case 'd':
+      *value_ptr = g_variant_new_double(basic.d);
+      return r;
+    case 's':
+      *value_ptr = g_variant_new_string(basic.s);
+      return r;
+    case 'o':
+      *value_ptr = g_variant_new_object_path(basic.s);
+      return r;
+    case 'g':
+      *value_ptr = g_variant_new_signature(basic.s);
+      return r;
+    case 'v': {
+      char inner_type = 0;
+      const char *inner_contents = NULL;
+      GVariant *inner = NULL;
+      r = sd_bus_message_peek_type(message, &inner_type, &inner_contents);
+      if (r == 0) r = -EBADMSG;
+      if (r > 0) r = read_value(message, inner_type, inner_contents, &inner);
+      if (r >= 0) r = sd_bus_message_exit_container(message);
+      if (r < 0) {
+        if (inner) g_variant_unref(g_variant_ref_sink(inner));
+        return r;
+      }
+      *value_ptr = g_variant_new_variant(inner);
+      return r;
+    }
+    default: {
+      gchar *container_type = type == 'a'   ? g_strconcat("a", contents, NULL)
+                              : type == 'r' ? g_strconcat("(", contents, ")", NULL)
+                                            : g_strconcat("{", contents, "}", NULL);
+      GVariantBuilder builder;
+      g_variant_builder_init(&builder, G_VARIANT_TYPE(container_type));
+      g_free(container_type);
+      r = read_values(message, &builder);
+      if (r >= 0) r = sd_bus_message_exit_container(message);
+      if (r < 0) {
+        g_variant_builder_clear(&builder);
+        return r;
+      }
+      *value_ptr = g_variant_builder_end(&builder);
+      return r;
+    }
+  }
+}
+
+/// @brief Read the remaining values of the current container (or body) of an `sd_bus_message`.
+/// @param message the message being read
+/// @param builder the `GVariantBuilder` to which the values are added
+/// @return a non-negative value on success, else a negative errno
+int read_values(sd_bus_message *message, GVariantBuilder *builder) {
+  while (true) {
+    char type = 0;
+    const char *contents = NULL;
+    int r = sd_bus_message_peek_type(message, &type, &contents);
+    if (r <= 0) return r;
+    GVariant *value = NULL;
+    if ((r = read_value(message, type, contents, &value)) < 0) return r;
+    g_variant_builder_add_value(builder, value);
+  }
+}
+
+/// @brief Read the body of an `sd_bus_message` as a tuple and check its type.
+/// @param message the message to read
+/// @param reply_type the expected type of the body, or NULL to accept any
+/// @param error_message pointer to `gchar*` that is filled with the error message on failure
+/// @return the body that should be released with `g_variant_unref()`, or NULL on failure
+GVariant *read_message_body(sd_bus_message *message, const char *reply_type,
+    gchar **error_message) {
+  gchar *body_type = g_strconcat("(", sd_bus_message_get_signature(message, 1), ")", NULL);
+  if (reply_type && g_strcmp0(body_type, reply_type) != 0) {
+    *error_message = g_strdup_printf("Method '%s' returned type '%s', but expected '%s'",
+        sd_bus_message_get_member(message), body_type, reply_type);
+    g_free(body_type);
+    return NULL;
+  }
+  GVariantBuilder builder;
+  g_variant_builder_init(&builder, G_VARIANT_TYPE(body_type));
+  g_free(body_type);
+  int r = read_values(message, &builder);
+  if (r < 0) {
+    g_variant_builder_clear(&builder);
+    *error_message = g_strdup_printf("Failed to read the message: %s", g_strerror(-r));
+    return NULL;
+  }
+  return g_variant_ref_sink(g_variant_builder_end(&builder));
+}
+
+/// @brief Create a method call message having the given arguments.
+/// @param conn the connection to the system bus
+/// @param destination the bus name of the peer
+/// @param object_path path of the object
+/// @param interface_name D-Bus interface of the method
+/// @param method_name name of the method
+/// @param parameters the arguments as a tuple (a floating reference is consumed), or NULL if none
+/// @param error_message pointer to `gchar*` that is filled with the error message on failure
+/// @return the message that should be released with `sd_bus_message_unref()`, or NULL on failure
+sd_bus_message *new_method_call(dbus_conn *conn, const char *destination,
+    const char *object_path, const char *interface_name, const char *method_name,
+    GVariant *parameters, gchar **error_message) {
+  sd_bus_message *message = NULL;
+  int r = sd_bus_message_new_method_call(
+      conn->bus, &message, destination, object_path, interface_name, method_name);
+  if (parameters) {
+    g_variant_ref_sink(parameters);
+    for (gsize i = 0, n = g_variant_n_children(parameters); r >= 0 && i < n; i++) {
+      GVariant *child = g_variant_get_child_value(parameters, i);
+      r = append_value(message, child);
+      g_variant_unref(child);
+    }
+    g_variant_unref(parameters);
+  }
+  if (r < 0) {
+    *error_message = g_strdup_printf("Failed to build the call of '%s': %s", method_name,
+        g_strerror(-r));
+    sd_bus_message_unref(message);
+    return NULL;
+  }
+  return message;
+}
+
+/// @brief Release the `call_request`.
+void call_request_free(call_request *request) {
+  g_free(request->reply_type);
+  g_free(request->error_message);
+  g_free(request);
+}
+
+/// @brief Callback for the reply to a call made by `dbus_call()`, which may also be an error
+///        generated locally by sd-bus e.g. on timeout.
+int handle_call_reply(sd_bus_message *reply, void *user_data, sd_bus_error *ret_error) {
+  call_request *request = (call_request *)user_data;
+  const sd_bus_error *error = sd_bus_message_get_error(reply);
+  if (error) {
+    request->callback(NULL, error->name, error->message, request->user_data);
+  } else {
+    GVariant *body = read_message_body(reply, request->reply_type, &request->error_message);
+    if (body) {
+      request->callback(body, NULL, NULL, request->user_data);
+      g_variant_unref(body);
+    } else {
+      request->callback(NULL, NULL, request->error_message, request->user_data);
+    }
+  }
+  call_request_free(request);
+  return 0;
+}
+
+/// @brief Report the failure to send a call from the main loop, like the other replies.
+gboolean report_call_failure(gpointer user_data) {
+  call_request *request = (call_request *)user_data;
+  request->callback(NULL, NULL, request->error_message, request->user_data);
+  call_request_free(request);
+  return G_SOURCE_REMOVE;
+}
+
+void dbus_call(dbus_conn *conn, const char *destination, const char *object_path,
+    const char *interface_name, const char *method_name, GVariant *parameters,
+    const char *reply_type, int timeout_ms, dbus_reply_callback callback, gpointer user_data) {
+  gchar *error_message = NULL;
+  sd_bus_message *message = new_method_call(conn, destination, object_path, interface_name,
+      method_name, parameters, &error_message);
+  int r = 0;
+  if (message && !callback) {
+    sd_bus_message_set_expect_reply(message, 0);
+    r = sd_bus_send(conn->bus, message, NULL);
+  } else if (message) {
+    call_request *request = g_new0(call_request, 1);
+    request->reply_type = g_strdup(reply_type);
+    request->callback = callback;
+    request->user_data = user_data;
+    r = sd_bus_call_async(conn->bus, NULL, message, handle_call_reply, request,
+        (uint64_t)timeout_ms * 1000);
+    if (r < 0) call_request_free(request);
+  }
+  sd_bus_message_unref(message);
+  if (r < 0) {
+    error_message =
+        g_strdup_printf("Failed to send the call of '%s': %s", method_name, g_strerror(-r));
+  }
+  if (!error_message) return;
+  if (callback) {
+    call_request *request = g_new0(call_request, 1);
+    request->callback = callback;
+    request->user_data = user_data;
+    request->error_message = error_message;
+    g_idle_add(report_call_failure, request);
+  } else {
+    print_error("%s\n", error_message);
+    g_free(error_message);
+  }
+}
+
+GVariant *dbus_call_sync(dbus_conn *conn, const char *destination, const char *object_path,
+    const char *interface_name, const char *method_name, GVariant *parameters,
+    const char *reply_type, int timeout_ms, gchar **error_message) {
+  sd_bus_message *message = new_method_call(conn, destination, object_path, interface_name,
+      method_name, parameters, error_message);
+  if (!message) return NULL;
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *reply = NULL;
+  int r = sd_bus_call(conn->bus, message, (uint64_t)timeout_ms * 1000, &error, &reply);
+  sd_bus_message_unref(message);
+  GVariant *body = NULL;
+  if (r < 0) {
+    *error_message = g_strdup(error.message ? error.message : g_strerror(-r));
+  } else {
+    body = read_message_body(reply, reply_type, error_message);
+  }
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(reply);
+  return body;
+}
+
+/// @brief Callback for a signal subscribed by `dbus_signal_subscribe()`.
+int handle_signal(sd_bus_message *message, void *user_data, sd_bus_error *ret_error) {
+  signal_subscription *subscription = (signal_subscription *)user_data;
+  gchar *error_message = NULL;
+  GVariant *parameters = read_message_body(message, NULL, &error_message);
+  if (parameters) {
+    subscription->callback(
+        sd_bus_message_get_path(message), parameters, subscription->user_data);
+    g_variant_unref(parameters);
+  } else {
+    print_error("Failed to read signal '%s': %s\n", sd_bus_message_get_member(message),
+        error_message);
+    g_free(error_message);
+  }
+  return 0;
+}
+
+guint dbus_signal_subscribe(dbus_conn *conn, const char *sender, const char *interface_name,
+    const char *member, const char *object_path, dbus_signal_callback callback,
+    gpointer user_data) {
+  signal_subscription *subscription = g_new(signal_subscription, 1);
+  subscription->callback = callback;
+  subscription->user_data = user_data;
+  sd_bus_slot *slot = NULL;
+  // the match is added asynchronously and a failure to add it closes the connection
+  int r = sd_bus_match_signal_async(conn->bus, &slot, sender, object_path, interface_name,
+      member, handle_signal, NULL, subscription);
+  if (r < 0) {
+    g_free(subscription);
+    return 0;
+  }
+  sd_bus_slot_set_destroy_callback(slot, g_free);
+  guint subscription_id = ++conn->last_subscription_id;
+  g_hash_table_insert(conn->subscriptions, GUINT_TO_POINTER(subscription_id), slot);
+  return subscription_id;
+}
+
+void dbus_signal_unsubscribe(dbus_conn *conn, guint subscription_id) {
+  g_hash_table_remove(conn->subscriptions, GUINT_TO_POINTER(subscription_id));
+}
+
+/// @brief Reply to a method call with a single value.
+/// @param call the method call
+/// @param value the value of the reply (a floating reference is consumed)
+/// @return a positive value on success, else a negative errno
+int reply_with_value(sd_bus_message *call, GVariant *value) {
+  sd_bus_message *reply = NULL;
+  g_variant_ref_sink(value);
+  int r = sd_bus_message_new_method_return(call, &reply);
+  if (r >= 0) r = append_value(reply, value);
+  if (r >= 0) r = sd_bus_send(NULL, reply, NULL);
+  g_variant_unref(value);
+  sd_bus_message_unref(reply);
+  return r < 0 ? r : 1;
+}
+
+/// @brief Callback for the method calls on an object exported by `dbus_export_properties()`
+///        which serves the introspection data and the `Get` and `GetAll` of its properties.
+int handle_object_message(sd_bus_message *message, void *user_data, sd_bus_error *ret_error) {
+  exported_properties *properties = (exported_properties *)user_data;
+  if (sd_bus_message_is_method_call(message, INTROSPECTABLE_INTERFACE, "Introspect")) {
+    return sd_bus_reply_method_return(message, "s", properties->introspection_xml);
+  }
+
+  bool get_all = sd_bus_message_is_method_call(message, PROPERTIES_INTERFACE, "GetAll") > 0;
+  if (!get_all && !sd_bus_message_is_method_call(message, PROPERTIES_INTERFACE, "Get")) {
+    if (sd_bus_message_is_method_call(message, PROPERTIES_INTERFACE, "Set")) {
+      return sd_bus_reply_method_errorf(
+          message, "org.freedesktop.DBus.Error.PropertyReadOnly", "Properties are read-only");
+    }
+    return 0;    // sd-bus replies with an error to the unknown methods
+  }
+  const char *interface_name = NULL, *property_name = NULL;
+  int r = get_all ? sd_bus_message_read(message, "s", &interface_name)
+                  : sd_bus_message_read(message, "ss", &interface_name, &property_name);
+  if (r < 0) return r;
+  if (g_strcmp0(interface_name, properties->interface_name) != 0) {
+    return sd_bus_reply_method_errorf(message, "org.freedesktop.DBus.Error.UnknownInterface",
+        "No such interface '%s'", interface_name);
+  }
+
+  if (!get_all) {
+    GVariant *value = properties->getter(property_name, properties->user_data);
+    if (!value) {
+      return sd_bus_reply_method_errorf(message, "org.freedesktop.DBus.Error.UnknownProperty",
+          "No such property '%s'", property_name);
+    }
+    return reply_with_value(message, g_variant_new_variant(value));
+  }
+  GVariantBuilder builder;
+  g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+  for (guint i = 0; i < properties->property_names->len; i++) {
+    const char *name = g_ptr_array_index(properties->property_names, i);
+    GVariant *value = properties->getter(name, properties->user_data);
+    if (value) g_variant_builder_add(&builder, "{sv}", name, value);
+  }
+  return reply_with_value(message, g_variant_builder_end(&builder));
+}
+
+/// @brief Holds the state of parsing the introspection data in `dbus_export_properties()`
+typedef struct {
+  const char *interface_name;    // D-Bus interface whose properties are collected
+  bool in_interface;             // whether the parser is inside the element of `interface_name`
+  GPtrArray *property_names;     // names of the properties collected so far
+} introspection_parser;
+
+/// @brief Collect the name of a `property` element within the `interface` being looked up.
+void handle_introspection_start(GMarkupParseContext *context, const gchar *element_name,
+    const gchar **attribute_names, const gchar **attribute_values, gpointer user_data,
+    GError **error) {
+  introspection_parser *parser = (introspection_parser *)user_data;
+  const gchar *name = NULL;
+  for (size_t i = 0; attribute_names[i]; i++) {
+    if (strcmp(attribute_names[i], "name") == 0) name = attribute_values[i];
+  }
+  if (strcmp(element_name, "interface") == 0) {
+    parser->in_interface = g_strcmp0(name, parser->interface_name) == 0;
+  } else if (parser->in_interface && name && strcmp(element_name, "property") == 0) {
+    g_ptr_array_add(parser->property_names, g_strdup(name));
+  }
+}
+
+/// @brief Note the end of the `interface` element being looked up.
+void handle_introspection_end(GMarkupParseContext *context, const gchar *element_name,
+    gpointer user_data, GError **error) {
+  introspection_parser *parser = (introspection_parser *)user_data;
+  if (strcmp(element_name, "interface") == 0) parser->in_interface = false;
+}
+
+static const GMarkupParser introspection_markup_parser = {
+    handle_introspection_start, handle_introspection_end, NULL, NULL, NULL};
+
+/// @brief Release the `exported_properties` when the object is removed.
+void exported_properties_free(void *data) {
+  exported_properties *properties = (exported_properties *)data;
+  g_ptr_array_unref(properties->property_names);
+  g_free(properties);
+}
+
+bool dbus_export_properties(dbus_conn *conn, const char *object_path,
+    const char *introspection_xml, const char *interface_name, dbus_property_getter getter,
+    gpointer user_data, gchar **error_message) {
+  introspection_parser parser = {interface_name, false, g_ptr_array_new_with_free_func(g_free)};
+  GError *error = NULL;
+  GMarkupParseContext *context =
+      g_markup_parse_context_new(&introspection_markup_parser, 0, &parser, NULL);
+  bool parsed = g_markup_parse_context_parse(context, introspection_xml, -1, &error) &&
+                g_markup_parse_context_end_parse(context, &error);
+  g_markup_parse_context_free(context);
+  if (!parsed) {
+    *error_message = g_strdup(error ? error->message : "(null)");
+    g_clear_error(&error);
+    g_ptr_array_unref(parser.property_names);
+    return false;
+  }
+
+  exported_properties *properties = g_new(exported_properties, 1);
+  properties->introspection_xml = introspection_xml;
+  properties->interface_name = interface_name;
+  properties->property_names = parser.property_names;
+  properties->getter = getter;
+  properties->user_data = user_data;
+  sd_bus_slot *slot = NULL;
+  int r = sd_bus_add_object(conn->bus, &slot, object_path, handle_object_message, properties);
+  if (r < 0) {
+    *error_message = g_strdup(g_strerror(-r));
+    exported_properties_free(properties);
+    return false;
+  }
+  // the object stays for the lifetime of the connection
+  sd_bus_slot_set_destroy_callback(slot, exported_properties_free);
+  sd_bus_slot_set_floating(slot, 1);
+  sd_bus_slot_unref(slot);
+  return true;
+}
@@ -0,0 +1,128 @@
+#ifndef _KEEPASSXC_UNLOCK_DBUS_H_
+#define _KEEPASSXC_UNLOCK_DBUS_H_
+
+// Thin layer over the handful of D-Bus operations needed by the login monitor (calls, signal
+// subscriptions and exported properties) which is implemented by a backend chosen at build time:
+// GIO by default (`dbus-gio.c`), or sd-bus with `make DBUS_BACKEND=sdbus` (`dbus-sdbus.c`) which
+// does not need GIO and GObject. Message bodies are `GVariant`s and the buses are dispatched from
+// the GLib main loop in both.
+
+#include <stdbool.h>
+
+#include <glib.h>
+
+#ifdef DBUS_BACKEND_SDBUS
+typedef struct dbus_conn dbus_conn;    // connection to the system bus wrapping an `sd_bus`
+#else
+#include <gio/gio.h>
+typedef GDBusConnection dbus_conn;    // connection to the system bus which is a `GDBusConnection`
+#endif
+
+#define DBUS_OBJECT_NAME "org.freedesktop.DBus"
+#define DBUS_OBJECT_PATH "/org/freedesktop/DBus"
+#define DBUS_INTERFACE "org.freedesktop.DBus"
+#define DBUS_NAME_FLAG_DO_NOT_QUEUE 4              // flag of `RequestName` to not wait for the name
+#define DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER 1    // result of `RequestName` when it was acquired
+
+/// @brief Callback invoked from the main loop with the result of `dbus_call()`.
+/// @param reply the body of the reply which is valid only during the callback, or NULL if the call
+///              failed
+/// @param error_name D-Bus name of the error if the call failed with an error from the peer or the
+///                   bus, else NULL
+/// @param error_message message of the error if the call failed, else NULL
+/// @param user_data the `user_data` passed to `dbus_call()`
+typedef void (*dbus_reply_callback)(
+    GVariant *reply, const char *error_name, const char *error_message, gpointer user_data);
+
+/// @brief Callback invoked from the main loop for a signal subscribed by `dbus_signal_subscribe()`.
+/// @param object_path path of the object that emitted the signal
+/// @param parameters parameters of the signal which are valid only during the callback
+/// @param user_data the `user_data` passed to `dbus_signal_subscribe()`
+typedef void (*dbus_signal_callback)(
+    const char *object_path, GVariant *parameters, gpointer user_data);
+
+/// @brief Callback that gets the value of a property exported by `dbus_export_properties()`.
+/// @param property_name name of the property
+/// @param user_data the `user_data` passed to `dbus_export_properties()`
+/// @return the value of the property (which may be floating), or NULL if there is no such property
+typedef GVariant *(*dbus_property_getter)(const char *property_name, gpointer user_data);
+
+/// @brief Connect to the system bus and attach the connection to the default main context.
+///        The process exits if the connection is closed later.
+/// @param error_message pointer to `gchar*` that is filled with the error message on failure which
+///                      should be released with `g_free()` after use
+/// @return the connection that should be released with `dbus_conn_unref()`, or NULL on failure
+extern dbus_conn *dbus_connect_system(gchar **error_message);
+
+/// @brief Release the connection returned by `dbus_connect_system()`.
+/// @param conn the connection to the system bus
+extern void dbus_conn_unref(dbus_conn *conn);
+
+/// @brief Call a method asynchronously and invoke the callback with its reply.
+/// @param conn the connection to the system bus
+/// @param destination the bus name of the peer
+/// @param object_path path of the object
+/// @param interface_name D-Bus interface of the method
+/// @param method_name name of the method
+/// @param parameters the arguments as a tuple (a floating reference is consumed), or NULL if none
+/// @param reply_type the expected type of the reply, e.g. `(o)`, or NULL to accept any reply
+/// @param timeout_ms deadline of the call in milliseconds
+/// @param callback the function to be invoked with the reply, or NULL if it is not needed
+/// @param user_data custom user data passed through to `callback`
+extern void dbus_call(dbus_conn *conn, const char *destination, const char *object_path,
+    const char *interface_name, const char *method_name, GVariant *parameters,
+    const char *reply_type, int timeout_ms, dbus_reply_callback callback, gpointer user_data);
+
+/// @brief Call a method and block till its reply is received. This is meant only for the start of
+///        the programs before the main loop runs.
+/// @param conn the connection to the system bus
+/// @param destination the bus name of the peer
+/// @param object_path path of the object
+/// @param interface_name D-Bus interface of the method
+/// @param method_name name of the method
+/// @param parameters the arguments as a tuple (a floating reference is consumed), or NULL if none
+/// @param reply_type the expected type of the reply, e.g. `(o)`, or NULL to accept any reply
+/// @param timeout_ms deadline of the call in milliseconds
+/// @param error_message pointer to `gchar*` that is filled with the error message on failure which
+///                      should be released with `g_free()` after use
+/// @return the reply that should be released with `g_variant_unref()`, or NULL on failure
+extern GVariant *dbus_call_sync(dbus_conn *conn, const char *destination,
+    const char *object_path, const char *interface_name, const char *method_name,
+    GVariant *parameters, const char *reply_type, int timeout_ms, gchar **error_message);
+
+/// @brief Subscribe to a signal which also adds the match rule for it to the bus.
+/// @param conn the connection to the system bus
+/// @param sender the bus name of the sender
+/// @param interface_name D-Bus interface of the signal
+/// @param member name of the signal
+/// @param object_path path of the object emitting the signal, or NULL to match all objects
+/// @param callback the function to be invoked for every matching signal
+/// @param user_data custom user data passed through to `callback`
+/// @return the ID of the subscription for `dbus_signal_unsubscribe()`, or 0 on failure
+extern guint dbus_signal_subscribe(dbus_conn *conn, const char *sender,
+    const char *interface_name, const char *member, const char *object_path,
+    dbus_signal_callback callback, gpointer user_data);
+
+/// @brief Remove a subscription added by `dbus_signal_subscribe()`.
+/// @param conn the connection to the system bus
+/// @param subscription_id the ID of the subscription
+extern void dbus_signal_unsubscribe(dbus_conn *conn, guint subscription_id);
+
+/// @brief Export an object having the read-only properties of one interface, which are served by
+///        `org.freedesktop.DBus.Properties` (`Get` and `GetAll`) and can be introspected.
+/// @param conn the connection to the system bus
+/// @param object_path path of the object
+/// @param introspection_xml introspection data of the object having the interface, which should
+///                          be a string literal (or otherwise never freed)
+/// @param interface_name D-Bus interface of the properties
+/// @param getter the function that gets the value of a property
+/// @param user_data custom user data passed through to `getter`
+/// @param error_message pointer to `gchar*` that is filled with the error message on failure which
+///                      should be released with `g_free()` after use
+/// @return `true` if the object was exported else `false`
+extern bool dbus_export_properties(dbus_conn *conn, const char *object_path,
+    const char *introspection_xml, const char *interface_name, dbus_property_getter getter,
+    gpointer user_data, gchar **error_message);
+
+
+#endif /* !_KEEPASSXC_UNLOCK_DBUS_H_ */
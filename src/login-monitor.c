@@ -1,29 +1,185 @@
-#include <gio/gio.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "stats.h"
 
-/// @brief Callback for creation of a new session that checks if it is a valid target for auto-lock
-///        and if so, then starts user-specific `keepassxc-unlock@<uid>.service` to handle the same.
-/// @param conn the `GBusConnection` object for the system D-Bus
-/// @param sender_name name of the sender of the event
+#define SYSTEMD_OBJECT_NAME "org.freedesktop.systemd1"
+#define SYSTEMD_OBJECT_PATH "/org/freedesktop/systemd1"
+#define SYSTEMD_MANAGER_INTERFACE "org.freedesktop.systemd1.Manager"
+#define SYSTEMD_UNIT_EXISTS_ERROR "org.freedesktop.systemd1.UnitExists"
+#define UNLOCK_PROGRAM "keepassxc-unlock"
+#define UNLOCK_UNIT_PREFIX "keepassxc-unlock-"
+#define ENV_SETTINGS_PREFIX "KEEPASSXC_UNLOCK_"
+#define LOGIN_MONITOR_STATS_NAME STATS_BUS_NAME_PREFIX ".LoginMonitor"
+
+/// @brief Holds the state of the login monitor which is the `user_data` passed to the callbacks
+typedef struct {
+  dbus_conn *connection;    // the connection to the system D-Bus
+  gchar *unlock_program;    // absolute path of the `keepassxc-unlock` executable
+  GHashTable *jobs;         // map of systemd job path to the `start_unit_request` for it
+} monitor_data;
+
+/// @brief Holds the `user_data` passed to `handle_start_unit_reply` callback which is then kept
+///        in the `jobs` of the monitor till the job completes
+typedef struct {
+  monitor_data *monitor;    // the state of the login monitor
+  gchar *unit_name;         // name of the unit being started
+  gint64 start_time;        // monotonic time in microseconds when the start was requested
+} start_unit_request;
+
+/// @brief Release the `start_unit_request`.
+void start_unit_request_free(gpointer data) {
+  start_unit_request *request = (start_unit_request *)data;
+  g_free(request->unit_name);
+  g_free(request);
+}
+
+/// @brief Add the sandboxing properties of the unlock service to a transient unit definition.
+/// @param props the `GVariantBuilder` of type `a(sv)` for the unit properties
+void add_unlock_unit_sandboxing(GVariantBuilder *props) {
+  const char *bool_props[] = {"LockPersonality", "MemoryDenyWriteExecute", "NoNewPrivileges",
+      "PrivateTmp", "ProtectClock", "ProtectControlGroups", "ProtectHostname", "ProtectKernelLogs",
+      "ProtectKernelModules", "ProtectKernelTunables", "RestrictRealtime", "RestrictSUIDSGID"};
+  for (size_t i = 0; i < G_N_ELEMENTS(bool_props); i++) {
+    g_variant_builder_add(props, "(sv)", bool_props[i], g_variant_new_boolean(TRUE));
+  }
+  const gchar *address_families[] = {"AF_UNIX", "AF_NETLINK", NULL};
+  const gchar *architectures[] = {"native", NULL};
+  const gchar *syscall_filter[] = {"@system-service", NULL};
+  g_variant_builder_add(
+      props, "(sv)", "DeviceAllow", g_variant_new_parsed("[('/dev/tpmrm0', 'rw')]"));
+  g_variant_builder_add(props, "(sv)", "ProtectSystem", g_variant_new_string("full"));
+  g_variant_builder_add(props, "(sv)", "RestrictAddressFamilies",
+      g_variant_new("(b^as)", TRUE, address_families));
+  // the value is the set of namespace types that are allowed, so zero restricts all of them
+  g_variant_builder_add(props, "(sv)", "RestrictNamespaces", g_variant_new_uint64(0));
+  g_variant_builder_add(
+      props, "(sv)", "SystemCallArchitectures", g_variant_new_strv(architectures, -1));
+  g_variant_builder_add(
+      props, "(sv)", "SystemCallFilter", g_variant_new("(b^as)", TRUE, syscall_filter));
+  g_variant_builder_add(props, "(sv)", "SystemCallErrorNumber", g_variant_new_int32(EPERM));
+}
+
+/// @brief Callback for completion of the `StartTransientUnit` call which records the queued job
+///        so that its result can be reported when `JobRemoved` is received for it.
+/// @param result the reply having the path of the queued job, or NULL if the call failed
+/// @param error_name D-Bus name of the error if the call failed
+/// @param error_message message of the error if the call failed
+/// @param user_data pointer to the `start_unit_request`
+void handle_start_unit_reply(GVariant *result, const char *error_name, const char *error_message,
+    gpointer user_data) {
+  start_unit_request *request = (start_unit_request *)user_data;
+  if (result) {
+    gchar *job_path = NULL;
+    g_variant_get(result, "(o)", &job_path);
+    g_hash_table_insert(request->monitor->jobs, job_path, request);
+    return;
+  }
+
+  // deliberately have only one auto-unlock service for one user and not separate one for each
+  // session to avoid those interfering with one another (a KeePassXC instance outside any session
+  // scope can only be correlated by its environment), so an existing unit is not an error; the
+  // daemon mode monitors all the sessions of a user in one process
+  if (g_strcmp0(error_name, SYSTEMD_UNIT_EXISTS_ERROR) == 0) {
+    print_info("Service '%s' is already running for another session\n", request->unit_name);
+  } else {
+    print_error("Failed to start service '%s': %s\n", request->unit_name, error_message);
+    stats_record("start_unit", request->start_time, false);
+  }
+  start_unit_request_free(request);
+}
+
+/// @brief Start the user-specific `keepassxc-unlock-<uid>.service` as a transient unit that
+///        monitors the given session. The session path is passed in the command-line of the unit,
+///        and the settings of the login monitor (`KEEPASSXC_UNLOCK_*` environment variables) are
+///        passed through to it. This only queues the start whose result is reported on the
+///        `JobRemoved` signal of systemd.
+/// @param monitor pointer to the `monitor_data`
+/// @param user_id numeric ID of the session owner
+/// @param session_path path of the session
+void start_unlock_unit(monitor_data *monitor, guint32 user_id, const gchar *session_path) {
+  gchar *unit_name = g_strdup_printf("%s%u.service", UNLOCK_UNIT_PREFIX, user_id);
+  gchar *description =
+      g_strdup_printf("Auto-unlock registered KeePassXC databases for UID=%u", user_id);
+  gchar user_arg[32];
+  snprintf(user_arg, sizeof(user_arg), "%u", user_id);
+  const gchar *exec_argv[] = {monitor->unlock_program, user_arg, session_path, NULL};
+
+  GVariantBuilder exec_start;
+  g_variant_builder_init(&exec_start, G_VARIANT_TYPE("a(sasb)"));
+  g_variant_builder_add(&exec_start, "(s^asb)", monitor->unlock_program, exec_argv, FALSE);
+  GVariantBuilder environment;
+  g_variant_builder_init(&environment, G_VARIANT_TYPE("as"));
+  gchar **env = g_get_environ();
+  for (gchar **env_ptr = env; *env_ptr; env_ptr++) {
+    if (g_str_has_prefix(*env_ptr, "PATH=") || g_str_has_prefix(*env_ptr, ENV_SETTINGS_PREFIX)) {
+      g_variant_builder_add(&environment, "s", *env_ptr);
+    }
+  }
+  g_strfreev(env);
+
+  GVariantBuilder props;
+  g_variant_builder_init(&props, G_VARIANT_TYPE("a(sv)"));
+  g_variant_builder_add(&props, "(sv)", "Description", g_variant_new_string(description));
+  g_variant_builder_add(&props, "(sv)", "ExecStart", g_variant_builder_end(&exec_start));
+  g_variant_builder_add(&props, "(sv)", "Environment", g_variant_builder_end(&environment));
+  g_variant_builder_add(&props, "(sv)", "Restart", g_variant_new_string("on-failure"));
+  // unload the unit as soon as it stops so that the next login of the user can start it afresh
+  g_variant_builder_add(
+      &props, "(sv)", "CollectMode", g_variant_new_string("inactive-or-failed"));
+  add_unlock_unit_sandboxing(&props);
+  g_free(description);
+
+  print_info("Starting service '%s' for session '%s'\n", unit_name, session_path);
+  start_unit_request *request = g_new(start_unit_request, 1);
+  request->monitor = monitor;
+  request->unit_name = unit_name;
+  request->start_time = g_get_monotonic_time();
+  // "fail" mode makes the call fail if the unit is already running for another session
+  dbus_call(monitor->connection, SYSTEMD_OBJECT_NAME, SYSTEMD_OBJECT_PATH,
+      SYSTEMD_MANAGER_INTERFACE, "StartTransientUnit",
+      g_variant_new("(ssa(sv)a(sa(sv)))", unit_name, "fail", &props, NULL), "(o)",
+      DBUS_CALL_WAIT, handle_start_unit_reply, request);
+}
+
+/// @brief Callback for the `JobRemoved` signal of systemd which reports the result of starting
+///        an unlock service.
 /// @param object_path path of the object for which the event was raised
-/// @param interface_name D-Bus interface of the raised signal
-/// @param signal_name name of the D-Bus signal that was raised (should be `SessionNew`)
 /// @param parameters parameters of the raised signal
-/// @param user_data custom user data sent through with the event which is ignored for this method
-void handle_new_session(GDBusConnection *conn, const gchar *sender_name, const gchar *object_path,
-    const gchar *interface_name, const gchar *signal_name, GVariant *parameters,
-    gpointer user_data) {
-  gchar *session_path = NULL;
-  // extract session path from the parameters
-  g_variant_get(parameters, "(s&o)", NULL, &session_path);
+/// @param user_data pointer to the `monitor_data`
+void handle_job_removed(const gchar *object_path, GVariant *parameters, gpointer user_data) {
+  monitor_data *monitor = (monitor_data *)user_data;
+  const gchar *job_path = NULL, *unit_name = NULL, *result = NULL;
+  g_variant_get(parameters, "(u&o&s&s)", NULL, &job_path, &unit_name, &result);
+  start_unit_request *request = g_hash_table_lookup(monitor->jobs, job_path);
+  if (!request) return;
+  bool done = g_strcmp0(result, "done") == 0;
+  stats_record("start_unit", request->start_time, done);
+  g_hash_table_remove(monitor->jobs, job_path);
+  if (done) {
+    print_info("Started service '%s'\n", unit_name);
+  } else {
+    print_error("Failed to start service '%s' with result '%s'\n", unit_name, result);
+  }
+}
 
-  // check if the session can be a target for auto-unlock and also get the owner
-  print_info(
-      "Checking if session '%s' can be auto-unlocked and looking up its owner\n", session_path);
-  guint32 user_id = 0;
-  if (!session_valid_for_unlock(conn, session_path, 0, &user_id, NULL, NULL)) {
-    print_info("Ignoring session which is not a valid target for auto-unlock\n");
+/// @brief Callback invoked once a new session has been checked by
+///        `session_valid_for_unlock_async()` which starts user-specific
+///        `keepassxc-unlock-<uid>.service` for a valid session.
+/// @param session_path path of the new session
+/// @param valid `true` if auto-unlock can be attempted for the session else `false`
+/// @param user_id numeric ID of the session owner
+/// @param is_wayland `true` if the session type is `wayland` (ignored)
+/// @param display value of the `Display` property of the session (ignored)
+/// @param session_id value of the `Id` property of the session (ignored)
+/// @param leader_pid process ID of the session leader (ignored)
+/// @param user_data pointer to the `monitor_data`
+void handle_new_session_checked(const gchar *session_path, bool valid, guint32 user_id,
+    bool is_wayland, const gchar *display, const gchar *session_id, guint32 leader_pid,
+    gpointer user_data) {
+  if (!valid) {
+    print_info("Ignoring session '%s' which is not a valid target for auto-unlock\n", session_path);
     return;
   }
 
@@ -35,34 +191,49 @@ void handle_new_session(GDBusConnection *conn, const gchar *sender_name, const g
     return;
   }
 
-  // write session.env for the service (extension should not be `.conf` which is for kdbx configs)
-  char session_env[128];
-  snprintf(session_env, sizeof(session_env), "%s/%u/session.env", KP_CONFIG_DIR, user_id);
-  FILE *session_env_fp = fopen(session_env, "w");
-  if (!session_env_fp) {
-    print_error(
-        "\033[1;33mhandle_new_session() failed to open '%s' for writing: \033[00m", session_env);
-    perror(NULL);
+  start_unlock_unit((monitor_data *)user_data, user_id, session_path);
+}
+
+/// @brief Callback for creation of a new session that checks if it is a valid target for auto-lock
+///        and if so, then starts user-specific `keepassxc-unlock-<uid>.service` to handle the same.
+/// @param object_path path of the object for which the event was raised
+/// @param parameters parameters of the raised signal
+/// @param user_data pointer to the `monitor_data`
+void handle_new_session(const gchar *object_path, GVariant *parameters, gpointer user_data) {
+  monitor_data *monitor = (monitor_data *)user_data;
+  gchar *session_path = NULL;
+  // extract session path from the parameters
+  g_variant_get(parameters, "(s&o)", NULL, &session_path);
+
+  // check if the session can be a target for auto-unlock and also get the owner; this is done
+  // asynchronously so that other new sessions can be handled while logind is queried
+  print_info(
+      "Checking if session '%s' can be auto-unlocked and looking up its owner\n", session_path);
+  session_valid_for_unlock_async(
+      monitor->connection, session_path, handle_new_session_checked, monitor);
+}
+
+/// @brief Callback for `ListSessions` of logind which checks all the existing sessions, so that
+///        the services are started for the users already logged in (e.g. after an upgrade).
+/// @param result the reply having the sessions, or NULL if the call failed
+/// @param error_name D-Bus name of the error if the call failed (ignored)
+/// @param error_message message of the error if the call failed
+/// @param user_data pointer to the `monitor_data`
+void handle_list_sessions(GVariant *result, const char *error_name, const char *error_message,
+    gpointer user_data) {
+  monitor_data *monitor = (monitor_data *)user_data;
+  if (!result) {
+    print_error("Failed to list existing sessions: %s\n", error_message);
     return;
   }
-  // this can write different session paths for the same user but it doesn't matter since subsequent
-  // service starts for the same user will be ignored in any case (if the previous service is still
-  //   running) and the existing one will keep performing auto-unlock for its session
-  fprintf(session_env_fp, "SESSION_PATH=%s\n", session_path);
-  fclose(session_env_fp);
-
-  // start the systemd service for the user which gets instantiated from the template service
-  char service_cmd[1024];
-  // deliberately have only one auto-unlock service for one user and not separate one for each
-  // session to avoid those interfering with one another (KeePassXC instance to session correlation
-  //   might be incorrect for multiple Wayland sessions)
-  snprintf(
-      service_cmd, sizeof(service_cmd), "systemctl start keepassxc-unlock@%u.service", user_id);
-  print_info("Executing: %s\n", service_cmd);
-  if (system(service_cmd) != 0) {
-    print_error("\033[1;33mhandle_new_session() failed to start '%s': \033[00m", service_cmd);
-    perror(NULL);
+  GVariantIter *iter = NULL;
+  const gchar *session_path = NULL;
+  g_variant_get(result, "(a(susso))", &iter);
+  while (g_variant_iter_loop(iter, "(&su&s&s&o)", NULL, NULL, NULL, NULL, &session_path)) {
+    session_valid_for_unlock_async(
+        monitor->connection, session_path, handle_new_session_checked, monitor);
   }
+  g_variant_iter_free(iter);
 }
 
 
@@ -78,35 +249,61 @@ int main(int argc, char *argv[]) {
 
   print_info("Starting %s version %s\n", argv[0], PRODUCT_VERSION);
 
+  // transient units need the absolute path of the executable
+  gchar *unlock_program = g_find_program_in_path(UNLOCK_PROGRAM);
+  if (!unlock_program) {
+    print_error("Failed to find '%s' in PATH\n", UNLOCK_PROGRAM);
+    return 1;
+  }
+
   // connect to the system bus
-  GError *error = NULL;
-  GDBusConnection *connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+  gchar *error_message = NULL;
+  dbus_conn *connection = dbus_connect_system(&error_message);
   if (!connection) {
-    print_error("Failed to connect to system bus: %s\n", error ? error->message : "(null)");
-    g_clear_error(&error);
+    print_error("Failed to connect to system bus: %s\n", error_message);
+    g_free(error_message);
+    g_free(unlock_program);
     return 1;
   }
+  monitor_data monitor = {connection, unlock_program,
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, start_unit_request_free)};
+  stats_export(connection, LOGIN_MONITOR_STATS_NAME);
+
+  // subscribe to `JobRemoved` signal of systemd, which it sends only after `Subscribe` is called
+  guint job_subscription_id = dbus_signal_subscribe(connection, SYSTEMD_OBJECT_NAME,
+      SYSTEMD_MANAGER_INTERFACE, "JobRemoved", SYSTEMD_OBJECT_PATH, handle_job_removed, &monitor);
+  dbus_call(connection, SYSTEMD_OBJECT_NAME, SYSTEMD_OBJECT_PATH, SYSTEMD_MANAGER_INTERFACE,
+      "Subscribe", NULL, NULL, DBUS_CALL_WAIT, NULL, NULL);
 
   // subscribe to `SessionNew` signal on org.freedesktop.login1
-  guint subscription_id = g_dbus_connection_signal_subscribe(connection,
+  guint subscription_id = dbus_signal_subscribe(connection,
       LOGIN_OBJECT_NAME,          // sender
       LOGIN_MANAGER_INTERFACE,    // interface
       "SessionNew",               // signal name
       LOGIN_OBJECT_PATH,          // object path
-      NULL, G_DBUS_SIGNAL_FLAGS_NONE, handle_new_session, NULL, NULL);
-  if (subscription_id == 0) {
+      handle_new_session, &monitor);
+  if (subscription_id == 0 || job_subscription_id == 0) {
     print_error("Failed to subscribe to receive D-Bus signals for %s\n", LOGIN_OBJECT_PATH);
-    g_object_unref(connection);
+    dbus_conn_unref(connection);
+    g_hash_table_unref(monitor.jobs);
+    g_free(unlock_program);
     return 1;
   }
 
+  // pick up the sessions that already exist after the subscription is in place
+  dbus_call(connection, LOGIN_OBJECT_NAME, LOGIN_OBJECT_PATH, LOGIN_MANAGER_INTERFACE,
+      "ListSessions", NULL, "(a(susso))", LOGIN_CALL_WAIT, handle_list_sessions, &monitor);
+
   // run the main loop
   GMainLoop *loop = g_main_loop_new(NULL, FALSE);
   g_main_loop_run(loop);
 
   // cleanup
-  g_dbus_connection_signal_unsubscribe(connection, subscription_id);
-  g_object_unref(connection);
+  dbus_signal_unsubscribe(connection, subscription_id);
+  dbus_signal_unsubscribe(connection, job_subscription_id);
+  dbus_conn_unref(connection);
+  g_hash_table_unref(monitor.jobs);
+  g_free(unlock_program);
   g_main_loop_unref(loop);
 
   return 0;
@@ -8,5 +8,5 @@ apk cache purge
 
 cd /build
 make all-static STATIC_LIBS="-lpcre2-8 -lffi -lz -lintl -lmount -lblkid -leconf"
-strip -g *-`uname -m`-static
+strip --strip-all *-`uname -m`-static
 chown --reference unlock.c *-static
@@ -0,0 +1,141 @@
+#include <fcntl.h>
+#include <openssl/crypto.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "secrets.h"
+
+/// @brief A cached secret held in its own mapping of locked memory
+typedef struct {
+  char *secret;               // the null terminated secret at the start of the mapping
+  size_t size;                // size of the mapping which is a multiple of the page size
+  guint expiry_source_id;     // ID of the timeout source that wipes the secret, or 0 if none
+} cached_secret;
+
+static GHashTable *secret_cache = NULL;    // map of `<uid>/<name>` to `cached_secret`
+static bool lock_failure_logged = false;    // `true` if failure to lock memory has been logged
+
+int secret_cache_get_ttl(void) {
+  return get_env_setting(ENV_SECRET_CACHE_SECS, 0, SECRET_CACHE_FOR_SESSION, G_MAXINT);
+}
+
+/// @brief Allocate memory for secrets using `memfd_secret` if possible, else fall back to
+///        anonymous memory that is locked and excluded from core dumps.
+/// @param size size of the memory to be allocated which should be a multiple of the page size
+/// @return the allocated memory that should be released with `munmap()`, or NULL on failure
+void *secure_alloc(size_t size) {
+  void *ptr = MAP_FAILED;
+#ifdef SYS_memfd_secret
+  // the pages of a secret memfd are locked and hidden from the kernel itself, but it may be
+  // disabled in the kernel or blocked by the seccomp filter of the service
+  int fd = (int)syscall(SYS_memfd_secret, O_CLOEXEC);
+  if (fd != -1) {
+    if (ftruncate(fd, (off_t)size) == 0) {
+      ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (ptr != MAP_FAILED) return ptr;
+  }
+#endif
+  ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) return NULL;
+  if (mlock(ptr, size) != 0) {
+    if (!lock_failure_logged) {
+      print_error("\033[1;33mNot caching secrets since memory could not be locked: \033[00m");
+      perror(NULL);
+      lock_failure_logged = true;
+    }
+    munmap(ptr, size);
+    return NULL;
+  }
+  madvise(ptr, size, MADV_DONTDUMP);
+#ifdef MADV_WIPEONFORK
+  madvise(ptr, size, MADV_WIPEONFORK);
+#endif
+  return ptr;
+}
+
+/// @brief Wipe a cached secret and release its memory.
+void cached_secret_free(gpointer data) {
+  cached_secret *cached = (cached_secret *)data;
+  if (cached->expiry_source_id != 0) g_source_remove(cached->expiry_source_id);
+  OPENSSL_cleanse(cached->secret, cached->size);
+  munmap(cached->secret, cached->size);
+  g_free(cached);
+}
+
+/// @brief Timeout callback that wipes a cached secret once it expires.
+/// @param user_data the key of the secret in `secret_cache`
+/// @return `G_SOURCE_REMOVE` always
+gboolean handle_secret_expiry(gpointer user_data) {
+  cached_secret *cached = g_hash_table_lookup(secret_cache, user_data);
+  if (cached) {
+    cached->expiry_source_id = 0;
+    g_hash_table_remove(secret_cache, user_data);
+  }
+  return G_SOURCE_REMOVE;
+}
+
+bool secret_cache_lookup(uid_t user_id, const char *name, char *buffer, size_t buffer_size) {
+  if (!secret_cache) return false;
+  gchar *key = g_strdup_printf("%u/%s", user_id, name);
+  cached_secret *cached = g_hash_table_lookup(secret_cache, key);
+  g_free(key);
+  if (!cached) return false;
+  size_t secret_len = strlen(cached->secret);
+  if (secret_len >= buffer_size) return false;
+  memcpy(buffer, cached->secret, secret_len + 1);
+  return true;
+}
+
+bool secret_cache_contains(uid_t user_id, const char *name) {
+  if (!secret_cache) return false;
+  gchar *key = g_strdup_printf("%u/%s", user_id, name);
+  bool found = g_hash_table_contains(secret_cache, key);
+  g_free(key);
+  return found;
+}
+
+void secret_cache_store(uid_t user_id, const char *name, const char *secret, int ttl) {
+  if (ttl == 0) return;
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t secret_len = strlen(secret);
+  size_t size = (secret_len + page_size) / page_size * page_size;
+  char *memory = secure_alloc(size);
+  if (!memory) return;
+  memcpy(memory, secret, secret_len + 1);
+
+  if (!secret_cache) {
+    secret_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, cached_secret_free);
+  }
+  cached_secret *cached = g_new0(cached_secret, 1);
+  cached->secret = memory;
+  cached->size = size;
+  gchar *key = g_strdup_printf("%u/%s", user_id, name);
+  if (ttl != SECRET_CACHE_FOR_SESSION) {
+    cached->expiry_source_id = g_timeout_add_seconds_full(
+        G_PRIORITY_DEFAULT, (guint)ttl, handle_secret_expiry, g_strdup(key), g_free);
+  }
+  g_hash_table_replace(secret_cache, key, cached);
+}
+
+void secret_cache_wipe(uid_t user_id, const char *name) {
+  if (!secret_cache) return;
+  gchar *key = name ? g_strdup_printf("%u/%s", user_id, name) : g_strdup_printf("%u/", user_id);
+  if (name) {
+    g_hash_table_remove(secret_cache, key);
+  } else {
+    GHashTableIter iter;
+    gpointer cached_key;
+    g_hash_table_iter_init(&iter, secret_cache);
+    while (g_hash_table_iter_next(&iter, &cached_key, NULL)) {
+      if (g_str_has_prefix((const char *)cached_key, key)) g_hash_table_iter_remove(&iter);
+    }
+  }
+  g_free(key);
+}
+
+void secret_cache_wipe_all(void) {
+  if (secret_cache) g_hash_table_remove_all(secret_cache);
+}
@@ -0,0 +1,48 @@
+#ifndef _KEEPASSXC_UNLOCK_SECRETS_H_
+#define _KEEPASSXC_UNLOCK_SECRETS_H_
+
+#include "common.h"
+
+#define ENV_SECRET_CACHE_SECS "KEEPASSXC_UNLOCK_CACHE_SECS"
+#define SECRET_CACHE_FOR_SESSION -1    // cached secrets are kept till the session ends
+
+/// @brief Get the configured lifetime of the cached secrets from `ENV_SECRET_CACHE_SECS`.
+/// @return the lifetime in seconds, `SECRET_CACHE_FOR_SESSION` to keep the secrets till the
+///         session ends, or 0 if the cache is disabled (the default)
+extern int secret_cache_get_ttl(void);
+
+/// @brief Copy a cached secret of a user into the given buffer if it has not expired.
+/// @param user_id numeric ID of the user owning the secret
+/// @param name name of the secret (the name of the database configuration)
+/// @param buffer buffer to be filled with the secret plus a terminating null
+/// @param buffer_size total size of the passed `buffer`
+/// @return `true` if the secret was found and copied else `false`
+extern bool secret_cache_lookup(uid_t user_id, const char *name, char *buffer, size_t buffer_size);
+
+/// @brief Check if a secret of a user is in the cache.
+/// @param user_id numeric ID of the user owning the secret
+/// @param name name of the secret (the name of the database configuration)
+/// @return `true` if the secret is cached else `false`
+extern bool secret_cache_contains(uid_t user_id, const char *name);
+
+/// @brief Cache a secret of a user in memory that is locked, excluded from core dumps and, where
+///        the kernel supports `memfd_secret`, also removed from the kernel's direct map. The
+///        secret is wiped once it expires. Nothing is cached if `ttl` is 0 or the memory could not
+///        be locked.
+/// @param user_id numeric ID of the user owning the secret
+/// @param name name of the secret (the name of the database configuration)
+/// @param secret the null terminated secret to be cached
+/// @param ttl lifetime of the secret in seconds, or `SECRET_CACHE_FOR_SESSION` (normally the value
+///            returned by `secret_cache_get_ttl()`)
+extern void secret_cache_store(uid_t user_id, const char *name, const char *secret, int ttl);
+
+/// @brief Wipe and forget the cached secrets of a user.
+/// @param user_id numeric ID of the user
+/// @param name name of the secret to be wiped, or NULL to wipe all the secrets of the user
+extern void secret_cache_wipe(uid_t user_id, const char *name);
+
+/// @brief Wipe and forget all the cached secrets of all the users.
+extern void secret_cache_wipe_all(void);
+
+
+#endif /* !_KEEPASSXC_UNLOCK_SECRETS_H_ */
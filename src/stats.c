@@ -0,0 +1,125 @@
+#include "stats.h"
+
+// upper bounds of the latency histogram buckets in microseconds; the last bucket counts the rest
+static const guint64 bucket_bounds[] = {1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000,
+    500000, 1000000, 2000000, 5000000, 10000000, 30000000, 60000000};
+#define NUM_BUCKETS (G_N_ELEMENTS(bucket_bounds) + 1)
+
+static const gchar STATS_XML[] =
+    "<node>"
+    " <interface name='" STATS_INTERFACE "'>"
+    "  <property name='StartTime' type='x' access='read'/>"
+    "  <property name='BucketBounds' type='at' access='read'/>"
+    "  <property name='Phases' type='a{s(ttttat)}' access='read'/>"
+    " </interface>"
+    "</node>";
+
+/// @brief Counters and the latency histogram of a phase
+typedef struct {
+  const char *name;                // name of the phase
+  guint64 passes;                  // number of times the phase completed successfully
+  guint64 failures;                // number of times the phase failed
+  guint64 total_us;                // sum of all the latencies in microseconds
+  guint64 max_us;                  // the largest latency in microseconds
+  guint64 buckets[NUM_BUCKETS];    // number of latencies falling in each of `bucket_bounds`
+} phase_stats;
+
+static GPtrArray *phases = NULL;       // `phase_stats` in the order of their first record
+static gint64 stats_start_time = 0;    // real time in microseconds when the recording started
+
+/// @brief Initialize the recording if not done already.
+void stats_init(void) {
+  if (phases) return;
+  phases = g_ptr_array_new_with_free_func(g_free);
+  stats_start_time = g_get_real_time();
+}
+
+/// @brief Get the `phase_stats` of a phase, creating it if it does not exist yet.
+/// @param phase name of the phase
+/// @return pointer to the `phase_stats` of the phase
+phase_stats *get_phase_stats(const char *phase) {
+  stats_init();
+  for (guint i = 0; i < phases->len; i++) {
+    phase_stats *stats = g_ptr_array_index(phases, i);
+    if (strcmp(stats->name, phase) == 0) return stats;
+  }
+  phase_stats *stats = g_new0(phase_stats, 1);
+  stats->name = phase;
+  g_ptr_array_add(phases, stats);
+  return stats;
+}
+
+void stats_record(const char *phase, gint64 start_time, bool success) {
+  phase_stats *stats = get_phase_stats(phase);
+  gint64 elapsed = g_get_monotonic_time() - start_time;
+  guint64 latency_us = elapsed > 0 ? (guint64)elapsed : 0;
+  if (success) {
+    stats->passes++;
+  } else {
+    stats->failures++;
+  }
+  stats->total_us += latency_us;
+  if (latency_us > stats->max_us) stats->max_us = latency_us;
+  size_t bucket = 0;
+  while (bucket < G_N_ELEMENTS(bucket_bounds) && latency_us > bucket_bounds[bucket]) bucket++;
+  stats->buckets[bucket]++;
+}
+
+/// @brief Get the value of a property of `STATS_INTERFACE`.
+/// @param property_name name of the property
+/// @param user_data unused
+/// @return the floating value of the property, or NULL if there is no such property
+GVariant *get_stats_property(const char *property_name, gpointer user_data) {
+  stats_init();
+  if (g_strcmp0(property_name, "StartTime") == 0) return g_variant_new_int64(stats_start_time);
+  if (g_strcmp0(property_name, "BucketBounds") == 0) {
+    return g_variant_new_fixed_array(G_VARIANT_TYPE_UINT64, bucket_bounds,
+        G_N_ELEMENTS(bucket_bounds), sizeof(bucket_bounds[0]));
+  }
+  if (g_strcmp0(property_name, "Phases") == 0) {
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{s(ttttat)}"));
+    for (guint i = 0; i < phases->len; i++) {
+      phase_stats *stats = g_ptr_array_index(phases, i);
+      g_variant_builder_add(&builder, "{s(tttt@at)}", stats->name, stats->passes,
+          stats->failures, stats->total_us, stats->max_us,
+          g_variant_new_fixed_array(
+              G_VARIANT_TYPE_UINT64, stats->buckets, NUM_BUCKETS, sizeof(stats->buckets[0])));
+    }
+    return g_variant_builder_end(&builder);
+  }
+  return NULL;
+}
+
+/// @brief Callback for the reply of `RequestName` for the well-known name of the statistics.
+/// @param reply the reply of the call having the result code, or NULL if the call failed
+/// @param error_name D-Bus name of the error if the call failed (ignored)
+/// @param error_message message of the error if the call failed
+/// @param user_data the well-known name that was requested
+void handle_stats_request_name(
+    GVariant *reply, const char *error_name, const char *error_message, gpointer user_data) {
+  gchar *bus_name = (gchar *)user_data;
+  guint32 result = 0;
+  if (reply) g_variant_get(reply, "(u)", &result);
+  if (result != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+    print_error(
+        "Statistics are not available on the system bus as '%s' (check the D-Bus policy)\n",
+        bus_name);
+  }
+  g_free(bus_name);
+}
+
+void stats_export(dbus_conn *connection, const char *bus_name) {
+  stats_init();
+  gchar *error_message = NULL;
+  if (!dbus_export_properties(connection, STATS_OBJECT_PATH, STATS_XML, STATS_INTERFACE,
+          get_stats_property, NULL, &error_message)) {
+    print_error("Failed to register statistics object: %s\n", error_message);
+    g_free(error_message);
+    return;
+  }
+  // never queue for the name, so a second instance reports that the statistics are unavailable
+  dbus_call(connection, DBUS_OBJECT_NAME, DBUS_OBJECT_PATH, DBUS_INTERFACE, "RequestName",
+      g_variant_new("(su)", bus_name, DBUS_NAME_FLAG_DO_NOT_QUEUE), "(u)", DBUS_CALL_WAIT,
+      handle_stats_request_name, g_strdup(bus_name));
+}
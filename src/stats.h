@@ -0,0 +1,27 @@
+#ifndef _KEEPASSXC_UNLOCK_STATS_H_
+#define _KEEPASSXC_UNLOCK_STATS_H_
+
+#include "common.h"
+
+#define STATS_OBJECT_PATH "/org/keepassxc/Unlock/Stats"
+#define STATS_INTERFACE "org.keepassxc.Unlock.Stats"
+#define STATS_BUS_NAME_PREFIX "org.keepassxc.Unlock"
+
+/// @brief Record the outcome and the latency of a phase of the unlock pipeline. The latency is
+///        added to the histogram of the phase and one of its pass or failure counters is bumped.
+/// @param phase name of the phase which should be a string literal (or otherwise never freed)
+/// @param start_time monotonic time in microseconds (from `g_get_monotonic_time()`) when the
+///                   phase started
+/// @param success `true` if the phase completed successfully else `false`
+extern void stats_record(const char *phase, gint64 start_time, bool success);
+
+/// @brief Publish the recorded statistics as read-only properties of `STATS_INTERFACE` at
+///        `STATS_OBJECT_PATH` on the system bus, and request a well-known name for the scrapers.
+///        Failure to get the name is only logged since the statistics are not essential.
+/// @param connection the connection to the system D-Bus
+/// @param bus_name the well-known name to be owned which should start with `STATS_BUS_NAME_PREFIX`
+///                 so that it is allowed by the D-Bus policy installed for the system bus
+extern void stats_export(dbus_conn *connection, const char *bus_name);
+
+
+#endif /* !_KEEPASSXC_UNLOCK_STATS_H_ */
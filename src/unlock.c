@@ -1,41 +1,83 @@
 #include <fcntl.h>
+#include <gio/gunixfdlist.h>
+#include <glib-unix.h>
 #include <glib.h>
-#include <glob.h>
+#include <linux/fsverity.h>
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
 #include <pwd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "config.h"
+#include "credentials.h"
+#include "secrets.h"
+#include "stats.h"
 
 #define SHA512_BUFFER_SIZE EVP_MAX_MD_SIZE * 2 + 1
+#define MAX_VERITY_DIGEST_SIZE 64    // size of SHA-512, the largest digest supported by fs-verity
+#define VERITY_BUFFER_SIZE 8 + MAX_VERITY_DIGEST_SIZE * 2    // "sha512:" prefix, hex and null
 #define MAX_PASSWORD_SIZE 4096    // maximum allowed size of decrypted password plus one for null
+#define MAX_BUNDLE_SIZE 65536     // maximum allowed size of decrypted credential bundle plus null
+#define CREDS_DECRYPT_TIMEOUT_SECS 30    // deadline of a `systemd-creds decrypt` (like TPM unseal)
+#define SESSION_BUS_CONNECT_TIMEOUT_SECS 10    // deadline of the handshake with the session bus
+#define SESSION_BUS_RECONNECT_MAX_SECS 60    // cap on the doubling delay between reconnections
+#define BUS_LOOKUP_WAIT 5000    // deadline of a lookup of a name on the session bus in milliseconds
+#define BUNDLE_MAGIC "KXUB1"      // header of the decrypted bundle followed by its null
 #define KP_DBUS_INTERFACE "org.keepassxc.KeePassXC.MainWindow"
+#define ENV_MAX_PARALLEL_UNLOCKS "KEEPASSXC_UNLOCK_MAX_PARALLEL"
+#define ENV_UNLOCK_SETTLE_MS "KEEPASSXC_UNLOCK_SETTLE_MS"
+#define ENV_DEFER_SECS "KEEPASSXC_UNLOCK_DEFER_SECS"
+#define ENV_PRESTAGE "KEEPASSXC_UNLOCK_PRESTAGE"
+#define PRESTAGE_VERIFY 1     // verify KeePassXC when the session locks
+#define PRESTAGE_DECRYPT 2    // also decrypt the passwords into the secret cache
+#define DAEMON_STATS_NAME STATS_BUS_NAME_PREFIX ".Daemon"
+#define USER_STATS_NAME_FORMAT STATS_BUS_NAME_PREFIX ".User%u"    // formatted with the user ID
 
 /// @brief Show usage of this program
 /// @param script_name name of the invoking script as obtained from `argv[0]`
 void show_usage(const char *script_name) {
-  printf("\nUsage: %s <USER>\n", script_name);
+  printf("\nUsage: %s <USER_ID> <SESSION_PATH>\n", script_name);
+  printf("       %s --daemon\n", script_name);
   printf("\nMonitor a session for login and screen unlock events to unlock configured KeepassXC "
          "databases\n");
   printf("\nArguments:\n");
   printf("  <USER_ID>       numeric ID of user who owns the session to be monitored\n\n");
-  printf("  <SESSION_ID>    the session ID to be monitored\n\n");
+  printf("  <SESSION_PATH>  the D-Bus path of the session to be monitored\n\n");
+  printf("  --daemon        monitor all the sessions of all the users in this single process\n\n");
   fflush(stdout);
 }
 
-/// @brief Check if given session is locked (i.e. `LockedHint` is true)
+/// @brief Start an asynchronous query of the `LockedHint` property of the given session. The
+///        callback should call `query_locked_hint_finish()` to get the result.
 /// @param connection the `GBusConnection` object for the system D-Bus
 /// @param session_path path of the selected session
-/// @return boolean `LockedHint` property of the session
-bool is_locked(GDBusConnection *connection, const char *session_path) {
-  GError *error = NULL;
-  GVariant *result = g_dbus_connection_call_sync(connection, LOGIN_OBJECT_NAME, session_path,
+/// @param cancellable the `GCancellable` to abort the query, or NULL
+/// @param callback the function to be invoked from the main loop when the query completes
+/// @param user_data custom user data passed through to `callback`
+void query_locked_hint(GDBusConnection *connection, const char *session_path,
+    GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+  g_dbus_connection_call(connection, LOGIN_OBJECT_NAME, session_path,
       "org.freedesktop.DBus.Properties", "Get",
-      g_variant_new("(ss)", "org.freedesktop.login1.Session", "LockedHint"), NULL,
-      G_DBUS_CALL_FLAGS_NONE, DBUS_CALL_WAIT, NULL, &error);
+      g_variant_new("(ss)", LOGIN_SESSION_INTERFACE, "LockedHint"), G_VARIANT_TYPE("(v)"),
+      G_DBUS_CALL_FLAGS_NONE, LOGIN_CALL_WAIT, cancellable, callback, user_data);
+}
+
+/// @brief Get the result of the query started by `query_locked_hint()`.
+/// @param connection the `GBusConnection` object for the system D-Bus
+/// @param res the result passed to the callback of `query_locked_hint()`
+/// @return boolean `LockedHint` property of the session, or `true` if the query failed or was
+///         cancelled
+bool query_locked_hint_finish(GDBusConnection *connection, GAsyncResult *res) {
+  GError *error = NULL;
+  GVariant *result = g_dbus_connection_call_finish(connection, res, &error);
   if (!result) {
-    print_error("Failed to get LockedHint: %s\n", error ? error->message : "(null)");
+    if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      print_error("Failed to get LockedHint: %s\n", error ? error->message : "(null)");
+    }
     g_clear_error(&error);
     return true;
   }
@@ -65,314 +107,2122 @@ void change_euid(uid_t uid) {
   }
 }
 
-/// @brief Get the process ID registered for given D-Bus API on the session bus.
-///        Since this uses the session bus, the call should be done after changing
-///        the effective UID of this process to the target user.
-/// @param dbus_api the D-Bus API that the process has registered
-/// @param log_error if `true`, then D-Bus connection error is logged else not
-/// @return the process ID registered for the D-Bus API or 0 if something went wrong
-guint32 get_dbus_service_process_id(const char *dbus_api, bool log_error) {
-  GError *error = NULL;
-  GDBusConnection *session_conn = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
-  if (!session_conn) {
-    if (log_error) {
-      print_error("Failed to connect to session bus: %s\n", error ? error->message : "(null)");
+/// @brief Holds the long-lived connection to the session bus of the user which is re-established
+///        automatically when the bus goes away (e.g. on logout or a restart of the bus daemon),
+///        and tracks the databases that KeePassXC has unlocked while connected
+typedef struct {
+  uid_t user_id;                        // numeric ID of the user who owns the session bus
+  gchar *address;                       // D-Bus address of the session bus, or NULL till resolved
+  GDBusConnection *conn;                // the current connection, or NULL when disconnected
+  gulong closed_handler_id;             // ID of the handler for `closed` signal of `conn`
+  GCancellable *connect_cancellable;    // abandons the connection attempt in progress
+  guint connect_timeout_id;             // ID of the timeout source for the attempt's deadline
+  gchar *connect_error;                 // message of the last failed connection attempt, or NULL
+  guint reconnect_source_id;            // ID of the timeout source to reconnect, or 0 if none
+  guint reconnect_delay_secs;           // delay of the next reconnection, or 0 after a success
+  guint db_state_id;                    // subscription to the lock state signals of KeePassXC
+  guint kp_owner_id;                    // subscription to `NameOwnerChanged` of KeePassXC
+  GHashTable *unlocked_dbs;             // paths of the databases KeePassXC reported unlocked
+  // invoked when the connection is established, if non-NULL
+  void (*connected_cb)(GDBusConnection *conn, gpointer user_data);
+  // invoked when KeePassXC registers its D-Bus API, if non-NULL
+  void (*kp_appeared_cb)(gpointer user_data);
+  // resolves the address before connecting, returning a new string or NULL if it is unknown
+  gchar *(*resolve_address_cb)(gpointer user_data);
+  gpointer callback_data;    // the `user_data` passed to all the callbacks above
+} session_bus;
+
+/// @brief Drop the current connection to the session bus, if any.
+/// @param bus pointer to the `session_bus` of the user
+void session_bus_disconnect(session_bus *bus) {
+  if (!bus->conn) return;
+  g_signal_handler_disconnect(bus->conn, bus->closed_handler_id);
+  bus->closed_handler_id = 0;
+  g_dbus_connection_signal_unsubscribe(bus->conn, bus->db_state_id);
+  g_dbus_connection_signal_unsubscribe(bus->conn, bus->kp_owner_id);
+  bus->db_state_id = bus->kp_owner_id = 0;
+  g_clear_pointer(&bus->unlocked_dbs, g_hash_table_unref);
+  g_clear_object(&bus->conn);
+}
+
+/// @brief Callback for the `databaseUnlocked` and `databaseLocked` signals of KeePassXC having
+///        the path of the database which keep the set of the unlocked databases up-to-date.
+void handle_kp_db_state_changed(GDBusConnection *conn, const char *sender_name,
+    const char *object_path, const char *interface_name, const char *signal_name,
+    GVariant *parameters, gpointer user_data) {
+  session_bus *bus = (session_bus *)user_data;
+  bool unlocked = g_strcmp0(signal_name, "databaseUnlocked") == 0;
+  if ((!unlocked && g_strcmp0(signal_name, "databaseLocked") != 0) ||
+      !g_variant_is_of_type(parameters, G_VARIANT_TYPE("(s)"))) {
+    return;
+  }
+  const char *kdbx_file = NULL;
+  g_variant_get(parameters, "(&s)", &kdbx_file);
+  gchar *kdbx_path = g_canonicalize_filename(kdbx_file, "/");
+  if (unlocked) {
+    g_hash_table_add(bus->unlocked_dbs, kdbx_path);
+  } else {
+    g_hash_table_remove(bus->unlocked_dbs, kdbx_path);
+    g_free(kdbx_path);
+  }
+}
+
+/// @brief Callback for `NameOwnerChanged` of KeePassXC's D-Bus API which forgets all the unlocked
+///        databases since they belonged to the previous KeePassXC process, if any, and announces
+///        the new KeePassXC process.
+void handle_kp_owner_changed(GDBusConnection *conn, const char *sender_name,
+    const char *object_path, const char *interface_name, const char *signal_name,
+    GVariant *parameters, gpointer user_data) {
+  session_bus *bus = (session_bus *)user_data;
+  g_hash_table_remove_all(bus->unlocked_dbs);
+  const char *new_owner = NULL;
+  g_variant_get(parameters, "(&s&s&s)", NULL, NULL, &new_owner);
+  // empty new owner means that the name went away
+  if (new_owner && *new_owner != '\0' && bus->kp_appeared_cb) {
+    bus->kp_appeared_cb(bus->callback_data);
+  }
+}
+
+/// @brief Get the current connection to the user's session bus.
+/// @param bus pointer to the `session_bus` of the user
+/// @return the `GDBusConnection` object for the session bus which is owned by `bus` and should
+///         not be released, else NULL if not connected
+GDBusConnection *session_bus_get(session_bus *bus) {
+  return bus->conn && !g_dbus_connection_is_closed(bus->conn) ? bus->conn : NULL;
+}
+
+/// @brief Open a socket to the session bus at the given D-Bus address which can only be a `unix:`
+///        one having a `path` or `abstract` key. The socket is connected with the effective UID
+///        of this process switched to the user since the bus takes the credentials of the peer at
+///        the time of the connection (`SO_PEERCRED`) to authenticate it. The connection is made
+///        without blocking, so a bus that is not accepting connections fails right away.
+/// @param address the D-Bus address of the session bus
+/// @param user_id numeric ID of the user who owns the session bus
+/// @param error filled with the error if the connection failed
+/// @return the connected socket as a new `GIOStream`, or NULL if the connection failed
+GIOStream *session_bus_open_stream(const gchar *address, uid_t user_id, GError **error) {
+  GSocketAddress *socket_address = NULL;
+  gchar **params = g_str_has_prefix(address, "unix:") ? g_strsplit(address + 5, ",", -1) : NULL;
+  for (gchar **param = params; param && *param && !socket_address; param++) {
+    if (g_str_has_prefix(*param, "path=") || g_str_has_prefix(*param, "abstract=")) {
+      gchar *value = g_uri_unescape_string(strchr(*param, '=') + 1, NULL);
+      if (value && **param == 'p') {
+        socket_address = g_unix_socket_address_new(value);
+      } else if (value) {
+        socket_address =
+            g_unix_socket_address_new_with_type(value, -1, G_UNIX_SOCKET_ADDRESS_ABSTRACT);
+      }
+      g_free(value);
+    }
+  }
+  g_strfreev(params);
+  if (!socket_address) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Unsupported address");
+    return NULL;
+  }
+
+  GSocket *socket =
+      g_socket_new(G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, error);
+  bool connected = false;
+  if (socket) {
+    g_socket_set_blocking(socket, FALSE);
+    change_euid(user_id);
+    connected = g_socket_connect(socket, socket_address, NULL, error);
+    change_euid(0);
+    g_socket_set_blocking(socket, TRUE);
+  }
+  g_object_unref(socket_address);
+  GIOStream *stream =
+      connected ? G_IO_STREAM(g_socket_connection_factory_create_connection(socket)) : NULL;
+  g_clear_object(&socket);
+  return stream;
+}
+
+void handle_session_bus_closed(
+    GDBusConnection *conn, gboolean remote_peer_vanished, GError *error, gpointer user_data);
+void session_bus_schedule_reconnect(session_bus *bus);
+
+/// @brief Record the failure of a connection attempt to the session bus and retry later.
+/// @param bus pointer to the `session_bus` of the user
+/// @param message the error message of the failure
+void session_bus_connect_failed(session_bus *bus, const char *message) {
+  g_free(bus->connect_error);
+  bus->connect_error = g_strdup_printf("Failed to connect to session bus at '%s': %s",
+      bus->address ? bus->address : "(null)", message);
+  // the bus may have moved (e.g. a per-session bus started afresh), so look it up again
+  if (bus->resolve_address_cb) g_clear_pointer(&bus->address, g_free);
+  session_bus_schedule_reconnect(bus);
+}
+
+/// @brief Abandon the connection attempt to the session bus in progress, if any. Its callback
+///        still runs but finds the attempt cancelled and leaves `bus` alone.
+/// @param bus pointer to the `session_bus` of the user
+void session_bus_abandon_connect(session_bus *bus) {
+  if (bus->connect_timeout_id != 0) {
+    g_source_remove(bus->connect_timeout_id);
+    bus->connect_timeout_id = 0;
+  }
+  if (bus->connect_cancellable) {
+    g_cancellable_cancel(bus->connect_cancellable);
+    g_clear_object(&bus->connect_cancellable);
+  }
+}
+
+/// @brief Timeout callback for the deadline of a connection attempt to the session bus which
+///        abandons the attempt and retries later.
+/// @param user_data pointer to the `session_bus` of the user
+/// @return `G_SOURCE_REMOVE` always
+gboolean handle_session_bus_connect_timeout(gpointer user_data) {
+  session_bus *bus = (session_bus *)user_data;
+  bus->connect_timeout_id = 0;
+  session_bus_abandon_connect(bus);
+  session_bus_connect_failed(bus, "Timed out");
+  return G_SOURCE_REMOVE;
+}
+
+/// @brief Callback for the completion of the D-Bus handshake with the session bus which sets up the
+///        connection and then invokes `connected_cb`, or retries later if the handshake failed.
+/// @param source unused
+/// @param res the result of `g_dbus_connection_new()`
+/// @param user_data pointer to the `session_bus` of the user which is valid only if the attempt was
+///                  not abandoned
+void handle_session_bus_handshake(GObject *source, GAsyncResult *res, gpointer user_data) {
+  GError *error = NULL;
+  // the result of an abandoned attempt is always the cancellation error even if the handshake
+  // went through, so `bus` is not touched after it was abandoned (and possibly released)
+  GDBusConnection *conn = g_dbus_connection_new_finish(res, &error);
+  if (!conn && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    g_clear_error(&error);
+    return;
+  }
+  session_bus *bus = (session_bus *)user_data;
+  g_source_remove(bus->connect_timeout_id);
+  bus->connect_timeout_id = 0;
+  g_clear_object(&bus->connect_cancellable);
+  if (!conn) {
+    session_bus_connect_failed(bus, error ? error->message : "(null)");
+    g_clear_error(&error);
+    return;
+  }
+  print_info("Connected to the session bus for UID=%u\n", bus->user_id);
+  g_clear_pointer(&bus->connect_error, g_free);
+  bus->reconnect_delay_secs = 0;
+  bus->conn = conn;
+  bus->closed_handler_id =
+      g_signal_connect(conn, "closed", G_CALLBACK(handle_session_bus_closed), bus);
+  // databases unlocked before the subscription are not known, so they are treated as locked
+  bus->unlocked_dbs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  bus->db_state_id = g_dbus_connection_signal_subscribe(conn, KP_DBUS_INTERFACE,
+      KP_DBUS_INTERFACE, NULL, "/keepassxc", NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+      handle_kp_db_state_changed, bus, NULL);
+  bus->kp_owner_id = g_dbus_connection_signal_subscribe(conn, "org.freedesktop.DBus",
+      "org.freedesktop.DBus", "NameOwnerChanged", "/org/freedesktop/DBus", KP_DBUS_INTERFACE,
+      G_DBUS_SIGNAL_FLAGS_NONE, handle_kp_owner_changed, bus, NULL);
+  if (bus->connected_cb) bus->connected_cb(conn, bus->callback_data);
+}
+
+/// @brief Start connecting to the user's session bus unless connected already or an attempt is in
+///        progress, in which case `connected_cb` is invoked once done. A reconnection scheduled
+///        for later is done right away. The address is resolved once and kept till a connection
+///        attempt fails. Only the socket is connected synchronously (see
+///        `session_bus_open_stream()`) while the D-Bus handshake is done asynchronously within
+///        `SESSION_BUS_CONNECT_TIMEOUT_SECS`, so that a wedged bus does not block the main loop.
+///        A failed attempt is retried in the background.
+/// @param bus pointer to the `session_bus` of the user
+void session_bus_connect(session_bus *bus) {
+  if (session_bus_get(bus) || bus->connect_cancellable) return;
+  session_bus_disconnect(bus);
+  if (bus->reconnect_source_id != 0) {
+    g_source_remove(bus->reconnect_source_id);
+    bus->reconnect_source_id = 0;
+  }
+  if (!bus->address && bus->resolve_address_cb) {
+    bus->address = bus->resolve_address_cb(bus->callback_data);
+  }
+  if (!bus->address) return;
+
+  GError *error = NULL;
+  GIOStream *stream = session_bus_open_stream(bus->address, bus->user_id, &error);
+  if (!stream) {
+    session_bus_connect_failed(bus, error ? error->message : "(null)");
+    g_clear_error(&error);
+    return;
+  }
+  bus->connect_cancellable = g_cancellable_new();
+  bus->connect_timeout_id = g_timeout_add_seconds(
+      SESSION_BUS_CONNECT_TIMEOUT_SECS, handle_session_bus_connect_timeout, bus);
+  g_dbus_connection_new(stream, NULL,
+      G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+          G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+      NULL, bus->connect_cancellable, handle_session_bus_handshake, bus);
+  g_object_unref(stream);
+}
+
+/// @brief Timeout callback that makes the next attempt to connect to the session bus.
+/// @param user_data pointer to the `session_bus` of the user
+/// @return `G_SOURCE_REMOVE` always
+gboolean reconnect_session_bus(gpointer user_data) {
+  session_bus *bus = (session_bus *)user_data;
+  bus->reconnect_source_id = 0;
+  session_bus_connect(bus);
+  return G_SOURCE_REMOVE;
+}
+
+/// @brief Keep trying to connect to the session bus in the background, if not done already. The
+///        first retry is after a second and the delay doubles for each failed attempt up to
+///        `SESSION_BUS_RECONNECT_MAX_SECS`, so that a bus which stays away is not polled at 1 Hz.
+/// @param bus pointer to the `session_bus` of the user
+void session_bus_schedule_reconnect(session_bus *bus) {
+  if (bus->reconnect_source_id == 0 && !bus->connect_cancellable) {
+    guint delay_secs = MAX(bus->reconnect_delay_secs, 1);
+    bus->reconnect_source_id = g_timeout_add_seconds(delay_secs, reconnect_session_bus, bus);
+    bus->reconnect_delay_secs = MIN(delay_secs * 2, SESSION_BUS_RECONNECT_MAX_SECS);
+  }
+}
+
+/// @brief Callback for the `closed` signal of the session bus connection which schedules
+///        reconnection attempts in the background.
+void handle_session_bus_closed(
+    GDBusConnection *conn, gboolean remote_peer_vanished, GError *error, gpointer user_data) {
+  session_bus *bus = (session_bus *)user_data;
+  print_info("Session bus connection closed: %s\n", error ? error->message : "(no error)");
+  session_bus_disconnect(bus);
+  session_bus_schedule_reconnect(bus);
+}
+
+/// @brief Close the connection to the session bus and release all the resources of `session_bus`.
+/// @param bus pointer to the `session_bus` of the user
+void session_bus_close(session_bus *bus) {
+  session_bus_disconnect(bus);
+  session_bus_abandon_connect(bus);
+  if (bus->reconnect_source_id != 0) {
+    g_source_remove(bus->reconnect_source_id);
+    bus->reconnect_source_id = 0;
+  }
+  g_clear_pointer(&bus->connect_error, g_free);
+  g_free(bus->address);
+  bus->address = NULL;
+}
+
+/// @brief Start looking up the process registered for given D-Bus API on the session bus along
+///        with a pidfd for it. The call is bounded by `BUS_LOOKUP_WAIT`.
+/// @param session_conn the `GDBusConnection` object for the session bus
+/// @param dbus_api the D-Bus API that the process has registered
+/// @param cancellable the `GCancellable` to abort the lookup, or NULL
+/// @param callback invoked on completion which should call `get_dbus_service_process_finish()`
+/// @param user_data the `user_data` passed to `callback`
+void get_dbus_service_process(GDBusConnection *session_conn, const char *dbus_api,
+    GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+  g_dbus_connection_call_with_unix_fd_list(session_conn, "org.freedesktop.DBus", "/",
+      "org.freedesktop.DBus", "GetConnectionCredentials", g_variant_new("(s)", dbus_api),
+      G_VARIANT_TYPE("(a{sv})"), G_DBUS_CALL_FLAGS_NONE, BUS_LOOKUP_WAIT, NULL, cancellable,
+      callback, user_data);
+}
+
+/// @brief Get the result of `get_dbus_service_process()`. The pidfd is taken from the `ProcessFD`
+///        credential of the bus where available (dbus-daemon 1.15.2+ or dbus-broker on Linux 6.5+)
+///        which refers to the exact process that connected to the bus, else it is opened using the
+///        process ID which can race with the process exiting and its ID being reused.
+/// @param session_conn the `GDBusConnection` object for the session bus
+/// @param res the `GAsyncResult` passed to the callback
+/// @param pidfd_ptr pointer to `int` that is filled with the pidfd of the process which should be
+///                  closed after use, or with -1 if no pidfd could be obtained
+/// @return the process ID registered for the D-Bus API or 0 if something went wrong or the lookup
+///         was cancelled
+guint32 get_dbus_service_process_finish(
+    GDBusConnection *session_conn, GAsyncResult *res, int *pidfd_ptr) {
+  *pidfd_ptr = -1;
+  GError *error = NULL;
+  GUnixFDList *fd_list = NULL;
+  GVariant *result =
+      g_dbus_connection_call_with_unix_fd_list_finish(session_conn, &fd_list, res, &error);
+  if (!result) {
+    g_clear_error(&error);
+    return 0;
+  }
+  GVariant *credentials = g_variant_get_child_value(result, 0);
+  guint32 pid = 0;
+  gint32 fd_index = -1;
+  g_variant_lookup(credentials, "ProcessID", "u", &pid);
+  if (pid != 0 && fd_list && g_variant_lookup(credentials, "ProcessFD", "h", &fd_index)) {
+    *pidfd_ptr = g_unix_fd_list_get(fd_list, fd_index, NULL);
+  }
+  g_variant_unref(credentials);
+  g_variant_unref(result);
+  g_clear_object(&fd_list);
+  if (pid != 0 && *pidfd_ptr == -1) *pidfd_ptr = open_process_fd(pid);
+  return pid;
+}
+
+/// @brief Calculate the SHA-512 hash for the file open at the given descriptor and return as a
+///        hexadecimal string in the given buffer.
+/// @param fd descriptor of the file opened for reading positioned at its start
+/// @param cancellable the `GCancellable` checked between the chunks read from the file, or NULL
+/// @param hash_buffer fill the SHA-512 hash as a hexadecimal string with terminating null
+/// @param buffer_size total size of the passed `hash_buffer`
+/// @return length of the filled `hash_buffer` excluding terminating null, else 0 in case of
+///         failure, cancellation or if the buffer is not large enough
+size_t sha512sum_fd(int fd, GCancellable *cancellable, char *hash_buffer, size_t buffer_size) {
+  // read data from the file in chunks and keep updating the checksum
+  unsigned char buffer[32768];
+  ssize_t bytes_read;
+  unsigned char hash[EVP_MAX_MD_SIZE];
+  unsigned int hash_len;
+  // keep on heap to maintain compatibility in the case of change in size of EVP_MD_CTX struct
+  EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(md_ctx, EVP_sha512(), NULL);
+  while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
+    EVP_DigestUpdate(md_ctx, buffer, bytes_read);
+    if (g_cancellable_is_cancelled(cancellable)) break;
+  }
+  bool cancelled = bytes_read > 0;
+  if (bytes_read == -1) {
+    perror("sha512sum() failed to read file");
+  } else if (!cancelled) {
+    EVP_DigestFinal_ex(md_ctx, hash, &hash_len);
+  }
+  EVP_MD_CTX_free(md_ctx);
+  if (bytes_read == -1 || cancelled) return 0;
+
+  // convert bytes to hex string using sprintf which is not efficient but its a tiny fixed overhead
+  size_t buf_len = 0;
+  for (size_t i = 0; i < hash_len; i++, buf_len += 2) {
+    if (buf_len >= buffer_size - 2) return 0;
+    sprintf(hash_buffer + buf_len, "%02x", hash[i]);
+  }
+  hash_buffer[buf_len] = '\0';
+  return buf_len;
+}
+
+/// @brief Get the fs-verity digest of the file open at the given descriptor which is held by the
+///        kernel, so it costs a single `ioctl` irrespective of the size of the file. The kernel
+///        checks all the data read from such a file against the digest, hence it can stand in
+///        for a hash of the whole file.
+/// @param fd descriptor of the file
+/// @param digest_buffer fill the digest as `<algorithm>:<hex>` with terminating null which is the
+///                      format printed by `fsverity measure`
+/// @param buffer_size total size of the passed `digest_buffer`
+/// @return length of the filled `digest_buffer` excluding terminating null, else 0 if fs-verity
+///         is not enabled on the file or is not supported by the kernel or the filesystem
+size_t fsverity_digest_fd(int fd, char *digest_buffer, size_t buffer_size) {
+  struct {
+    struct fsverity_digest header;
+    unsigned char digest[MAX_VERITY_DIGEST_SIZE];
+  } measurement = {.header.digest_size = MAX_VERITY_DIGEST_SIZE};
+  if (ioctl(fd, FS_IOC_MEASURE_VERITY, &measurement) != 0) return 0;
+  const char *algorithm;
+  switch (measurement.header.digest_algorithm) {
+    case FS_VERITY_HASH_ALG_SHA256:
+      algorithm = "sha256";
+      break;
+    case FS_VERITY_HASH_ALG_SHA512:
+      algorithm = "sha512";
+      break;
+    default:
+      return 0;
+  }
+  size_t buf_len = (size_t)snprintf(digest_buffer, buffer_size, "%s:", algorithm);
+  for (size_t i = 0; i < measurement.header.digest_size; i++, buf_len += 2) {
+    if (buf_len >= buffer_size - 2) return 0;
+    sprintf(digest_buffer + buf_len, "%02x", measurement.digest[i]);
+  }
+  return buf_len;
+}
+
+/// @brief Get the start time of a process (in clock ticks since boot) from `/proc/<pid>/stat`.
+/// @param pid the ID of the process
+/// @return the start time of the process, or 0 if it could not be read
+guint64 get_process_start_time(guint32 pid) {
+  char stat_file[64], stat_line[1024];
+  snprintf(stat_file, sizeof(stat_file), "/proc/%u/stat", pid);
+  FILE *file = fopen(stat_file, "r");
+  if (!file) return 0;
+  char *line = fgets(stat_line, sizeof(stat_line), file);
+  fclose(file);
+  // the command name in brackets can have spaces, so skip to the last closing bracket after which
+  // `starttime` is the 20th field (field 22 in proc(5))
+  char *fields = line ? strrchr(line, ')') : NULL;
+  if (!fields) return 0;
+  gchar **tokens = g_strsplit(fields + 2, " ", 21);
+  guint64 start_time = g_strv_length(tokens) > 19 ? g_ascii_strtoull(tokens[19], NULL, 10) : 0;
+  g_strfreev(tokens);
+  return start_time;
+}
+
+#define MAX_EXE_DIGEST_CACHE_SIZE 16
+
+/// @brief Cache of the SHA-512 digests of executables keyed by the identity of the file (device,
+///        inode, size, modification and change times) and of the process running it
+static GHashTable *exe_digest_cache = NULL;
+
+/// @brief Get the key of the executable of a process in `exe_digest_cache`. Any change to the
+///        identity of the file or of the process gives a different key.
+/// @param pid the ID of the process
+/// @param st the `struct stat` of the executable obtained from the descriptor being hashed
+/// @return the key that should be released with `g_free()` after use, or NULL if the process
+///         start time could not be read
+gchar *get_exe_digest_cache_key(guint32 pid, const struct stat *st) {
+  guint64 start_time = get_process_start_time(pid);
+  if (start_time == 0) return NULL;
+  return g_strdup_printf("%u:%" G_GUINT64_FORMAT ":%lu:%lu:%ld:%ld.%09ld:%ld.%09ld", pid,
+      start_time, (unsigned long)st->st_dev, (unsigned long)st->st_ino, (long)st->st_size,
+      (long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec, (long)st->st_ctim.tv_sec,
+      st->st_ctim.tv_nsec);
+}
+
+/// @brief Add the SHA-512 digest of an executable to `exe_digest_cache`.
+/// @param cache_key the key from `get_exe_digest_cache_key()` which is owned by the cache
+/// @param sha512 the SHA-512 hash of the executable as a hexadecimal string
+void exe_digest_cache_add(gchar *cache_key, const char *sha512) {
+  if (!exe_digest_cache) {
+    exe_digest_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  }
+  // entries of processes that have exited are never looked up again, so just start afresh when
+  // the cache gets full
+  if (g_hash_table_size(exe_digest_cache) >= MAX_EXE_DIGEST_CACHE_SIZE) {
+    g_hash_table_remove_all(exe_digest_cache);
+  }
+  g_hash_table_replace(exe_digest_cache, cache_key, g_strdup(sha512));
+}
+
+/// @brief Verify that a KeePassXC process which is not in the cgroup of any session belongs to the
+///        selected session. This is done by comparing the $DISPLAY variable of the process with the
+///        `Display` property of the session for X11, or checking that $WAYLAND_DISPLAY is
+///        non-empty for Wayland.
+/// @param kp_pid process ID of KeePassXC
+/// @param is_wayland `true` if the session is a Wayland one, else `false` if it is X11
+/// @param display the $DISPLAY variable for the session as retrieved from its `Display` property
+/// @return `true` if the KeePassXC is running in the session else `false`
+bool verify_process_session(guint32 kp_pid, bool is_wayland, const gchar *display) {
+  // the `Display` property of the session is not set for the case of Wayland, and there is no way
+  // to check from the environment if this is the same Wayland session so just check that
+  // $WAYLAND_DISPLAY is not non-empty, while for the case of X11, the value of $DISPLAY should
+  // match the passed `Display` session property
+  const char *env_vars[] = {is_wayland ? "WAYLAND_DISPLAY" : "DISPLAY", NULL};
+  gchar *env_value = NULL;
+  if (!get_process_env_vars(kp_pid, env_vars, &env_value)) return false;
+  bool success = is_wayland ? env_value && *env_value != '\0' : g_strcmp0(env_value, display) == 0;
+  g_free(env_value);
+  return success;
+}
+
+/// @brief Callback for the `Notify` call of `report_exe_sha512_mismatch()` which logs its failure.
+/// @param source the `GDBusConnection` object for the session bus
+/// @param res the result of the asynchronous call
+/// @param user_data unused
+void handle_notify_reply(GObject *source, GAsyncResult *res, gpointer user_data) {
+  GError *error = NULL;
+  GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+  if (result) {
+    g_variant_unref(result);
+  } else {
+    print_error("Failed to notify checksum mismatch: %s\n", error ? error->message : "(null)");
+    g_clear_error(&error);
+  }
+}
+
+/// @brief Log the mismatch of the checksum of the KeePassXC executable against the recorded one and
+///        notify the user about it on the desktop using the notification D-Bus API.
+/// @param session_conn the `GDBusConnection` object for the user's session bus, or NULL to skip
+///                     the notification
+/// @param kp_pid process ID of KeePassXC
+void report_exe_sha512_mismatch(GDBusConnection *session_conn, guint32 kp_pid) {
+  char kp_exe[128];
+  snprintf(kp_exe, sizeof(kp_exe), "/proc/%u/exe", kp_pid);
+  // `kp_exe_full` stores the actual executable that /proc/<pid>/exe points to, while
+  // `kp_exe_real` will either point to it or /proc/<pid>/exe in case `readlink` was unsuccessful
+  char kp_exe_full[PATH_MAX], *kp_exe_real = kp_exe;
+  ssize_t kp_full_len = readlink(kp_exe, kp_exe_full, sizeof(kp_exe_full) - 1);
+  if (kp_full_len > 0) {
+    kp_exe_full[kp_full_len] = '\0';
+    kp_exe_real = kp_exe_full;
+  }
+  print_error("\033[1;33mAborting unlock due to checksum mismatch in keepassxc (PID %u EXE %s)"
+              "\033[00m\n",
+      kp_pid, kp_exe_real);
+  if (!session_conn) return;
+
+  gchar *body = g_strdup_printf("If KeePassXC has been updated, then run "
+                                "\"sudo keepassxc-unlock-setup ...\" for one of the KDBX "
+                                "databases.\nOtherwise this could be an unknown process snooping "
+                                "on D-Bus.\nThe offending process ID is %u having executable "
+                                "pointing to %s",
+      kp_pid, kp_exe_real);
+  const gchar *actions[] = {NULL};
+  GVariantBuilder hints;
+  g_variant_builder_init(&hints, G_VARIANT_TYPE("a{sv}"));
+  g_variant_builder_add(&hints, "{sv}", "urgency", g_variant_new_byte(2));    // critical
+  // expiry timeout of 0 keeps the notification till the user dismisses it
+  g_dbus_connection_call(session_conn, "org.freedesktop.Notifications",
+      "/org/freedesktop/Notifications", "org.freedesktop.Notifications", "Notify",
+      g_variant_new("(susss^asa{sv}i)", "keepassxc-unlock", 0, "system-lock-screen",
+          "Checksum mismatch in keepassxc", body, actions, &hints, 0),
+      G_VARIANT_TYPE("(u)"), G_DBUS_CALL_FLAGS_NONE, DBUS_CALL_WAIT, NULL, handle_notify_reply,
+      NULL);
+  g_free(body);
+}
+
+/// @brief A KDBX database with its decrypted password that is ready to be sent to KeePassXC
+typedef struct {
+  gchar *kdbx_file;    // path of the KDBX database
+  gchar *key_file;     // path of the key file, or empty if none
+  gchar *password;     // the decrypted password in a `MAX_PASSWORD_SIZE` buffer
+} db_unlock_request;
+
+/// @brief Wipe the decrypted password and release the `db_unlock_request`.
+/// @param request pointer to the `db_unlock_request` to be released
+void db_unlock_request_free(db_unlock_request *request) {
+  if (!request) return;
+  if (request->password) {
+    OPENSSL_cleanse(request->password, MAX_PASSWORD_SIZE);
+    g_free(request->password);
+  }
+  g_free(request->kdbx_file);
+  g_free(request->key_file);
+  g_free(request);
+}
+
+/// @brief Create a `db_unlock_request` for a KDBX database configuration.
+/// @param db the `db_config` of the database
+/// @param password the decrypted password in a `MAX_PASSWORD_SIZE` buffer which is owned by the
+///                 returned request
+/// @return a new `db_unlock_request` that should be released with `db_unlock_request_free()`
+db_unlock_request *db_unlock_request_new(db_config *db, char *password) {
+  db_unlock_request *request = g_new0(db_unlock_request, 1);
+  request->kdbx_file = g_strdup(db->kdbx_file);
+  request->key_file = g_strdup(db->key_file);
+  request->password = password;
+  return request;
+}
+
+/// @brief State of an asynchronous decryption of a credential which is the task data of its
+///        `GTask`
+typedef struct {
+  GSubprocess *proc;         // the `systemd-creds` process, or NULL if decrypted in-process
+  gchar *label;              // the file that the credential belongs to used in the error messages
+  char *plain_buffer;        // buffer to be filled with the decrypted credential
+  size_t buffer_size;        // total size of `plain_buffer`
+  size_t *plain_len_ptr;     // filled with the length of the decrypted credential
+  guint timeout_id;          // ID of the timeout source for the deadline of `proc`, or 0
+  bool timed_out;            // `true` if `proc` was killed for missing its deadline
+  gint64 start_time;         // monotonic time in microseconds when the decryption started
+} credential_decryption;
+
+/// @brief Release the `credential_decryption` killing its `systemd-creds` process if running.
+void credential_decryption_free(gpointer data) {
+  credential_decryption *decryption = (credential_decryption *)data;
+  if (decryption->timeout_id != 0) g_source_remove(decryption->timeout_id);
+  if (decryption->proc) {
+    g_subprocess_force_exit(decryption->proc);
+    g_object_unref(decryption->proc);
+  }
+  g_free(decryption->label);
+  g_free(decryption);
+}
+
+/// @brief Timeout callback for the deadline of a `systemd-creds` decryption which kills it, so that
+///        a hung TPM does not hold up the unlock.
+/// @param user_data pointer to the `credential_decryption`
+/// @return `G_SOURCE_REMOVE` always
+gboolean handle_creds_decrypt_timeout(gpointer user_data) {
+  credential_decryption *decryption = (credential_decryption *)user_data;
+  decryption->timeout_id = 0;
+  decryption->timed_out = true;
+  g_subprocess_force_exit(decryption->proc);
+  return G_SOURCE_REMOVE;
+}
+
+/// @brief Callback for the completion of the output of `systemd-creds decrypt` which copies the
+///        decrypted credential into the buffer of the decryption and completes its task.
+/// @param source the `GSubprocess` of `systemd-creds`
+/// @param res the result of the asynchronous communication
+/// @param user_data the `GTask` of the decryption
+void handle_creds_decrypt_output(GObject *source, GAsyncResult *res, gpointer user_data) {
+  GTask *task = G_TASK(user_data);
+  credential_decryption *decryption = g_task_get_task_data(task);
+  GError *error = NULL;
+  GBytes *output = NULL;
+  bool success = g_subprocess_communicate_finish(decryption->proc, res, &output, NULL, &error) &&
+                 g_subprocess_get_successful(decryption->proc);
+  if (decryption->timed_out) {
+    print_error("Timed out decrypting credential of '%s' after %d secs\n", decryption->label,
+        CREDS_DECRYPT_TIMEOUT_SECS);
+  } else if (error && !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    print_error("Failed to decrypt credential of '%s': %s\n", decryption->label, error->message);
+  }
+  g_clear_error(&error);
+  if (output) {
+    gsize plain_len = 0;
+    guchar *plain = (guchar *)g_bytes_get_data(output, &plain_len);
+    if (success && plain_len >= decryption->buffer_size) {
+      print_error("Credential of '%s' exceeds %zu characters!\n", decryption->label,
+          decryption->buffer_size - 1);
+      success = false;
+    } else if (success) {
+      memcpy(decryption->plain_buffer, plain, plain_len);
+      decryption->plain_buffer[plain_len] = '\0';
+      *decryption->plain_len_ptr = plain_len;
+    }
+    if (plain) OPENSSL_cleanse(plain, plain_len);
+    g_bytes_unref(output);
+  }
+  stats_record("decrypt", decryption->start_time, success);
+  g_task_return_boolean(task, success);
+  g_object_unref(task);
+}
+
+/// @brief Decrypt a credential in-process if possible, else using `systemd-creds` for the
+///        credential types that are not handled natively (e.g. TPM2 sealed ones) without blocking
+///        the main loop. The encrypted credential is fed through the stdin of `systemd-creds`
+///        which is killed if it does not finish within `CREDS_DECRYPT_TIMEOUT_SECS` or the
+///        decryption is cancelled. A host key credential that fails natively is not retried since
+///        systemd-creds would fail the same. The result is always delivered from the main loop.
+/// @param creds_ctx the `creds_context` shared by all decryptions of the unlock pass
+/// @param cred_name expected name of the credential that is embedded in the encrypted data
+/// @param encoded the base64 encoded encrypted credential which is used only till this returns
+/// @param label the file that the credential belongs to which is used in the error messages
+/// @param plain_buffer buffer to be filled with the decrypted credential plus a terminating null
+///                     which should be kept valid till the completion
+/// @param buffer_size total size of the passed `plain_buffer`
+/// @param plain_len_ptr pointer to `size_t` that is filled with the length of decrypted credential
+/// @param cancellable the `GCancellable` to abort the decryption, or NULL
+/// @param callback invoked on completion which should call `decrypt_any_credential_finish()`
+/// @param user_data the `user_data` passed to `callback`
+void decrypt_any_credential_async(creds_context *creds_ctx, const char *cred_name,
+    const char *encoded, const char *label, char *plain_buffer, size_t buffer_size,
+    size_t *plain_len_ptr, GCancellable *cancellable, GAsyncReadyCallback callback,
+    gpointer user_data) {
+  GTask *task = g_task_new(NULL, cancellable, callback, user_data);
+  credential_decryption *decryption = g_new0(credential_decryption, 1);
+  decryption->label = g_strdup(label);
+  decryption->plain_buffer = plain_buffer;
+  decryption->buffer_size = buffer_size;
+  decryption->plain_len_ptr = plain_len_ptr;
+  decryption->start_time = g_get_monotonic_time();
+  g_task_set_task_data(task, decryption, credential_decryption_free);
+
+  cred_decrypt_status status =
+      decrypt_credential(creds_ctx, cred_name, encoded, plain_buffer, buffer_size, plain_len_ptr);
+  if (status != CRED_UNSUPPORTED) {
+    stats_record("decrypt", decryption->start_time, status == CRED_DECRYPTED);
+    g_task_return_boolean(task, status == CRED_DECRYPTED);
+    g_object_unref(task);
+    return;
+  }
+
+  GError *error = NULL;
+  gchar *name_arg = g_strdup_printf("--name=%s", cred_name);
+  const gchar *argv[] = {"systemd-creds", name_arg, "decrypt", "-", "-", NULL};
+  decryption->proc = g_subprocess_newv(
+      argv, G_SUBPROCESS_FLAGS_STDIN_PIPE | G_SUBPROCESS_FLAGS_STDOUT_PIPE, &error);
+  g_free(name_arg);
+  if (!decryption->proc) {
+    print_error("Failed to run systemd-creds for decryption: %s\n",
+        error ? error->message : "(null)");
+    g_clear_error(&error);
+    stats_record("decrypt", decryption->start_time, false);
+    g_task_return_boolean(task, false);
+    g_object_unref(task);
+    return;
+  }
+  decryption->timeout_id =
+      g_timeout_add_seconds(CREDS_DECRYPT_TIMEOUT_SECS, handle_creds_decrypt_timeout, decryption);
+  GBytes *input = g_bytes_new(encoded, strlen(encoded));
+  g_subprocess_communicate_async(
+      decryption->proc, input, cancellable, handle_creds_decrypt_output, task);
+  g_bytes_unref(input);
+}
+
+/// @brief Get the result of `decrypt_any_credential_async()`.
+/// @param res the `GAsyncResult` passed to the callback
+/// @return `true` if the decryption was successful else `false` in case of failure (which is
+///         logged) or cancellation
+bool decrypt_any_credential_finish(GAsyncResult *res) {
+  return g_task_propagate_boolean(G_TASK(res), NULL);
+}
+
+/// @brief The credential bundle of a user (see `user_config_get_bundle()`) which is decrypted at
+///        most once in an unlock pass when the first password missing from the cache is needed
+typedef struct {
+  gchar *encrypted;    // snapshot of the encrypted bundle, or NULL if the user has none
+  bool loaded;         // `true` if decrypting the bundle has already been attempted
+  gchar *plain;        // the decrypted bundle in a `MAX_BUNDLE_SIZE` buffer, or NULL
+  size_t plain_len;    // length of the decrypted bundle in `plain`
+} credential_bundle;
+
+/// @brief Wipe the decrypted bundle and release the fields of the `credential_bundle`.
+/// @param bundle pointer to the `credential_bundle` to be cleared
+void credential_bundle_clear(credential_bundle *bundle) {
+  if (bundle->plain) {
+    OPENSSL_cleanse(bundle->plain, MAX_BUNDLE_SIZE);
+    g_free(bundle->plain);
+  }
+  g_free(bundle->encrypted);
+  memset(bundle, 0, sizeof(*bundle));
+}
+
+/// @brief Check the credential bundle after its decryption was attempted, and drop it if it could
+///        not be decrypted or is invalid.
+/// @param bundle pointer to the `credential_bundle` of the user
+/// @param decrypted `true` if the bundle was decrypted
+/// @param cancellable the `GCancellable` of the decryption
+void credential_bundle_loaded(
+    credential_bundle *bundle, bool decrypted, GCancellable *cancellable) {
+  if (!decrypted || bundle->plain_len < sizeof(BUNDLE_MAGIC) ||
+      memcmp(bundle->plain, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0) {
+    if (!g_cancellable_is_cancelled(cancellable)) {
+      print_error("Ignoring invalid or undecryptable credential bundle '%s'\n", BUNDLE_FILE_NAME);
+    }
+    OPENSSL_cleanse(bundle->plain, MAX_BUNDLE_SIZE);
+    g_clear_pointer(&bundle->plain, g_free);
+  }
+}
+
+/// @brief Find the password of a KDBX database in the decrypted credential bundle. The bundle is
+///        a `BUNDLE_MAGIC` header followed by a record for each database made of the null
+///        terminated database path, key file path and password. Only a record that matches both
+///        paths of the configuration is used, so that a stale bundle falls back to the separate
+///        credential of the database.
+/// @param bundle pointer to the `credential_bundle` of the user
+/// @param db the `db_config` of the database
+/// @param passwd_buffer buffer of size `MAX_PASSWORD_SIZE` to be filled with the password
+/// @return `true` if the password was found else `false`
+bool credential_bundle_lookup(credential_bundle *bundle, db_config *db, char *passwd_buffer) {
+  if (!bundle->plain) return false;
+
+  // the buffer has a terminating null beyond `plain_len`, so `strlen` cannot run past it
+  const char *end = bundle->plain + bundle->plain_len;
+  const char *ptr = bundle->plain + sizeof(BUNDLE_MAGIC);
+  while (ptr < end) {
+    const char *kdbx_file = ptr;
+    const char *key_file = kdbx_file + strlen(kdbx_file) + 1;
+    if (key_file >= end) break;
+    const char *passwd = key_file + strlen(key_file) + 1;
+    if (passwd >= end) break;
+    size_t passwd_len = strlen(passwd);
+    ptr = passwd + passwd_len + 1;
+    if (strcmp(kdbx_file, db->kdbx_file) == 0 && strcmp(key_file, db->key_file) == 0 &&
+        passwd_len < MAX_PASSWORD_SIZE) {
+      memcpy(passwd_buffer, passwd, passwd_len + 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+/// @brief Selects the databases that are processed by an unlock pass
+typedef enum {
+  UNLOCK_ALL_DBS,         // all the databases of the user
+  UNLOCK_PRIORITY_DBS,    // the databases having a non-negative priority
+  UNLOCK_DEFERRED_DBS,    // the low priority databases (negative priority) that were deferred
+} unlock_selection;
+
+/// @brief Moving averages of the latencies of `openDatabase` calls in microseconds keyed by the
+///        path of the database
+static GHashTable *open_db_latencies = NULL;
+
+/// @brief Add the latency of a successful `openDatabase` call to the moving average of the
+///        database.
+/// @param kdbx_file path of the KDBX database
+/// @param latency latency of the call in microseconds
+void record_open_db_latency(const char *kdbx_file, gint64 latency) {
+  if (!open_db_latencies) {
+    open_db_latencies = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  }
+  gint64 *average = g_hash_table_lookup(open_db_latencies, kdbx_file);
+  if (average) {
+    *average += (latency - *average) / 4;
+  } else {
+    average = g_new(gint64, 1);
+    *average = latency;
+    g_hash_table_insert(open_db_latencies, g_strdup(kdbx_file), average);
+  }
+}
+
+/// @brief Get the average latency of the `openDatabase` calls of a database.
+/// @param kdbx_file path of the KDBX database
+/// @return the average latency in microseconds, or 0 if the database has not been opened yet
+gint64 get_open_db_latency(const char *kdbx_file) {
+  gint64 *average = open_db_latencies ? g_hash_table_lookup(open_db_latencies, kdbx_file) : NULL;
+  return average ? *average : 0;
+}
+
+/// @brief Order the databases of an unlock pass by descending priorities, then the ones with
+///        shorter measured `openDatabase` latencies first so that most of the databases are
+///        available sooner, and finally by their names.
+gint compare_db_unlock_order(gconstpointer a, gconstpointer b) {
+  const db_config *db1 = *(db_config *const *)a, *db2 = *(db_config *const *)b;
+  if (db1->priority != db2->priority) return db1->priority > db2->priority ? -1 : 1;
+  gint64 latency1 = get_open_db_latency(db1->kdbx_file);
+  gint64 latency2 = get_open_db_latency(db2->kdbx_file);
+  if (latency1 != latency2) return latency1 < latency2 ? -1 : 1;
+  return strcmp(db1->name, db2->name);
+}
+
+/// @brief Holds the state of an asynchronous unlock pass which decrypts the passwords of the
+///        databases one by one while the previously sent `openDatabase` calls are in flight
+typedef struct {
+  GDBusConnection *session_conn;    // reference to the connection to the user's session bus
+  uid_t user_id;                    // numeric ID of the user owning the databases
+  GPtrArray *dbs;                   // the KDBX database configurations to be processed
+  guint next_db;                    // index of the next database configuration in `dbs`
+  creds_context creds_ctx;          // context shared by all the decryptions of this pass
+  credential_bundle bundle;         // credential bundle of the user decrypted at most once
+  db_unlock_request *staged;        // next decrypted database waiting for a free call slot
+  char *decrypting_passwd;          // password buffer of the database being decrypted, or NULL
+  guint in_flight;                  // number of `openDatabase` calls currently in flight
+  guint max_in_flight;              // maximum number of concurrent `openDatabase` calls
+  guint num_unlocked;               // number of databases unlocked successfully
+  guint num_skipped;                // number of databases skipped as KeePassXC had them unlocked
+  GPtrArray *failures;              // error messages for the databases that failed to unlock
+  gint64 start_time;                // monotonic time in microseconds when the pass started
+  gint64 trigger_time;              // monotonic time in microseconds of the triggering event
+  GCancellable *cancellable;        // aborts the pass when the session locks or goes away
+  GSourceFunc finished_cb;          // invoked with `finished_data` once the pass is done
+  gpointer finished_data;           // the `user_data` passed to `finished_cb`
+} unlock_pass;
+
+/// @brief State of an asynchronous decryption of the password of a KDBX database which is the task
+///        data of its `GTask`
+typedef struct {
+  creds_context *creds_ctx;     // the `creds_context` shared by all the decryptions
+  credential_bundle *bundle;    // the credential bundle of the user
+  db_config *db;                // the configuration of the database
+  char *passwd_buffer;          // buffer of size `MAX_PASSWORD_SIZE` to be filled with the password
+  size_t passwd_len;            // length of the decrypted password
+} db_password_decryption;
+
+/// @brief Callback for the decryption of the separate credential of a database which completes the
+///        task of `decrypt_db_password_async()`.
+void handle_db_credential_decrypted(GObject *source, GAsyncResult *res, gpointer user_data) {
+  GTask *task = G_TASK(user_data);
+  g_task_return_boolean(task, decrypt_any_credential_finish(res));
+  g_object_unref(task);
+}
+
+/// @brief Look up the password of the database of the task in the decrypted credential bundle,
+///        else start the decryption of its separate credential.
+/// @param task the `GTask` of `decrypt_db_password_async()`
+void decrypt_db_credential(GTask *task) {
+  db_password_decryption *decryption = g_task_get_task_data(task);
+  db_config *db = decryption->db;
+  if (credential_bundle_lookup(decryption->bundle, db, decryption->passwd_buffer)) {
+    g_task_return_boolean(task, true);
+    g_object_unref(task);
+    return;
+  }
+  decrypt_any_credential_async(decryption->creds_ctx, db->name, db->encrypted_passwd,
+      db->kdbx_file, decryption->passwd_buffer, MAX_PASSWORD_SIZE, &decryption->passwd_len,
+      g_task_get_cancellable(task), handle_db_credential_decrypted, task);
+}
+
+/// @brief Callback for the decryption of the credential bundle which continues with the lookup of
+///        the password of the database.
+void handle_bundle_decrypted(GObject *source, GAsyncResult *res, gpointer user_data) {
+  GTask *task = G_TASK(user_data);
+  db_password_decryption *decryption = g_task_get_task_data(task);
+  credential_bundle_loaded(
+      decryption->bundle, decrypt_any_credential_finish(res), g_task_get_cancellable(task));
+  if (g_task_return_error_if_cancelled(task)) {
+    g_object_unref(task);
+    return;
+  }
+  decrypt_db_credential(task);
+}
+
+/// @brief Decrypt the password of a KDBX database configuration using the credential bundle of the
+///        user if possible (decrypting the bundle on first use), else by decrypting the separate
+///        credential of the database. None of the passed pointers are owned and they should stay
+///        valid till the completion.
+/// @param creds_ctx the `creds_context` shared by all the decryptions
+/// @param bundle pointer to the `credential_bundle` of the user
+/// @param db the `db_config` of the database
+/// @param passwd_buffer buffer of size `MAX_PASSWORD_SIZE` to be filled with the password
+/// @param cancellable the `GCancellable` to abort the decryption, or NULL
+/// @param callback invoked on completion which should call `decrypt_db_password_finish()`
+/// @param user_data the `user_data` passed to `callback`
+void decrypt_db_password_async(creds_context *creds_ctx, credential_bundle *bundle, db_config *db,
+    char *passwd_buffer, GCancellable *cancellable, GAsyncReadyCallback callback,
+    gpointer user_data) {
+  GTask *task = g_task_new(NULL, cancellable, callback, user_data);
+  db_password_decryption *decryption = g_new0(db_password_decryption, 1);
+  decryption->creds_ctx = creds_ctx;
+  decryption->bundle = bundle;
+  decryption->db = db;
+  decryption->passwd_buffer = passwd_buffer;
+  g_task_set_task_data(task, decryption, g_free);
+  if (bundle->encrypted && !bundle->loaded) {
+    bundle->loaded = true;
+    bundle->plain = g_malloc0(MAX_BUNDLE_SIZE);
+    decrypt_any_credential_async(creds_ctx, BUNDLE_CRED_NAME, bundle->encrypted,
+        BUNDLE_FILE_NAME, bundle->plain, MAX_BUNDLE_SIZE, &bundle->plain_len, cancellable,
+        handle_bundle_decrypted, task);
+  } else {
+    decrypt_db_credential(task);
+  }
+}
+
+/// @brief Get the result of `decrypt_db_password_async()`.
+/// @param res the `GAsyncResult` passed to the callback
+/// @return `true` if the password was decrypted else `false` in case of failure (which is logged)
+///         or cancellation
+bool decrypt_db_password_finish(GAsyncResult *res) {
+  return g_task_propagate_boolean(G_TASK(res), NULL);
+}
+
+/// @brief Holds the `user_data` passed to the `handle_open_database_reply` callback
+typedef struct {
+  unlock_pass *pass;    // the unlock pass that sent the call
+  gchar *kdbx_file;     // path of the KDBX database being unlocked
+  gint64 start_time;    // monotonic time in microseconds when the call was sent
+} open_db_call;
+
+void unlock_pass_fill(unlock_pass *pass);
+
+/// @brief Callback for the decryption of the password of the last database taken up by the unlock
+///        pass which stages it for unlock, or skips the database if the decryption failed.
+/// @param source unused
+/// @param res the result of `decrypt_db_password_async()`
+/// @param user_data pointer to the `unlock_pass`
+void handle_pass_password_decrypted(GObject *source, GAsyncResult *res, gpointer user_data) {
+  unlock_pass *pass = (unlock_pass *)user_data;
+  db_config *db = g_ptr_array_index(pass->dbs, pass->next_db - 1);
+  char *passwd = pass->decrypting_passwd;
+  pass->decrypting_passwd = NULL;
+  if (decrypt_db_password_finish(res)) {
+    secret_cache_store(pass->user_id, db->name, passwd, secret_cache_get_ttl());
+    pass->staged = db_unlock_request_new(db, passwd);
+  } else {
+    OPENSSL_cleanse(passwd, MAX_PASSWORD_SIZE);
+    g_free(passwd);
+  }
+  unlock_pass_fill(pass);
+}
+
+/// @brief Report the results gathered for all the databases and release the unlock pass.
+/// @param pass pointer to the `unlock_pass` that has no more work left
+void unlock_pass_finish(unlock_pass *pass) {
+  guint num_failed = pass->failures->len;
+  for (guint i = 0; i < num_failed; i++) {
+    print_error("%s\n", (const char *)g_ptr_array_index(pass->failures, i));
+  }
+  if (g_cancellable_is_cancelled(pass->cancellable)) {
+    print_info("Aborted unlock after unlocking %u of %u database(s) in %ld ms\n",
+        pass->num_unlocked, pass->dbs->len,
+        (long)((g_get_monotonic_time() - pass->start_time) / 1000));
+  } else if (pass->num_skipped != 0) {
+    print_info("Unlocked %u of %u database(s) in %ld ms, %u were already unlocked\n",
+        pass->num_unlocked, pass->num_unlocked + num_failed,
+        (long)((g_get_monotonic_time() - pass->start_time) / 1000), pass->num_skipped);
+  } else {
+    print_info("Unlocked %u of %u database(s) in %ld ms\n", pass->num_unlocked,
+        pass->num_unlocked + num_failed,
+        (long)((g_get_monotonic_time() - pass->start_time) / 1000));
+  }
+  // databases that failed to decrypt are not in `failures` but are still missing from the count
+  stats_record("unlock", pass->trigger_time, pass->num_unlocked == pass->dbs->len);
+  // pre-staged passwords are kept only till the unlock they were meant for when caching is off,
+  // while those of an aborted unlock are left for the next one
+  if (secret_cache_get_ttl() == 0 && !g_cancellable_is_cancelled(pass->cancellable)) {
+    secret_cache_wipe(pass->user_id, NULL);
+  }
+  g_ptr_array_unref(pass->dbs);
+  creds_context_clear(&pass->creds_ctx);
+  credential_bundle_clear(&pass->bundle);
+  g_ptr_array_unref(pass->failures);
+  g_object_unref(pass->session_conn);
+  g_clear_object(&pass->cancellable);
+  if (pass->finished_cb) pass->finished_cb(pass->finished_data);
+  g_free(pass);
+}
+
+/// @brief Callback for completion of an asynchronous `openDatabase` call which records the result
+///        and then sends more calls if any databases are left.
+/// @param source the `GDBusConnection` object for the session bus
+/// @param res the result of the asynchronous call
+/// @param user_data pointer to the `open_db_call` for the call
+void handle_open_database_reply(GObject *source, GAsyncResult *res, gpointer user_data) {
+  open_db_call *call = (open_db_call *)user_data;
+  unlock_pass *pass = call->pass;
+  GError *error = NULL;
+  GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+  if (result) {
+    stats_record("open_database", call->start_time, true);
+    record_open_db_latency(call->kdbx_file, g_get_monotonic_time() - call->start_time);
+    pass->num_unlocked++;
+    g_variant_unref(result);
+  } else if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    g_clear_error(&error);
+  } else {
+    stats_record("open_database", call->start_time, false);
+    g_ptr_array_add(pass->failures, g_strdup_printf("Failed to unlock database '%s': %s",
+                                        call->kdbx_file, error ? error->message : "(null)"));
+    g_clear_error(&error);
+  }
+  g_free(call->kdbx_file);
+  g_free(call);
+
+  pass->in_flight--;
+  unlock_pass_fill(pass);
+}
+
+/// @brief Send as many `openDatabase` calls as allowed by the concurrency limit, then decrypt the
+///        next database ahead of time so that it is ready when a call slot frees up. The password
+///        is taken from the secret cache if caching has been enabled or it was pre-staged, else it
+///        is decrypted asynchronously and the pass resumes once that completes. Finishes the pass
+///        once all the databases have been processed and no call or decryption is in flight.
+///        Once the pass is cancelled, the staged password is wiped and nothing more is decrypted or
+///        sent.
+/// @param pass pointer to the `unlock_pass` to be advanced
+void unlock_pass_fill(unlock_pass *pass) {
+  while (true) {
+    if (g_cancellable_is_cancelled(pass->cancellable)) {
+      g_clear_pointer(&pass->staged, db_unlock_request_free);
+      break;
+    }
+    if (!pass->staged) {
+      // resumed by `handle_pass_password_decrypted()` which skips the database if it fails
+      if (pass->decrypting_passwd) return;
+      if (pass->next_db >= pass->dbs->len) break;    // all databases have been sent
+      db_config *db = g_ptr_array_index(pass->dbs, pass->next_db++);
+      char *passwd = g_malloc0(MAX_PASSWORD_SIZE);
+      if (!secret_cache_lookup(pass->user_id, db->name, passwd, MAX_PASSWORD_SIZE)) {
+        pass->decrypting_passwd = passwd;
+        decrypt_db_password_async(&pass->creds_ctx, &pass->bundle, db, passwd, pass->cancellable,
+            handle_pass_password_decrypted, pass);
+        continue;
+      }
+      pass->staged = db_unlock_request_new(db, passwd);
+    }
+    if (pass->in_flight >= pass->max_in_flight) return;
+
+    db_unlock_request *request = pass->staged;
+    pass->staged = NULL;
+    open_db_call *call = g_new(open_db_call, 1);
+    call->pass = pass;
+    call->kdbx_file = g_strdup(request->kdbx_file);
+    call->start_time = g_get_monotonic_time();
+    pass->in_flight++;
+    g_dbus_connection_call(pass->session_conn, KP_DBUS_INTERFACE, "/keepassxc", KP_DBUS_INTERFACE,
+        "openDatabase",
+        g_variant_new("(sss)", request->kdbx_file, request->password, request->key_file), NULL,
+        G_DBUS_CALL_FLAGS_NONE, DBUS_CALL_WAIT, pass->cancellable, handle_open_database_reply,
+        call);
+    db_unlock_request_free(request);
+  }
+  if (pass->in_flight == 0 && !pass->decrypting_passwd) unlock_pass_finish(pass);
+}
+
+/// @brief Start an asynchronous pass to unlock all the databases configured for the user.
+///        The results are gathered and reported when the last `openDatabase` call completes.
+/// @param config pointer to the `user_config` of the user
+/// @param session_conn the `GDBusConnection` object for the user's session bus
+/// @param unlocked_dbs set of canonical paths of the databases that KeePassXC has already unlocked
+///                     which are skipped, or NULL
+/// @param selection the databases to be unlocked by the pass
+/// @param num_deferred_ptr pointer to `guint` that is filled with the number of low priority
+///                         databases left out by `UNLOCK_PRIORITY_DBS` before the pass proceeds
+/// @param trigger_time monotonic time in microseconds of the event that triggered the unlock
+/// @param cancellable the `GCancellable` that aborts the pass, or NULL
+/// @param finished_cb function invoked with `finished_data` once the pass is done (which can be
+///                    before this returns), or NULL; its return value is ignored
+/// @param finished_data the `user_data` passed to `finished_cb`
+void unlock_pass_start(user_config *config, GDBusConnection *session_conn,
+    GHashTable *unlocked_dbs, unlock_selection selection, guint *num_deferred_ptr,
+    gint64 trigger_time, GCancellable *cancellable, GSourceFunc finished_cb,
+    gpointer finished_data) {
+  unlock_pass *pass = g_new0(unlock_pass, 1);
+  // snapshot the configurations so that changes during the pass do not affect it
+  pass->dbs = user_config_get_dbs(config);
+  // skip the databases that KeePassXC reported unlocked and the ones not selected for the pass
+  guint num_deferred = 0;
+  for (guint i = 0; i < pass->dbs->len;) {
+    db_config *db = g_ptr_array_index(pass->dbs, i);
+    bool skip_db = false;
+    if (unlocked_dbs && g_hash_table_size(unlocked_dbs) != 0) {
+      gchar *kdbx_path = g_canonicalize_filename(db->kdbx_file, "/");
+      skip_db = g_hash_table_contains(unlocked_dbs, kdbx_path);
+      g_free(kdbx_path);
+    }
+    if (skip_db) {
+      pass->num_skipped++;
+    } else if (selection == UNLOCK_PRIORITY_DBS && db->priority < 0) {
+      num_deferred++;
+      skip_db = true;
+    } else if (selection == UNLOCK_DEFERRED_DBS && db->priority >= 0) {
+      skip_db = true;
+    }
+    if (skip_db) {
+      g_ptr_array_remove_index(pass->dbs, i);
+    } else {
+      i++;
+    }
+  }
+  g_ptr_array_sort(pass->dbs, compare_db_unlock_order);
+  if (num_deferred_ptr) *num_deferred_ptr = num_deferred;
+  pass->user_id = config->user_id;
+  pass->bundle.encrypted = g_strdup(user_config_get_bundle(config));
+  pass->session_conn = g_object_ref(session_conn);
+  creds_context_init(&pass->creds_ctx);
+  pass->max_in_flight = get_env_setting(ENV_MAX_PARALLEL_UNLOCKS, 4, 1, 64);
+  pass->failures = g_ptr_array_new_with_free_func(g_free);
+  pass->start_time = g_get_monotonic_time();
+  pass->trigger_time = trigger_time;
+  pass->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
+  pass->finished_cb = finished_cb;
+  pass->finished_data = finished_data;
+  unlock_pass_fill(pass);
+}
+
+/// @brief Holds the state of the decryption of the passwords of a locked session ahead of its
+///        unlock which is done asynchronously one database at a time
+typedef struct {
+  uid_t user_id;                // numeric ID of the user owning the databases
+  GPtrArray *dbs;               // the KDBX database configurations in the order of unlock
+  guint next_db;                // index of the next database configuration in `dbs`
+  guint num_decrypted;          // number of passwords decrypted so far
+  creds_context creds_ctx;      // context shared by all the decryptions
+  credential_bundle bundle;     // credential bundle of the user decrypted at most once
+  char *passwd;                 // password buffer of the database being decrypted, or NULL
+  GCancellable *cancellable;    // aborts the decryption in progress when stopped
+  gpointer session_data;        // the `session_loop_data` which is referenced while decrypting
+} prestaged_decryption;
+
+/// @brief Wipe the key material and release the `prestaged_decryption`.
+/// @param prestage pointer to the `prestaged_decryption`
+void prestaged_decryption_free(prestaged_decryption *prestage) {
+  g_ptr_array_unref(prestage->dbs);
+  g_object_unref(prestage->cancellable);
+  creds_context_clear(&prestage->creds_ctx);
+  credential_bundle_clear(&prestage->bundle);
+  g_free(prestage);
+}
+
+/// @brief Holds the state of a monitored session which is the `user_data` passed to the session
+///        callbacks. It is reference counted since asynchronous queries can outlive the session.
+typedef struct {
+  GMainLoop *loop;                     // the main loop object pointer
+  GDBusConnection *system_conn;        // the `GBusConnection` object for the system D-Bus
+  gchar *session_path;                 // path of the selected session
+  uid_t user_id;                       // numeric ID of the user
+  session_bus bus;                     // the persistent connection to the user's session bus
+  user_config *config;                 // the parsed configuration of the user (not owned)
+  bool is_wayland;                     // `true` if the session is a Wayland one, `false` for X11
+  gchar *session_id;                   // logind ID of the session, or NULL if unknown
+  guint32 leader_pid;                  // process ID of the session leader, or 0 if unknown
+  gchar *display;                      // the `Display` property of the session
+  bool session_locked;                 // holds the previous locked state of the session
+  bool session_active;                 // holds the previous active state of the session
+  int kp_wait_secs;                    // seconds to wait for KeePassXC in the pending unlock
+  guint kp_wait_timeout_id;            // deadline for KeePassXC to appear, or 0 if not waiting
+  GDBusConnection *kp_wait_conn;       // session bus connection watched for KeePassXC to appear
+  guint kp_wait_subscription_id;       // `NameOwnerChanged` subscription on `kp_wait_conn`
+  bool unlock_running;                 // `true` from the `LockedHint` query till the unlock is done
+  guint64 trigger_generation;          // number of unlock triggers seen so far
+  guint64 unlock_generation;           // `trigger_generation` when the last unlock was started
+  int pending_wait_secs;               // largest `wait_secs` of the triggers not yet served
+  gint64 pending_trigger_time;         // monotonic time of the oldest trigger not served, or 0
+  guint settle_timeout_id;             // end of the settle window of the queued triggers, or 0
+  GCancellable *unlock_cancellable;    // aborts the running unlock, or NULL if none is running
+  bool unlock_deferred;                // `true` if the running unlock is of the deferred databases
+  guint num_deferred;                  // number of low priority databases left by the last unlock
+  guint defer_timeout_id;              // end of the idle time before the deferred unlock, or 0
+  gint64 unlock_start_time;            // monotonic time of the oldest trigger of the running unlock
+  gint64 kp_wait_start_time;           // monotonic time when the check for KeePassXC began
+  guint32 verified_kp_pid;             // ID of the KeePassXC process verified last, or 0 if none
+  int verified_kp_pidfd;               // pidfd of `verified_kp_pid` watched for its exit, or -1
+  guint verified_kp_watch_id;          // ID of the source watching `verified_kp_pidfd`, or 0
+  dev_t verified_kp_exe_dev;           // device of the executable of `verified_kp_pid`
+  ino_t verified_kp_exe_ino;           // inode of the executable of `verified_kp_pid`
+  gchar *verified_kp_digest;           // recorded digest that the verified executable matched
+  guint32 kp_check_pid;                // ID of the KeePassXC process being hashed, or 0 if none
+  GCancellable *kp_check_cancellable;  // aborts the background hashing of `kp_check_pid`
+  bool kp_check_unlock;                // `true` if the running unlock waits for the hashing
+  prestaged_decryption *prestage;      // decryption of the passwords ahead of unlock, or NULL
+  bool closed;                         // `true` once the session has ended
+} session_loop_data;
+
+/// @brief Acquire a reference to the `session_loop_data`.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+/// @return the same `session_data` pointer
+session_loop_data *session_data_ref(session_loop_data *session_data) {
+  return g_rc_box_acquire(session_data);
+}
+
+/// @brief Release the fields of the `session_loop_data` when its last reference is released.
+void session_data_clear(gpointer data) {
+  session_loop_data *session_data = (session_loop_data *)data;
+  g_object_unref(session_data->system_conn);
+  g_clear_object(&session_data->unlock_cancellable);
+  g_clear_object(&session_data->kp_check_cancellable);
+  g_free(session_data->session_path);
+  g_free(session_data->display);
+  g_free(session_data->session_id);
+}
+
+/// @brief Release a reference to the `session_loop_data` which is freed with the last one.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+void session_data_unref(session_loop_data *session_data) {
+  g_rc_box_release_full(session_data, session_data_clear);
+}
+
+void session_unlock_start(session_loop_data *session_data);
+
+/// @brief Timeout callback for the end of the idle time of a session after which its deferred low
+///        priority databases are unlocked.
+/// @param user_data pointer to the `session_loop_data` of the monitored session
+/// @return `G_SOURCE_REMOVE` always
+gboolean handle_deferred_unlock(gpointer user_data) {
+  session_loop_data *session_data = (session_loop_data *)user_data;
+  session_data->defer_timeout_id = 0;
+  // an unlock that started meanwhile defers these databases again once it is done
+  if (session_data->unlock_running) return G_SOURCE_REMOVE;
+  print_info("Unlocking the deferred database(s) for UID=%u\n", session_data->user_id);
+  session_data->pending_trigger_time = g_get_monotonic_time();
+  session_data->unlock_deferred = true;
+  session_unlock_start(session_data);
+  return G_SOURCE_REMOVE;
+}
+
+/// @brief Mark the running unlock of a session as done, and start a single follow-up unlock if
+///        any triggers arrived while it was running (unless they are still settling).
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+void session_unlock_done(session_loop_data *session_data) {
+  bool deferred = session_data->unlock_deferred;
+  bool cancelled = g_cancellable_is_cancelled(session_data->unlock_cancellable);
+  session_data->unlock_running = false;
+  session_data->unlock_deferred = false;
+  g_clear_object(&session_data->unlock_cancellable);
+  if (session_data->closed || session_data->settle_timeout_id != 0) return;
+  if (session_data->trigger_generation != session_data->unlock_generation) {
+    print_info("Starting follow-up unlock for the events during the last one for UID=%u\n",
+        session_data->user_id);
+    session_unlock_start(session_data);
+  } else if (!deferred && !cancelled && session_data->num_deferred != 0) {
+    int defer_secs = get_env_setting(ENV_DEFER_SECS, 0, 0, 3600);
+    print_info("Deferring %u low priority database(s) for UID=%u till no unlock events arrive "
+               "for %d secs\n",
+        session_data->num_deferred, session_data->user_id, defer_secs);
+    session_data->defer_timeout_id =
+        g_timeout_add_seconds((guint)defer_secs, handle_deferred_unlock, session_data);
+  }
+}
+
+/// @brief Callback invoked when the unlock pass of a session is done.
+/// @param user_data pointer to the `session_loop_data` of the monitored session which holds a
+///                  reference for the pass
+/// @return `G_SOURCE_REMOVE` always (which is ignored)
+gboolean handle_session_unlock_pass_done(gpointer user_data) {
+  session_loop_data *session_data = (session_loop_data *)user_data;
+  session_unlock_done(session_data);
+  session_data_unref(session_data);
+  return G_SOURCE_REMOVE;
+}
+
+/// @brief Forget the KeePassXC process verified last for a session and stop watching for its exit.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+void session_forget_verified_kp(session_loop_data *session_data) {
+  if (session_data->verified_kp_watch_id != 0) {
+    g_source_remove(session_data->verified_kp_watch_id);
+    session_data->verified_kp_watch_id = 0;
+  }
+  if (session_data->verified_kp_pidfd != -1) {
+    close(session_data->verified_kp_pidfd);
+    session_data->verified_kp_pidfd = -1;
+  }
+  session_data->verified_kp_pid = 0;
+  g_clear_pointer(&session_data->verified_kp_digest, g_free);
+}
+
+/// @brief Callback for the pidfd of the verified KeePassXC process becoming readable which happens
+///        when the process exits, so its verification is dropped.
+/// @param fd the pidfd of the verified KeePassXC process
+/// @param condition the condition that was satisfied
+/// @param user_data pointer to the `session_loop_data` of the monitored session
+/// @return `G_SOURCE_REMOVE` always
+gboolean handle_verified_kp_exit(gint fd, GIOCondition condition, gpointer user_data) {
+  session_loop_data *session_data = (session_loop_data *)user_data;
+  print_info("KeePassXC process with ID %u exited for UID=%u\n", session_data->verified_kp_pid,
+      session_data->user_id);
+  session_data->verified_kp_watch_id = 0;
+  session_forget_verified_kp(session_data);
+  return G_SOURCE_REMOVE;
+}
+
+/// @brief Get the device and inode of the executable of a process.
+/// @param pid the ID of the process
+/// @param st pointer to `struct stat` that is filled for the executable
+/// @return `true` if the executable could be looked up else `false`
+bool stat_process_exe(guint32 pid, struct stat *st) {
+  char exe_path[64];
+  snprintf(exe_path, sizeof(exe_path), "/proc/%u/exe", pid);
+  return stat(exe_path, st) == 0;
+}
+
+/// @brief Check if the given KeePassXC process is the one verified last for the session. The
+///        pidfd of that process keeps its ID from being reused while it is running, so a live
+///        process with the same ID is the same process. The executable is compared too since
+///        the process could have replaced itself using `execve()`, and the digest it matched
+///        should still be the recorded one.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+/// @param kp_pid process ID of KeePassXC
+/// @return `true` if the process need not be verified again else `false`
+bool session_kp_verified(session_loop_data *session_data, guint32 kp_pid) {
+  struct stat st;
+  const char *verified_digest = session_data->verified_kp_digest;
+  return session_data->verified_kp_pid == kp_pid &&
+         process_fd_alive(session_data->verified_kp_pidfd) && verified_digest &&
+         (g_strcmp0(verified_digest, user_config_get_kp_sha512(session_data->config)) == 0 ||
+             g_strcmp0(verified_digest, user_config_get_kp_verity(session_data->config)) == 0) &&
+         stat_process_exe(kp_pid, &st) && st.st_dev == session_data->verified_kp_exe_dev &&
+         st.st_ino == session_data->verified_kp_exe_ino;
+}
+
+/// @brief Verify that the KeePassXC process belongs to the session. A process in the cgroup of a
+///        logind session (e.g. started by the autostart of the desktop) identifies its session
+///        exactly, so this works for any number of sessions of the user. The ones started by the
+///        user's service manager (as `app-*.scope` on recent GNOME and KDE) are not in any
+///        session and are checked by their environment using `verify_process_session()`.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+/// @param kp_pid process ID of KeePassXC
+/// @return `true` if the KeePassXC is running in the session else `false`
+bool session_owns_process(session_loop_data *session_data, guint32 kp_pid) {
+  guint32 kp_session_uid = 0;
+  gchar *kp_session_id = get_process_session_id(kp_pid, &kp_session_uid);
+  if (!kp_session_id) {
+    return verify_process_session(kp_pid, session_data->is_wayland, session_data->display);
+  }
+  bool owned = kp_session_uid == session_data->user_id &&
+               g_strcmp0(kp_session_id, session_data->session_id) == 0;
+  g_free(kp_session_id);
+  return owned;
+}
+
+/// @brief Result of `session_check_kp()`
+typedef enum {
+  KP_CHECK_FAILED,      // the process is not the registered KeePassXC of the session
+  KP_CHECK_VERIFIED,    // the process has been verified
+  KP_CHECK_PENDING,     // the executable of the process is being hashed in the background
+} kp_check_status;
+
+/// @brief A check of the executable of a KeePassXC process which is the task data of the
+///        `GTask` hashing it in a worker thread
+typedef struct {
+  guint32 pid;          // process ID of KeePassXC
+  int pidfd;            // pidfd of the process, or -1 if none or once it has been taken
+  int exe_fd;           // descriptor of the executable opened through /proc/<pid>/exe, or -1
+  struct stat exe_st;   // identity of the executable obtained from `exe_fd`
+  gchar *cache_key;     // key of the digest in `exe_digest_cache`, or NULL if not cacheable
+  gint64 start_time;    // monotonic time in microseconds when the check started
+} kp_exe_check;
+
+/// @brief Release the `kp_exe_check` along with its descriptors.
+void kp_exe_check_free(gpointer data) {
+  kp_exe_check *check = (kp_exe_check *)data;
+  if (check->pidfd != -1) close(check->pidfd);
+  if (check->exe_fd != -1) close(check->exe_fd);
+  g_free(check->cache_key);
+  g_free(check);
+}
+
+/// @brief Conclude the check of the KeePassXC executable by comparing its digest against the
+///        recorded one, then remember the process for the session if it has a pidfd so that later
+///        unlocks can skip the checks for as long as the same process is running.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+/// @param check the `kp_exe_check` of the process whose pidfd is taken over if verified
+/// @param digest SHA-512 hash of the executable as a hexadecimal string or its fs-verity digest,
+///               or NULL if hashing failed
+/// @param expected_digest the recorded digest of the same kind as `digest`
+/// @return `true` if the process was verified else `false`
+bool session_kp_exe_checked(session_loop_data *session_data, kp_exe_check *check,
+    const char *digest, const char *expected_digest) {
+  bool verified = digest && g_strcmp0(digest, expected_digest) == 0;
+  stats_record("verify_exe", check->start_time, verified);
+  if (!verified) {
+    if (digest) report_exe_sha512_mismatch(session_bus_get(&session_data->bus), check->pid);
+    return false;
+  }
+  if (check->pidfd == -1) return true;
+  // the checks went through /proc/<pid> and are valid only if the process did not exit meanwhile
+  // (when its ID could have been reused)
+  if (!process_fd_alive(check->pidfd)) {
+    print_error("Skipping unlock since KeePassXC process with ID %u exited\n", check->pid);
+    return false;
+  }
+  session_data->verified_kp_pid = check->pid;
+  session_data->verified_kp_pidfd = check->pidfd;
+  check->pidfd = -1;
+  session_data->verified_kp_exe_dev = check->exe_st.st_dev;
+  session_data->verified_kp_exe_ino = check->exe_st.st_ino;
+  session_data->verified_kp_digest = g_strdup(expected_digest);
+  session_data->verified_kp_watch_id = g_unix_fd_add(
+      session_data->verified_kp_pidfd, G_IO_IN, handle_verified_kp_exit, session_data);
+  return true;
+}
+
+/// @brief Worker thread function of the `GTask` that hashes the executable of KeePassXC. It only
+///        reads the descriptor opened by the main thread, so the switches of the effective UID of
+///        the process by the main thread do not affect it.
+void hash_kp_exe_thread(
+    GTask *task, gpointer source, gpointer task_data, GCancellable *cancellable) {
+  kp_exe_check *check = (kp_exe_check *)task_data;
+  char sha512[SHA512_BUFFER_SIZE];
+  if (sha512sum_fd(check->exe_fd, cancellable, sha512, SHA512_BUFFER_SIZE) == 0) {
+    g_task_return_pointer(task, NULL, NULL);
+  } else {
+    g_task_return_pointer(task, g_strdup(sha512), g_free);
+  }
+}
+
+void session_unlock_proceed(session_loop_data *session_data, bool verified);
+
+/// @brief Callback for the completion of the background hashing of the KeePassXC executable which
+///        concludes its check and resumes the unlock waiting for it, if any.
+/// @param source NULL
+/// @param res the `GTask` of the hashing
+/// @param user_data pointer to the `session_loop_data` of the monitored session which holds a
+///                  reference for the task
+void handle_kp_exe_hashed(GObject *source, GAsyncResult *res, gpointer user_data) {
+  session_loop_data *session_data = (session_loop_data *)user_data;
+  GTask *task = G_TASK(res);
+  kp_exe_check *check = g_task_get_task_data(task);
+  gchar *sha512 = g_task_propagate_pointer(task, NULL);
+  if (sha512 && check->cache_key) {
+    exe_digest_cache_add(check->cache_key, sha512);
+    check->cache_key = NULL;
+  }
+  // skip the checks that were superseded by another KeePassXC process or the end of the session
+  if (!session_data->closed &&
+      g_task_get_cancellable(task) == session_data->kp_check_cancellable) {
+    session_data->kp_check_pid = 0;
+    g_clear_object(&session_data->kp_check_cancellable);
+    bool verified = session_kp_exe_checked(
+        session_data, check, sha512, user_config_get_kp_sha512(session_data->config));
+    if (session_data->kp_check_unlock) {
+      session_data->kp_check_unlock = false;
+      session_unlock_proceed(session_data, verified);
+    }
+  }
+  g_free(sha512);
+  session_data_unref(session_data);
+}
+
+/// @brief Stop the background hashing of the KeePassXC executable, if any.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+void session_stop_kp_check(session_loop_data *session_data) {
+  if (session_data->kp_check_cancellable) {
+    g_cancellable_cancel(session_data->kp_check_cancellable);
+    g_clear_object(&session_data->kp_check_cancellable);
+  }
+  session_data->kp_check_pid = 0;
+}
+
+/// @brief Verify that the KeePassXC process runs in the session and has the recorded checksum,
+///        unless the same process was verified before. The fs-verity digest of the executable is
+///        compared if one was recorded and the executable has fs-verity enabled, else the
+///        checksum is calculated in a worker thread unless the digest of the executable is cached.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+/// @param kp_pid process ID of KeePassXC
+/// @param kp_pidfd pidfd of the KeePassXC process which is owned by this function, or -1
+/// @return the status of the check where `KP_CHECK_PENDING` means that the result is concluded
+///         by `handle_kp_exe_hashed()` later
+kp_check_status session_check_kp(session_loop_data *session_data, guint32 kp_pid, int kp_pidfd) {
+  if (session_kp_verified(session_data, kp_pid) || session_data->kp_check_pid == kp_pid) {
+    if (kp_pidfd != -1) close(kp_pidfd);
+    return session_data->kp_check_pid == kp_pid ? KP_CHECK_PENDING : KP_CHECK_VERIFIED;
+  }
+  session_stop_kp_check(session_data);
+  session_forget_verified_kp(session_data);
+  if (!user_config_get_kp_sha512(session_data->config)) {
+    print_error("Skipping unlock due to missing %s/%s - run 'sudo keepassxc-unlock-setup'\n",
+        session_data->config->conf_dir, KP_SHA512_FILE_NAME);
+    if (kp_pidfd != -1) close(kp_pidfd);
+    return KP_CHECK_FAILED;
+  }
+
+  // verify from the KeePassXC executable's environment that it is running in the selected session
+  gint64 start_time = g_get_monotonic_time();
+  bool verified = session_owns_process(session_data, kp_pid);
+  stats_record("verify_session", start_time, verified);
+  if (!verified) {
+    print_error("Skipping unlock since KeePassXC process with ID %u belongs to another session or "
+                "its $DISPLAY/$WAYLAND_DISPLAY does not match the session properties\n",
+        kp_pid);
+    if (kp_pidfd != -1) close(kp_pidfd);
+    return KP_CHECK_FAILED;
+  }
+
+  // verify the KeePassXC executable's checksum where the identity used for the cached digest is
+  // taken from the same descriptor which is hashed so both refer to the same file
+  char exe_path[64];
+  snprintf(exe_path, sizeof(exe_path), "/proc/%u/exe", kp_pid);
+  kp_exe_check *check = g_new0(kp_exe_check, 1);
+  check->pid = kp_pid;
+  check->pidfd = kp_pidfd;
+  check->start_time = g_get_monotonic_time();
+  check->exe_fd = open(exe_path, O_RDONLY | O_CLOEXEC);
+  if (check->exe_fd == -1 || fstat(check->exe_fd, &check->exe_st) != 0) {
+    perror("session_check_kp() failed to open KeePassXC executable");
+    stats_record("verify_exe", check->start_time, false);
+    kp_exe_check_free(check);
+    return KP_CHECK_FAILED;
+  }
+  // the fs-verity digest held by the kernel, if recorded by the setup, avoids reading the file
+  const char *expected_verity = user_config_get_kp_verity(session_data->config);
+  char verity[VERITY_BUFFER_SIZE];
+  if (expected_verity && fsverity_digest_fd(check->exe_fd, verity, VERITY_BUFFER_SIZE) > 0) {
+    verified = session_kp_exe_checked(session_data, check, verity, expected_verity);
+    kp_exe_check_free(check);
+    return verified ? KP_CHECK_VERIFIED : KP_CHECK_FAILED;
+  }
+  check->cache_key = get_exe_digest_cache_key(kp_pid, &check->exe_st);
+  const char *cached_sha512 = exe_digest_cache && check->cache_key
+                                  ? g_hash_table_lookup(exe_digest_cache, check->cache_key)
+                                  : NULL;
+  if (cached_sha512) {
+    verified = session_kp_exe_checked(
+        session_data, check, cached_sha512, user_config_get_kp_sha512(session_data->config));
+    kp_exe_check_free(check);
+    return verified ? KP_CHECK_VERIFIED : KP_CHECK_FAILED;
+  }
+
+  session_data->kp_check_pid = kp_pid;
+  session_data->kp_check_cancellable = g_cancellable_new();
+  GTask *task = g_task_new(NULL, session_data->kp_check_cancellable, handle_kp_exe_hashed,
+      session_data_ref(session_data));
+  g_task_set_task_data(task, check, kp_exe_check_free);
+  g_task_run_in_thread(task, hash_kp_exe_thread);
+  g_object_unref(task);
+  return KP_CHECK_PENDING;
+}
+
+/// @brief Callback for the lookup of KeePassXC on the session bus by `session_verify_kp_ahead()`
+///        which starts verifying the process found, resuming the running unlock if the check it
+///        waits for was superseded by one that concluded right away.
+/// @param source the `GDBusConnection` object for the session bus
+/// @param res the result of the lookup
+/// @param user_data pointer to the `session_loop_data` of the monitored session which holds a
+///                  reference for the lookup
+void handle_kp_ahead_lookup(GObject *source, GAsyncResult *res, gpointer user_data) {
+  session_loop_data *session_data = (session_loop_data *)user_data;
+  int kp_pidfd;
+  guint32 kp_pid = get_dbus_service_process_finish(G_DBUS_CONNECTION(source), res, &kp_pidfd);
+  if (kp_pid != 0 && !session_data->closed) {
+    kp_check_status status = session_check_kp(session_data, kp_pid, kp_pidfd);
+    // a check concluded right away for a new process supersedes the one that the running unlock
+    // waits for, whose completion is then skipped, so the unlock has to be resumed from here
+    if (status != KP_CHECK_PENDING && session_data->kp_check_unlock) {
+      session_data->kp_check_unlock = false;
+      session_unlock_proceed(session_data, status == KP_CHECK_VERIFIED);
     }
-    g_clear_error(&error);
-    return 0;
+  } else if (kp_pidfd != -1) {
+    close(kp_pidfd);
   }
-  GVariant *result = g_dbus_connection_call_sync(session_conn, "org.freedesktop.DBus", "/",
-      "org.freedesktop.DBus", "GetConnectionUnixProcessID", g_variant_new("(s)", dbus_api), NULL,
-      G_DBUS_CALL_FLAGS_NONE, DBUS_CALL_WAIT, NULL, &error);
-  g_object_unref(session_conn);
-  if (result) {
-    guint32 pid = 0;
-    g_variant_get(result, "(u)", &pid);
-    return pid;
+  session_data_unref(session_data);
+}
+
+/// @brief Look up KeePassXC on the session bus and start verifying it ahead of the unlock that will
+///        need it. If not connected, then the lookup is done once the connection is established.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+void session_verify_kp_ahead(session_loop_data *session_data) {
+  GDBusConnection *session_conn = session_bus_get(&session_data->bus);
+  if (session_conn) {
+    get_dbus_service_process(session_conn, KP_DBUS_INTERFACE, NULL, handle_kp_ahead_lookup,
+        session_data_ref(session_data));
   } else {
-    g_clear_error(&error);
-    return 0;
+    session_bus_connect(&session_data->bus);
   }
 }
 
-/// @brief Calculate the SHA-512 hash for the given file and return as a hexadecimal
-///        string in the given buffer.
-/// @param path path of the file for which SHA-512 hash has to be calculated
-/// @param hash_buffer fill the SHA-512 hash as a hexadecimal string with terminating null
-/// @param buffer_size total size of the passed `hash_buffer`
-/// @return length of the filled `hash_buffer` excluding terminating null, else 0 in case of failure
-///         or if the buffer is not large enough
-size_t sha512sum(const char *path, char *hash_buffer, size_t buffer_size) {
-  int fd = open(path, O_RDONLY);
-  if (fd == -1) {
-    perror("sha512sum() failed to open file");
-    return 0;
+/// @brief Callback for KeePassXC registering its D-Bus API on the session bus which starts its
+///        verification right away, so that the checksum is ready by the time an unlock needs it.
+/// @param user_data pointer to the `session_loop_data` of the monitored session
+void handle_kp_appeared(gpointer user_data) {
+  session_loop_data *session_data = (session_loop_data *)user_data;
+  if (!session_data->closed) session_verify_kp_ahead(session_data);
+}
+
+/// @brief Stop the decryption of the passwords ahead of the unlock of a session, if running.
+///        A decryption in progress is cancelled and releases the `prestaged_decryption` when done.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+void session_stop_prestage(session_loop_data *session_data) {
+  prestaged_decryption *prestage = session_data->prestage;
+  if (!prestage) return;
+  session_data->prestage = NULL;
+  if (prestage->passwd) {
+    g_cancellable_cancel(prestage->cancellable);
+  } else {
+    prestaged_decryption_free(prestage);
   }
+}
 
-  // read data from the file in chunks and keep updating the checksum
-  unsigned char buffer[32768];
-  ssize_t bytes_read;
-  unsigned char hash[EVP_MAX_MD_SIZE];
-  unsigned int hash_len;
-  // keep on heap to maintain compatibility in the case of change in size of EVP_MD_CTX struct
-  EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
-  EVP_DigestInit_ex(md_ctx, EVP_sha512(), NULL);
-  while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
-    EVP_DigestUpdate(md_ctx, buffer, bytes_read);
+void handle_prestage_password_decrypted(GObject *source, GAsyncResult *res, gpointer user_data);
+
+/// @brief Start the decryption of the password of the next database of a locked session that is
+///        missing from the secret cache, or release the `prestaged_decryption` once all are done.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+void session_prestage_next(session_loop_data *session_data) {
+  prestaged_decryption *prestage = session_data->prestage;
+  while (prestage->next_db < prestage->dbs->len) {
+    db_config *db = g_ptr_array_index(prestage->dbs, prestage->next_db++);
+    if (secret_cache_contains(prestage->user_id, db->name)) continue;
+    prestage->passwd = g_malloc0(MAX_PASSWORD_SIZE);
+    prestage->session_data = session_data_ref(session_data);
+    decrypt_db_password_async(&prestage->creds_ctx, &prestage->bundle, db, prestage->passwd,
+        prestage->cancellable, handle_prestage_password_decrypted, prestage);
+    return;
   }
-  if (bytes_read == -1) {
-    perror("sha512sum() failed to read file");
+  print_info("Pre-staged the passwords of %u database(s) for UID=%u\n", prestage->num_decrypted,
+      session_data->user_id);
+  session_data->prestage = NULL;
+  prestaged_decryption_free(prestage);
+}
+
+/// @brief Callback for the decryption of a password ahead of the unlock of a session which stores
+///        it in the secret cache and moves on to the next database. If the pre-staging has been
+///        stopped in the meantime, then the `prestaged_decryption` is released instead.
+/// @param source unused
+/// @param res the result of `decrypt_db_password_async()`
+/// @param user_data pointer to the `prestaged_decryption`
+void handle_prestage_password_decrypted(GObject *source, GAsyncResult *res, gpointer user_data) {
+  prestaged_decryption *prestage = (prestaged_decryption *)user_data;
+  session_loop_data *session_data = (session_loop_data *)prestage->session_data;
+  prestage->session_data = NULL;
+  if (decrypt_db_password_finish(res) && session_data->prestage == prestage) {
+    db_config *db = g_ptr_array_index(prestage->dbs, prestage->next_db - 1);
+    // kept till the unlock uses it even if caching is off, see `unlock_pass_finish()`
+    int ttl = secret_cache_get_ttl();
+    secret_cache_store(prestage->user_id, db->name, prestage->passwd,
+        ttl == 0 ? SECRET_CACHE_FOR_SESSION : ttl);
+    prestage->num_decrypted++;
+  }
+  OPENSSL_cleanse(prestage->passwd, MAX_PASSWORD_SIZE);
+  g_clear_pointer(&prestage->passwd, g_free);
+  if (session_data->prestage == prestage) {
+    session_prestage_next(session_data);
   } else {
-    EVP_DigestFinal_ex(md_ctx, hash, &hash_len);
+    prestaged_decryption_free(prestage);
   }
-  close(fd);
-  EVP_MD_CTX_free(md_ctx);
-  if (bytes_read == -1) return 0;
+  session_data_unref(session_data);
+}
 
-  // convert bytes to hex string using sprintf which is not efficient but its a tiny fixed overhead
-  size_t buf_len = 0;
-  for (size_t i = 0; i < hash_len; i++, buf_len += 2) {
-    if (buf_len >= buffer_size - 2) return 0;
-    sprintf(hash_buffer + buf_len, "%02x", hash[i]);
+/// @brief Prepare the next unlock of a session that has just been locked as configured by
+///        `ENV_PRESTAGE`, so that the unlock is left with little more than the `openDatabase`
+///        calls. KeePassXC is looked up and verified (with its executable hashed in the
+///        background), and optionally the passwords of the databases are also decrypted into the
+///        secret cache.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+void session_prestage_unlock(session_loop_data *session_data) {
+  int prestage_level = get_env_setting(ENV_PRESTAGE, PRESTAGE_VERIFY, 0, PRESTAGE_DECRYPT);
+  if (prestage_level < PRESTAGE_VERIFY || session_data->closed) return;
+  session_verify_kp_ahead(session_data);
+  if (prestage_level < PRESTAGE_DECRYPT || session_data->prestage) return;
+
+  prestaged_decryption *prestage = g_new0(prestaged_decryption, 1);
+  prestage->user_id = session_data->user_id;
+  prestage->dbs = user_config_get_dbs(session_data->config);
+  g_ptr_array_sort(prestage->dbs, compare_db_unlock_order);
+  creds_context_init(&prestage->creds_ctx);
+  prestage->bundle.encrypted = g_strdup(user_config_get_bundle(session_data->config));
+  prestage->cancellable = g_cancellable_new();
+  session_data->prestage = prestage;
+  session_prestage_next(session_data);
+}
+
+/// @brief Start the unlock pass of the databases of a session once the KeePassXC process has been
+///        checked, or end the unlock if the check failed.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+/// @param verified `true` if KeePassXC was verified else `false`
+void session_unlock_proceed(session_loop_data *session_data, bool verified) {
+  GDBusConnection *session_conn = verified ? session_bus_get(&session_data->bus) : NULL;
+  if (!session_conn) {
+    if (verified) {
+      print_error("Lost the session bus connection before the unlock for UID=%u\n",
+          session_data->user_id);
+    }
+    stats_record("unlock", session_data->unlock_start_time, false);
+    session_unlock_done(session_data);
+    return;
   }
-  hash_buffer[buf_len] = '\0';
-  return buf_len;
+  unlock_selection selection = UNLOCK_ALL_DBS;
+  if (get_env_setting(ENV_DEFER_SECS, 0, 0, 3600) != 0) {
+    selection = session_data->unlock_deferred ? UNLOCK_DEFERRED_DBS : UNLOCK_PRIORITY_DBS;
+  }
+  unlock_pass_start(session_data->config, session_conn, session_data->bus.unlocked_dbs, selection,
+      &session_data->num_deferred, session_data->unlock_start_time,
+      session_data->unlock_cancellable, handle_session_unlock_pass_done,
+      session_data_ref(session_data));
 }
 
-/// @brief Verify that the KeePassXC process belongs to the selected session. This is done by
-///        comparing the $DISPLAY variable of the process with the `Display` property of the session
-///        for X11, or checking that $WAYLAND_DISPLAY is non-empty for Wayland.
+/// @brief Verify the KeePassXC process found on the session bus, unless the same process was
+///        verified before, and then start the unlock pass for all the KDBX databases that were
+///        registered (using `keepassxc-unlock-setup`). If the executable of the process is still
+///        being hashed, then the unlock continues once that is done.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
 /// @param kp_pid process ID of KeePassXC
-/// @param is_wayland `true` if the session is a Wayland one, else `false` if it is X11
-/// @param display the $DISPLAY variable for the session as retrieved from its `Display` property
-/// @return `true` if the KeePassXC is running in the session else `false`
-bool verify_process_session(guint32 kp_pid, bool is_wayland, const gchar *display) {
-  bool success = false;
-  gchar *env_value = NULL;
-  if (is_wayland) {
-    // the `Display` property of the session is not set for the case of Wayland, and there is no way
-    // to check if this is the same Wayland session (multiple Wayland sessions break stuff in many
-    //   ways in any case) so just check that $WAYLAND_DISPLAY is not non-empty
-    env_value = get_process_env_var(kp_pid, "WAYLAND_DISPLAY");
-    success = env_value && *env_value != '\0';
+/// @param kp_pidfd pidfd of the KeePassXC process which is owned by this function, or -1
+void unlock_kp_process(session_loop_data *session_data, guint32 kp_pid, int kp_pidfd) {
+  kp_check_status status = session_check_kp(session_data, kp_pid, kp_pidfd);
+  if (status == KP_CHECK_PENDING) {
+    session_data->kp_check_unlock = true;
   } else {
-    // for the case of X11, the value of $DISPLAY should match the passed `Display` session property
-    env_value = get_process_env_var(kp_pid, "DISPLAY");
-    success = g_strcmp0(env_value, display) == 0;
+    session_unlock_proceed(session_data, status == KP_CHECK_VERIFIED);
   }
-  g_free(env_value);
-  return success;
 }
 
-/// @brief Get the executable's SHA-512 hash from /proc/<pid>/exe and compare against the recorded
-///        good checksum.
-/// @param user_id numeric ID of the user
-/// @param kp_pid process ID of KeePassXC
-/// @return `true` if the checksum matched else `false`
-bool verify_process_exe_sha512(const char *user_conf_dir, uid_t user_id, guint32 kp_pid) {
-  // get the executable's SHA-512 hash from /proc/<pid>/exe and compare against the
-  // recorded good checksum
-  char expected_sha512[SHA512_BUFFER_SIZE], current_sha512[SHA512_BUFFER_SIZE];
-  char kp_sha512_file[128], kp_exe[128];
-  snprintf(kp_sha512_file, sizeof(kp_sha512_file), "%s/keepassxc.sha512", user_conf_dir);
-  FILE *file = fopen(kp_sha512_file, "r");
-  if (!file) {
-    print_error(
-        "Skipping unlock due to missing %s - run 'sudo keepassxc-unlock-setup'\n", kp_sha512_file);
-    return false;
+/// @brief Stop waiting for KeePassXC to appear on the session bus.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+void stop_kp_wait(session_loop_data *session_data) {
+  if (session_data->kp_wait_timeout_id != 0) {
+    g_source_remove(session_data->kp_wait_timeout_id);
+    session_data->kp_wait_timeout_id = 0;
   }
-  snprintf(kp_exe, sizeof(kp_exe), "/proc/%u/exe", kp_pid);
-  bool mismatch = sha512sum(kp_exe, current_sha512, SHA512_BUFFER_SIZE) == 0;
-  // use `fgets` to read the sha512 file which is expected to have only one line
-  // and replace terminating newline using `strcspn` (which works even if there was no newline)
-  mismatch = mismatch || !fgets(expected_sha512, sizeof(expected_sha512), file) ||
-             (expected_sha512[strcspn(expected_sha512, "\n")] = '\0',
-                 g_strcmp0(current_sha512, expected_sha512) != 0);
-  fclose(file);
-  if (mismatch) {
-    // `kp_exe_full` stores the actual executable that /proc/<pid>/exe points to, while
-    // `kp_exe_real` will either point to it or /proc/<pid>/exe in case `readlink` was unsuccessful
-    char kp_exe_full[PATH_MAX], *kp_exe_real = kp_exe;
-    ssize_t kp_full_len = readlink(kp_exe, kp_exe_full, sizeof(kp_exe_full) - 1);
-    if (kp_full_len > 0) {
-      kp_exe_full[kp_full_len] = '\0';
-      kp_exe_real = kp_exe_full;
-    }
-    print_error("\033[1;33mAborting unlock due to checksum mismatch in keepassxc (PID %u EXE %s)"
-                "\033[00m\n",
-        kp_pid, kp_exe_real);
-    char notify_cmd[PATH_MAX * 2];
-    // TODO: use notification dbus API for below instead of notify-send which may not be present
-    snprintf(notify_cmd, sizeof(notify_cmd),
-        "runuser -u `id -un %u` -- notify-send -i system-lock-screen -u critical -t 0 "
-        "'Checksum mismatch in keepassxc' 'If KeePassXC has been updated, then run "
-        "\"sudo keepassxc-unlock-setup ...\" for one of the KDBX databases.\nOtherwise this "
-        "could be an unknown process snooping on D-Bus.\nThe offending process ID is %u "
-        "having executable pointing to %s'",
-        user_id, kp_pid, kp_exe_real);
-    if (system(notify_cmd) != 0) {
-      perror("unlock_databases() failed to notify-send for SHA-512 mismatch");
-    }
-    return false;
+  if (session_data->kp_wait_subscription_id != 0) {
+    g_dbus_connection_signal_unsubscribe(
+        session_data->kp_wait_conn, session_data->kp_wait_subscription_id);
+    session_data->kp_wait_subscription_id = 0;
   }
-  return true;
+  g_clear_object(&session_data->kp_wait_conn);
 }
 
-/// @brief Unlock all the KDBX databases that were registered (using `keepassxc-unlock-setup`)
-///        of the given user using KeePassXC's D-Bus API.
-/// @param user_id numeric ID of the user
-/// @param system_conn the `GBusConnection` object for the system D-Bus
-/// @param session_path path of the selected session
-/// @param is_wayland `true` if the session is a Wayland one, else `false` if it is X11
-/// @param display the $DISPLAY variable for the session as retrieved from its `Display` property
-/// @param wait_secs seconds to try connecting to the KeePassXC D-Bus service before giving up
-void unlock_databases(uid_t user_id, GDBusConnection *system_conn, const char *session_path,
-    bool is_wayland, const gchar *display, int wait_secs) {
-  // last minute check to skip unlock if LockedHint is true
-  if (is_locked(system_conn, session_path)) {
-    print_error("Skipping unlock since screen/session is still locked!\n");
-    return;
+/// @brief Callback for the lookup of KeePassXC by `check_kp_registered()` which stops the wait and
+///        proceeds with the unlock if found. The result is dropped if the wait has ended meanwhile
+///        (KeePassXC found by another lookup, timed out or the unlock aborted).
+/// @param source the `GDBusConnection` object for the session bus
+/// @param res the result of the lookup
+/// @param user_data pointer to the `session_loop_data` of the monitored session which holds a
+///                  reference for the lookup
+void handle_kp_registered_lookup(GObject *source, GAsyncResult *res, gpointer user_data) {
+  session_loop_data *session_data = (session_loop_data *)user_data;
+  int kp_pidfd;
+  guint32 kp_pid = get_dbus_service_process_finish(G_DBUS_CONNECTION(source), res, &kp_pidfd);
+  if (kp_pid != 0 && session_data->kp_wait_timeout_id != 0 &&
+      !g_cancellable_is_cancelled(session_data->unlock_cancellable)) {
+    stats_record("kp_wait", session_data->kp_wait_start_time, true);
+    stop_kp_wait(session_data);
+    unlock_kp_process(session_data, kp_pid, kp_pidfd);
+  } else if (kp_pidfd != -1) {
+    close(kp_pidfd);
   }
+  session_data_unref(session_data);
+}
 
-  // loop till `wait_secs` to get the ID of the process providing KeePassXC's D-Bus API
-  guint32 kp_pid = 0;
-  for (int i = 0; i < wait_secs; i++) {
-    // switch effective ID to the user before connecting since this is the user's session bus
-    change_euid(user_id);
-    // log connection error only in the last iteration
-    kp_pid = get_dbus_service_process_id(KP_DBUS_INTERFACE, i == wait_secs - 1);
-    change_euid(0);
-    if (kp_pid != 0) break;
-    sleep(1);
+/// @brief Check if KeePassXC has registered its D-Bus API, and if so, then stop the pending wait
+///        and proceed with the unlock.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+/// @param conn the `GDBusConnection` object for the session bus
+void check_kp_registered(session_loop_data *session_data, GDBusConnection *conn) {
+  get_dbus_service_process(conn, KP_DBUS_INTERFACE, session_data->unlock_cancellable,
+      handle_kp_registered_lookup, session_data_ref(session_data));
+}
+
+/// @brief Callback for `NameOwnerChanged` of KeePassXC's D-Bus API on the session bus.
+void handle_kp_name_owner_changed(GDBusConnection *conn, const char *sender_name,
+    const char *object_path, const char *interface_name, const char *signal_name,
+    GVariant *parameters, gpointer user_data) {
+  const char *new_owner = NULL;
+  g_variant_get(parameters, "(&s&s&s)", NULL, NULL, &new_owner);
+  // empty new owner means that the name went away
+  if (new_owner && *new_owner != '\0') check_kp_registered((session_loop_data *)user_data, conn);
+}
+
+/// @brief Subscribe to `NameOwnerChanged` of KeePassXC's D-Bus API on the given session bus
+///        connection, if an unlock is waiting for it and the connection is not already watched.
+/// @param conn the `GDBusConnection` object for the session bus
+/// @param user_data pointer to the `session_loop_data` of the monitored session
+void watch_kp_name(GDBusConnection *conn, gpointer user_data) {
+  session_loop_data *session_data = (session_loop_data *)user_data;
+  if (session_data->kp_wait_timeout_id == 0 || session_data->kp_wait_conn == conn) return;
+  if (session_data->kp_wait_subscription_id != 0) {
+    g_dbus_connection_signal_unsubscribe(
+        session_data->kp_wait_conn, session_data->kp_wait_subscription_id);
   }
-  if (kp_pid == 0) {
-    print_error("Failed to connect to KeePassXC D-Bus API within %d secs\n", wait_secs);
-    return;
+  g_clear_object(&session_data->kp_wait_conn);
+  session_data->kp_wait_conn = g_object_ref(conn);
+  session_data->kp_wait_subscription_id = g_dbus_connection_signal_subscribe(conn,
+      "org.freedesktop.DBus", "org.freedesktop.DBus", "NameOwnerChanged", "/org/freedesktop/DBus",
+      KP_DBUS_INTERFACE, G_DBUS_SIGNAL_FLAGS_NONE, handle_kp_name_owner_changed, session_data,
+      NULL);
+  // the name may have been registered before the subscription took effect
+  check_kp_registered(session_data, conn);
+}
+
+/// @brief Callback for the connection to the session bus of a session which looks up KeePassXC on
+///        it, either for the unlock waiting for it or to verify it ahead of the next unlock.
+/// @param conn the `GDBusConnection` object for the session bus
+/// @param user_data pointer to the `session_loop_data` of the monitored session
+void handle_session_bus_connected(GDBusConnection *conn, gpointer user_data) {
+  session_loop_data *session_data = (session_loop_data *)user_data;
+  if (session_data->closed) return;
+  if (session_data->kp_wait_timeout_id != 0) {
+    watch_kp_name(conn, session_data);
+  } else {
+    session_verify_kp_ahead(session_data);
   }
+}
 
-  // verify from the KeePassXC executable's environment that it is running in the selected session
-  if (!verify_process_session(kp_pid, is_wayland, display)) {
-    print_error("Skipping unlock due to mismatch of $DISPLAY/$WAYLAND_DISPLAY of KeePassXC process "
-                "with ID %u against the session properties\n",
-        kp_pid);
-    return;
+/// @brief Timeout callback for the deadline of the wait for KeePassXC to appear on the session bus.
+/// @param user_data pointer to the `session_loop_data` of the monitored session
+/// @return `G_SOURCE_REMOVE` always
+gboolean handle_kp_wait_timeout(gpointer user_data) {
+  session_loop_data *session_data = (session_loop_data *)user_data;
+  session_data->kp_wait_timeout_id = 0;
+  if (!session_data->kp_wait_conn && session_data->bus.connect_error) {
+    // log the connection error now that the session bus did not show up in time
+    print_error("%s\n", session_data->bus.connect_error);
   }
+  stop_kp_wait(session_data);
+  print_error("Failed to connect to KeePassXC D-Bus API within %d secs for UID=%u\n",
+      session_data->kp_wait_secs, session_data->user_id);
+  stats_record("kp_wait", session_data->kp_wait_start_time, false);
+  stats_record("unlock", session_data->unlock_start_time, false);
+  session_unlock_done(session_data);
+  return G_SOURCE_REMOVE;
+}
 
-  // verify the KeePassXC executable's checksum
-  char user_conf_dir[100];
-  snprintf(user_conf_dir, sizeof(user_conf_dir), "%s/%u", KP_CONFIG_DIR, user_id);
-  if (!verify_process_exe_sha512(user_conf_dir, user_id, kp_pid)) return;
-
-  char conf_pattern[128], decrypted_passwd[MAX_PASSWORD_SIZE];
-  snprintf(conf_pattern, sizeof(conf_pattern), "%s/*.conf", user_conf_dir);
-  glob_t globbuf;
-  if (glob(conf_pattern, 0, NULL, &globbuf) == 0) {
-    // clear decrypted_passwd in every loop even if the loop condition fails
-    for (size_t i = 0; memset(decrypted_passwd, 0, MAX_PASSWORD_SIZE), i < globbuf.gl_pathc; i++) {
-      char *conf_path = globbuf.gl_pathv[i];
-      FILE *file = fopen(conf_path, "r");
-      if (!file) {
-        print_error("Failed to open configuration file: %s\n", conf_path);
-        continue;
-      }
+/// @brief Get the D-Bus address of the session bus of a user from $DBUS_SESSION_BUS_ADDRESS of the
+///        leader of the session, else the default per-user bus given by
+///        `SESSION_BUS_ADDRESS_FORMAT` which is also used if the address is not a plain `unix:`
+///        one since other transports like `unixexec:` would spawn a process from this one.
+/// @param leader_pid process ID of the session leader, or 0 if unknown
+/// @param user_id numeric ID of the user
+/// @return the address which should be released with `g_free()` after use
+gchar *get_session_bus_address(guint32 leader_pid, uid_t user_id) {
+  const char *env_vars[] = {"DBUS_SESSION_BUS_ADDRESS", NULL};
+  gchar *address = NULL;
+  if (leader_pid != 0 && get_process_env_vars(leader_pid, env_vars, &address) && address &&
+      g_str_has_prefix(address, "unix:") && !strchr(address, ';')) {
+    return address;
+  }
+  g_free(address);
+  return g_strdup_printf(SESSION_BUS_ADDRESS_FORMAT, user_id);
+}
 
-      char line[PATH_MAX];
-      char kdbx_file[PATH_MAX] = {0};
-      char key_file[PATH_MAX] = {0};
-      int passwd_start_line = 0;
-      while (fgets(line, sizeof(line), file)) {
-        passwd_start_line++;
-        if (strncmp(line, "DB=", 3) == 0) {
-          strncpy(kdbx_file, line + 3, sizeof(kdbx_file) - 1);
-          kdbx_file[strcspn(kdbx_file, "\n")] = '\0';
-        } else if (strncmp(line, "KEY=", 4) == 0) {
-          strncpy(key_file, line + 4, sizeof(key_file) - 1);
-          key_file[strcspn(key_file, "\n")] = '\0';
-        } else if (strncmp(line, "PASSWORD:", 9) != 0) {
-          // password starts after the line having PASSWORD:
-          break;
-        }
-      }
-      fclose(file);
+/// @brief Resolver of the session bus address for `session_bus` that reads it afresh from the
+///        environment of the session leader every time it is called. The leader is not looked up
+///        again since the `Leader` property of a session never changes.
+/// @param user_data pointer to the `session_loop_data` of the monitored session
+/// @return the address which should be released with `g_free()` after use, or NULL if the session
+///         has ended
+gchar *resolve_session_bus_address(gpointer user_data) {
+  session_loop_data *session_data = (session_loop_data *)user_data;
+  if (session_data->closed) return NULL;
+  return get_session_bus_address(session_data->leader_pid, session_data->user_id);
+}
 
-      if (*kdbx_file == '\0') {
-        print_error("Skipping invalid KDBX unlock configuration file '%s'\n", conf_path);
-        continue;
-      }
+/// @brief Create the state for a session that is to be monitored for auto-unlock.
+/// @param loop the main loop object pointer
+/// @param system_conn the `GBusConnection` object for the system D-Bus
+/// @param session_path path of the session
+/// @param user_id numeric ID of the session owner
+/// @param config the parsed configuration of the user which should outlive the session
+/// @param is_wayland `true` if the session is a Wayland one, `false` for X11
+/// @param display the `Display` property of the session
+/// @param session_id the `Id` property of the session, or NULL if unknown
+/// @param leader_pid the `Leader` property of the session, or 0 if unknown
+/// @return a new `session_loop_data` that should be released with `session_data_close()` and
+///         then `session_data_unref()` when the session ends
+session_loop_data *session_data_new(GMainLoop *loop, GDBusConnection *system_conn,
+    const gchar *session_path, uid_t user_id, user_config *config, bool is_wayland,
+    const gchar *display, const gchar *session_id, guint32 leader_pid) {
+  session_loop_data *session_data = g_rc_box_new0(session_loop_data);
+  session_data->loop = loop;
+  session_data->system_conn = g_object_ref(system_conn);
+  session_data->session_path = g_strdup(session_path);
+  session_data->user_id = user_id;
+  // the user's session bus which is connected lazily and kept open for the life of the session
+  session_data->bus.user_id = user_id;
+  session_data->bus.resolve_address_cb = resolve_session_bus_address;
+  session_data->bus.connected_cb = handle_session_bus_connected;
+  session_data->bus.kp_appeared_cb = handle_kp_appeared;
+  session_data->bus.callback_data = session_data;
+  session_data->config = config;
+  session_data->is_wayland = is_wayland;
+  session_data->display = g_strdup(display);
+  session_data->session_id = g_strdup(session_id);
+  session_data->leader_pid = leader_pid;
+  session_data->session_active = true;
+  session_data->verified_kp_pidfd = -1;
+  return session_data;
+}
 
-      char conf_name[128] = {0}, decrypt_cmd[256];
-      char *conf_name_p, *conf_filename = strrchr(conf_path, '/');
-      if (conf_filename && (conf_name_p = strstr(conf_filename + 1, ".conf")) != NULL) {
-        size_t conf_name_len = conf_name_p - conf_filename - 1;
-        strncpy(conf_name, conf_filename + 1, MIN(conf_name_len, sizeof(conf_name)));
-      }
-      snprintf(decrypt_cmd, sizeof(decrypt_cmd),
-          "tail '-n+%d' '%s' | systemd-creds '--name=%s' decrypt - -", passwd_start_line, conf_path,
-          conf_name);
-      FILE *pipe = popen(decrypt_cmd, "r");
-      if (!pipe) {
-        perror("Failed to run systemd-creds for decryption");
-        continue;
-      }
-      size_t bytes_read = fread(decrypted_passwd, 1, MAX_PASSWORD_SIZE, pipe);
-      pclose(pipe);
-      if (bytes_read == MAX_PASSWORD_SIZE) {
-        print_error("Password for '%s' exceeds %u characters!\n", kdbx_file, MAX_PASSWORD_SIZE - 1);
-        continue;
-      }
-      decrypted_passwd[bytes_read] = '\0';
-
-      change_euid(user_id);
-      GError *error = NULL;
-      GDBusConnection *session_conn = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
-      if (!session_conn) {
-        fprintf(
-            stderr, "Failed to connect to session bus: %s\n", error ? error->message : "(null)");
-        g_clear_error(&error);
-        change_euid(0);
-        continue;
-      }
-      GVariant *result = g_dbus_connection_call_sync(session_conn, KP_DBUS_INTERFACE, "/keepassxc",
-          KP_DBUS_INTERFACE, "openDatabase",
-          g_variant_new("(sss)", kdbx_file, decrypted_passwd, key_file), NULL,
-          G_DBUS_CALL_FLAGS_NONE, DBUS_CALL_WAIT, NULL, &error);
-      if (result) {
-        g_variant_unref(result);
-      } else {
-        print_error(
-            "Failed to unlock database '%s': %s\n", kdbx_file, error ? error->message : "(null)");
-        g_clear_error(&error);
-      }
-      g_object_unref(session_conn);
-      change_euid(0);
+/// @brief Stop all the activity of a session that has ended. Any asynchronous queries still in
+///        flight hold their own references and skip the session when they complete.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+void session_data_close(session_loop_data *session_data) {
+  session_data->closed = true;
+  if (session_data->unlock_cancellable) g_cancellable_cancel(session_data->unlock_cancellable);
+  if (session_data->settle_timeout_id != 0) {
+    g_source_remove(session_data->settle_timeout_id);
+    session_data->settle_timeout_id = 0;
+  }
+  if (session_data->defer_timeout_id != 0) {
+    g_source_remove(session_data->defer_timeout_id);
+    session_data->defer_timeout_id = 0;
+  }
+  stop_kp_wait(session_data);
+  session_stop_kp_check(session_data);
+  session_stop_prestage(session_data);
+  session_data->kp_check_unlock = false;
+  session_forget_verified_kp(session_data);
+  session_bus_close(&session_data->bus);
+}
+
+/// @brief Wait for the name of the KeePassXC D-Bus API to be registered on the session bus without
+///        blocking the main loop, proceeding with the unlock right away if it already is. The
+///        session bus itself may not be up yet at login in which case it is watched once connected.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+void wait_for_kp(session_loop_data *session_data) {
+  session_data->kp_wait_start_time = g_get_monotonic_time();
+  session_data->kp_wait_timeout_id =
+      g_timeout_add_seconds(session_data->kp_wait_secs, handle_kp_wait_timeout, session_data);
+  GDBusConnection *session_conn = session_bus_get(&session_data->bus);
+  if (session_conn) {
+    watch_kp_name(session_conn, session_data);
+  } else {
+    session_bus_connect(&session_data->bus);
+  }
+}
+
+/// @brief Callback for completion of the `LockedHint` query of an unlock which proceeds with the
+///        unlock if the session is not locked. If KeePassXC is not yet running, then this waits
+///        for it to appear on the session bus.
+/// @param source the `GDBusConnection` object for the system D-Bus
+/// @param res the result of the asynchronous query
+/// @param user_data pointer to the `session_loop_data` of the monitored session which holds a
+///                  reference for the query
+void handle_unlock_locked_hint(GObject *source, GAsyncResult *res, gpointer user_data) {
+  session_loop_data *session_data = (session_loop_data *)user_data;
+  bool locked = query_locked_hint_finish(G_DBUS_CONNECTION(source), res);
+  stats_record("lock_check", session_data->unlock_start_time, !locked);
+  if (session_data->closed) {
+    session_data->unlock_running = false;
+  } else if (g_cancellable_is_cancelled(session_data->unlock_cancellable)) {
+    stats_record("unlock", session_data->unlock_start_time, false);
+    session_unlock_done(session_data);
+  } else {
+    // last minute check to skip unlock if LockedHint is true
+    if (locked) {
+      print_error("Skipping unlock since screen/session is still locked for UID=%u!\n",
+          session_data->user_id);
+      stats_record("unlock", session_data->unlock_start_time, false);
+      session_unlock_done(session_data);
+    } else {
+      wait_for_kp(session_data);
     }
   }
-  globfree(&globbuf);
+  session_data_unref(session_data);
 }
 
-/// @brief Holds the fields for `user_data` passed to the `handle_session_event` callback
-typedef struct {
-  GMainLoop *loop;              // the main loop object pointer
-  const gchar *session_path;    // path of the selected session
-  uid_t user_id;                // numeric ID of the user
-  bool is_wayland;              // `true` if the session is a Wayland one, `false` for X11
-  const gchar *display;         // the `Display` property of the session
-  bool session_locked;          // holds the previous locked state of the session
-  bool session_active;          // holds the previous active state of the session
-} session_loop_data;
+/// @brief Start an unlock of a session that serves all the triggers seen so far, beginning with
+///        a fresh `LockedHint` query.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+void session_unlock_start(session_loop_data *session_data) {
+  // the passwords that are not yet pre-staged are decrypted by the unlock itself
+  session_stop_prestage(session_data);
+  if (session_data->defer_timeout_id != 0) {
+    g_source_remove(session_data->defer_timeout_id);
+    session_data->defer_timeout_id = 0;
+  }
+  session_data->num_deferred = 0;
+  session_data->unlock_running = true;
+  session_data->unlock_generation = session_data->trigger_generation;
+  session_data->kp_wait_secs = session_data->pending_wait_secs;
+  session_data->unlock_start_time = session_data->pending_trigger_time;
+  session_data->pending_wait_secs = 0;
+  session_data->pending_trigger_time = 0;
+  session_data->unlock_cancellable = g_cancellable_new();
+  query_locked_hint(session_data->system_conn, session_data->session_path,
+      session_data->unlock_cancellable, handle_unlock_locked_hint, session_data_ref(session_data));
+}
 
-/// @brief Callback to handle session events on `org.freedesktop.login1` for selected session
-/// @param conn the `GBusConnection` object for the system D-Bus
-/// @param sender_name name of the sender of the event
-/// @param object_path path of the object for which the event was raised
-/// @param interface_name D-Bus interface of the raised signal
-/// @param signal_name name of the D-Bus signal that was raised
-/// @param parameters parameters of the raised signal
-/// @param user_data custom user data sent through with the event which should be pointer to
-///                  `session_loop_data`
-void handle_session_event(GDBusConnection *conn, const char *sender_name, const char *object_path,
-    const char *interface_name, const char *signal_name, GVariant *parameters, gpointer user_data) {
+/// @brief Abort the running unlock of a session, if any, and drop the triggers that are queued,
+///        since the session has been locked or deactivated. The passwords decrypted so far are
+///        wiped and no more `openDatabase` calls are sent.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+void session_unlock_cancel(session_loop_data *session_data) {
+  if (session_data->settle_timeout_id != 0) {
+    g_source_remove(session_data->settle_timeout_id);
+    session_data->settle_timeout_id = 0;
+  }
+  if (session_data->defer_timeout_id != 0) {
+    g_source_remove(session_data->defer_timeout_id);
+    session_data->defer_timeout_id = 0;
+  }
+  session_data->unlock_generation = session_data->trigger_generation;
+  session_data->pending_wait_secs = 0;
+  session_data->pending_trigger_time = 0;
+  if (!session_data->unlock_running) return;
+
+  print_info("Aborting the running unlock for UID=%u\n", session_data->user_id);
+  g_cancellable_cancel(session_data->unlock_cancellable);
+  // the other stages notice the cancellation when their asynchronous calls complete
+  if (session_data->kp_wait_timeout_id != 0) {
+    stop_kp_wait(session_data);
+    stats_record("kp_wait", session_data->kp_wait_start_time, false);
+    stats_record("unlock", session_data->unlock_start_time, false);
+    session_unlock_done(session_data);
+  } else if (session_data->kp_check_unlock) {
+    // the hashing of KeePassXC goes on since its result is needed by the next unlock
+    session_data->kp_check_unlock = false;
+    stats_record("unlock", session_data->unlock_start_time, false);
+    session_unlock_done(session_data);
+  }
+}
+
+/// @brief Timeout callback for the end of the settle window of the unlock triggers which starts
+///        the unlock, or leaves it to follow the one still running.
+/// @param user_data pointer to the `session_loop_data` of the monitored session
+/// @return `G_SOURCE_REMOVE` always
+gboolean handle_unlock_settled(gpointer user_data) {
   session_loop_data *session_data = (session_loop_data *)user_data;
+  session_data->settle_timeout_id = 0;
+  if (!session_data->unlock_running) session_unlock_start(session_data);
+  return G_SOURCE_REMOVE;
+}
+
+/// @brief Unlock all the KDBX databases that were registered (using `keepassxc-unlock-setup`)
+///        of the given user using KeePassXC's D-Bus API. This only starts the unlock which
+///        proceeds asynchronously from the main loop.
+///
+/// Bursts of triggers are coalesced so that at most one unlock runs and at most one more is
+/// queued behind it. A trigger on an idle session starts the unlock right away, while each one
+/// that arrives during a running unlock bumps the generation and (re)starts a settle window of
+/// `ENV_UNLOCK_SETTLE_MS`. A single follow-up unlock for all of them is started once the running
+/// one is done and the triggers have stopped flapping for the whole window.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+/// @param wait_secs seconds to wait for the KeePassXC D-Bus service to appear before giving up
+void unlock_databases(session_loop_data *session_data, int wait_secs) {
+  // a pending wait will unlock as soon as KeePassXC shows up
+  if (session_data->kp_wait_timeout_id != 0) {
+    print_info("Already waiting for KeePassXC D-Bus API to appear\n");
+    return;
+  }
+  session_data->trigger_generation++;
+  session_data->pending_wait_secs = MAX(session_data->pending_wait_secs, wait_secs);
+  if (session_data->pending_trigger_time == 0) {
+    session_data->pending_trigger_time = g_get_monotonic_time();
+  }
+  if (!session_data->unlock_running && session_data->settle_timeout_id == 0) {
+    session_unlock_start(session_data);
+    return;
+  }
+  if (session_data->settle_timeout_id != 0) {
+    g_source_remove(session_data->settle_timeout_id);
+  } else {
+    print_info("Unlock already in progress for UID=%u, another one will follow it\n",
+        session_data->user_id);
+  }
+  session_data->settle_timeout_id = g_timeout_add(
+      get_env_setting(ENV_UNLOCK_SETTLE_MS, 500, 0, 10000), handle_unlock_settled, session_data);
+}
+
+/// @brief Handle the `PropertiesChanged` signal of a monitored session and unlock the databases
+///        when the session gets unlocked or activated, or abort the running unlock when it gets
+///        locked or deactivated.
+/// @param session_data pointer to the `session_loop_data` of the monitored session
+/// @param parameters parameters of the `PropertiesChanged` signal
+void handle_session_properties_changed(session_loop_data *session_data, GVariant *parameters) {
   GVariantIter *iter = NULL;
   const char *key;
   GVariant *value = NULL;
@@ -381,17 +2231,22 @@ void handle_session_event(GDBusConnection *conn, const char *sender_name, const
     if (g_strcmp0(key, "LockedHint") == 0) {
       bool locked = g_variant_get_boolean(value);
       if (!locked && session_data->session_locked) {
-        print_info("Unlocking database(s) after screen/session unlock event\n");
-        unlock_databases(session_data->user_id, conn, session_data->session_path,
-            session_data->is_wayland, session_data->display, 10);
+        print_info("Unlocking database(s) after screen/session unlock event for UID=%u\n",
+            session_data->user_id);
+        unlock_databases(session_data, 10);
+      } else if (locked && !session_data->session_locked) {
+        session_unlock_cancel(session_data);
+        session_prestage_unlock(session_data);
       }
       session_data->session_locked = locked;
     } else if (g_strcmp0(key, "Active") == 0) {
       bool active = g_variant_get_boolean(value);
       if (active && !session_data->session_active && !session_data->session_locked) {
-        print_info("Unlocking database(s) after session activation event\n");
-        unlock_databases(session_data->user_id, conn, session_data->session_path,
-            session_data->is_wayland, session_data->display, 30);
+        print_info("Unlocking database(s) after session activation event for UID=%u\n",
+            session_data->user_id);
+        unlock_databases(session_data, 30);
+      } else if (!active && session_data->session_active) {
+        session_unlock_cancel(session_data);
       }
       session_data->session_active = active;
     }
@@ -399,6 +2254,20 @@ void handle_session_event(GDBusConnection *conn, const char *sender_name, const
   g_variant_iter_free(iter);
 }
 
+/// @brief Callback to handle session events on `org.freedesktop.login1` for selected session
+/// @param conn the `GBusConnection` object for the system D-Bus
+/// @param sender_name name of the sender of the event
+/// @param object_path path of the object for which the event was raised
+/// @param interface_name D-Bus interface of the raised signal
+/// @param signal_name name of the D-Bus signal that was raised
+/// @param parameters parameters of the raised signal
+/// @param user_data custom user data sent through with the event which should be pointer to
+///                  `session_loop_data`
+void handle_session_event(GDBusConnection *conn, const char *sender_name, const char *object_path,
+    const char *interface_name, const char *signal_name, GVariant *parameters, gpointer user_data) {
+  handle_session_properties_changed((session_loop_data *)user_data, parameters);
+}
+
 /// @brief Callback to handle session close for the selected session
 void handle_session_close(GDBusConnection *conn, const char *sender_name, const char *object_path,
     const char *interface_name, const char *signal_name, GVariant *parameters, gpointer user_data) {
@@ -407,38 +2276,275 @@ void handle_session_close(GDBusConnection *conn, const char *sender_name, const
   g_variant_get(parameters, "(s&o)", NULL, &removed_session_path);    // &o avoids `g_free()`
   if (g_strcmp0(removed_session_path, session_data->session_path) == 0) {
     print_info("Exit on session end for %s\n", session_data->session_path);
+    secret_cache_wipe(session_data->user_id, NULL);
     g_main_loop_quit(session_data->loop);
   }
 }
 
+/// @brief Callback for `PrepareForSleep` of logind which wipes all the cached secrets before the
+///        system suspends or hibernates, so that they are not left in memory that may be written
+///        out or be readable while the machine is unattended.
+void handle_prepare_for_sleep(GDBusConnection *conn, const char *sender_name,
+    const char *object_path, const char *interface_name, const char *signal_name,
+    GVariant *parameters, gpointer user_data) {
+  gboolean sleeping = FALSE;
+  g_variant_get(parameters, "(b)", &sleeping);
+  if (sleeping) secret_cache_wipe_all();
+}
+
+/// @brief Holds the state of the daemon mode that monitors the sessions of all the users
+typedef struct {
+  GMainLoop *loop;                 // the main loop object pointer
+  GDBusConnection *system_conn;    // the `GBusConnection` object for the system D-Bus
+  GHashTable *sessions;            // map of session path to its `session_loop_data`
+  GHashTable *pending_sessions;    // set of session paths being checked by logind queries
+  GHashTable *configs;             // map of user ID to the `user_config` shared by its sessions
+} daemon_data;
+
+/// @brief Stop monitoring a session and release its `session_loop_data`.
+void daemon_session_free(gpointer data) {
+  session_loop_data *session_data = (session_loop_data *)data;
+  session_data_close(session_data);
+  session_data_unref(session_data);
+}
+
+/// @brief Callback invoked once a session has been checked by `session_valid_for_unlock_async()`
+///        which starts monitoring it and unlocks the user's databases if it is a valid target.
+/// @param session_path path of the session
+/// @param valid `true` if auto-unlock can be attempted for the session else `false`
+/// @param user_id numeric ID of the session owner
+/// @param is_wayland `true` if the session type is `wayland` else `false` if it is `x11`
+/// @param display value of the `Display` property of the session
+/// @param session_id value of the `Id` property of the session
+/// @param leader_pid process ID of the session leader from the `Leader` property
+/// @param user_data pointer to the `daemon_data`
+void handle_daemon_session_checked(const gchar *session_path, bool valid, guint32 user_id,
+    bool is_wayland, const gchar *display, const gchar *session_id, guint32 leader_pid,
+    gpointer user_data) {
+  daemon_data *daemon = (daemon_data *)user_data;
+  // skip if the session was removed while it was being checked
+  if (!g_hash_table_remove(daemon->pending_sessions, session_path)) return;
+  if (!valid) {
+    print_info("Ignoring session '%s' which is not a valid target for auto-unlock\n", session_path);
+    return;
+  }
+  if (!user_has_db_configs(user_id)) {
+    print_info("Ignoring session '%s' as no KDBX databases have been configured for auto-unlock by "
+               "UID=%u\n",
+        session_path, user_id);
+    return;
+  }
+
+  // the configuration is shared by all the sessions of a user
+  user_config *config = g_hash_table_lookup(daemon->configs, GUINT_TO_POINTER(user_id));
+  if (!config) {
+    config = user_config_new(user_id);
+    g_hash_table_insert(daemon->configs, GUINT_TO_POINTER(user_id), config);
+  }
+  session_loop_data *session_data = session_data_new(daemon->loop, daemon->system_conn,
+      session_path, user_id, config, is_wayland, display, session_id, leader_pid);
+  g_hash_table_insert(daemon->sessions, session_data->session_path, session_data);
+
+  print_info("Monitoring session %s for UID=%u\n", session_path, user_id);
+  unlock_databases(session_data, 60);
+}
+
+/// @brief Start checking a session for auto-unlock if it is not already known to the daemon.
+/// @param daemon pointer to the `daemon_data`
+/// @param session_path path of the session
+void daemon_add_session(daemon_data *daemon, const gchar *session_path) {
+  if (g_hash_table_contains(daemon->sessions, session_path) ||
+      g_hash_table_contains(daemon->pending_sessions, session_path)) {
+    return;
+  }
+  g_hash_table_add(daemon->pending_sessions, g_strdup(session_path));
+  session_valid_for_unlock_async(
+      daemon->system_conn, session_path, handle_daemon_session_checked, daemon);
+}
+
+/// @brief Callback for creation of a new session in the daemon mode.
+void handle_daemon_session_new(GDBusConnection *conn, const char *sender_name,
+    const char *object_path, const char *interface_name, const char *signal_name,
+    GVariant *parameters, gpointer user_data) {
+  const gchar *session_path = NULL;
+  g_variant_get(parameters, "(&s&o)", NULL, &session_path);
+  daemon_add_session((daemon_data *)user_data, session_path);
+}
+
+/// @brief Callback for removal of a session in the daemon mode which stops monitoring it, and
+///        releases the user's configuration if this was the last session of the user.
+void handle_daemon_session_removed(GDBusConnection *conn, const char *sender_name,
+    const char *object_path, const char *interface_name, const char *signal_name,
+    GVariant *parameters, gpointer user_data) {
+  daemon_data *daemon = (daemon_data *)user_data;
+  const gchar *session_path = NULL;
+  g_variant_get(parameters, "(&s&o)", NULL, &session_path);
+  g_hash_table_remove(daemon->pending_sessions, session_path);
+  session_loop_data *session_data = g_hash_table_lookup(daemon->sessions, session_path);
+  if (!session_data) return;
+
+  uid_t user_id = session_data->user_id;
+  print_info("Stopped monitoring session %s for UID=%u\n", session_path, user_id);
+  // cached secrets live at most as long as any session of the user, so wipe them with each one
+  secret_cache_wipe(user_id, NULL);
+  g_hash_table_remove(daemon->sessions, session_path);
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, daemon->sessions);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    if (((session_loop_data *)value)->user_id == user_id) return;
+  }
+  g_hash_table_remove(daemon->configs, GUINT_TO_POINTER(user_id));
+}
+
+/// @brief Callback for `PropertiesChanged` of all the sessions in the daemon mode which is
+///        dispatched to the monitored session, if any.
+void handle_daemon_session_event(GDBusConnection *conn, const char *sender_name,
+    const char *object_path, const char *interface_name, const char *signal_name,
+    GVariant *parameters, gpointer user_data) {
+  daemon_data *daemon = (daemon_data *)user_data;
+  session_loop_data *session_data = g_hash_table_lookup(daemon->sessions, object_path);
+  if (session_data) handle_session_properties_changed(session_data, parameters);
+}
+
+/// @brief Callback for `ListSessions` of logind which starts checking all the existing sessions,
+///        so that a restart of the daemon picks up the sessions of users already logged in.
+/// @param source the `GDBusConnection` object for the system D-Bus
+/// @param res the result of the asynchronous call
+/// @param user_data pointer to the `daemon_data`
+void handle_daemon_list_sessions(GObject *source, GAsyncResult *res, gpointer user_data) {
+  GError *error = NULL;
+  GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+  if (!result) {
+    print_error("Failed to list existing sessions: %s\n", error ? error->message : "(null)");
+    g_clear_error(&error);
+    return;
+  }
+  GVariantIter *iter = NULL;
+  const gchar *session_path = NULL;
+  g_variant_get(result, "(a(susso))", &iter);
+  while (g_variant_iter_loop(iter, "(&su&s&s&o)", NULL, NULL, NULL, NULL, &session_path)) {
+    daemon_add_session((daemon_data *)user_data, session_path);
+  }
+  g_variant_iter_free(iter);
+  g_variant_unref(result);
+}
+
+/// @brief Run in the daemon mode which monitors the sessions of all the users in this process
+///        using a single connection to the system bus, and performs the unlocks in-process
+///        instead of starting a separate service for each user.
+/// @param connection the `GBusConnection` object for the system D-Bus
+/// @return the exit code of the program
+int run_daemon(GDBusConnection *connection) {
+  // a single match rule covers the properties of all the sessions; it is added explicitly since
+  // `g_dbus_connection_signal_subscribe()` cannot express a path namespace
+  GError *error = NULL;
+  gchar *match_rule = g_strdup_printf("type='signal',sender='%s',"
+                                      "interface='org.freedesktop.DBus.Properties',"
+                                      "member='PropertiesChanged',path_namespace='%s',arg0='%s'",
+      LOGIN_OBJECT_NAME, LOGIN_SESSION_PATH_NAMESPACE, LOGIN_SESSION_INTERFACE);
+  GVariant *result = g_dbus_connection_call_sync(connection, "org.freedesktop.DBus",
+      "/org/freedesktop/DBus", "org.freedesktop.DBus", "AddMatch",
+      g_variant_new("(s)", match_rule), NULL, G_DBUS_CALL_FLAGS_NONE, DBUS_CALL_WAIT, NULL,
+      &error);
+  g_free(match_rule);
+  if (!result) {
+    print_error("Failed to add match rule for session properties: %s\n",
+        error ? error->message : "(null)");
+    g_clear_error(&error);
+    return 1;
+  }
+  g_variant_unref(result);
+
+  GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+  daemon_data daemon = {loop, connection,
+      g_hash_table_new_full(g_str_hash, g_str_equal, NULL, daemon_session_free),
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL),
+      g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)user_config_free)};
+
+  guint properties_subscription_id = g_dbus_connection_signal_subscribe(connection,
+      LOGIN_OBJECT_NAME, "org.freedesktop.DBus.Properties", "PropertiesChanged", NULL,
+      LOGIN_SESSION_INTERFACE, G_DBUS_SIGNAL_FLAGS_NO_MATCH_RULE, handle_daemon_session_event,
+      &daemon, NULL);
+  guint new_subscription_id = g_dbus_connection_signal_subscribe(connection, LOGIN_OBJECT_NAME,
+      LOGIN_MANAGER_INTERFACE, "SessionNew", LOGIN_OBJECT_PATH, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+      handle_daemon_session_new, &daemon, NULL);
+  guint removed_subscription_id = g_dbus_connection_signal_subscribe(connection,
+      LOGIN_OBJECT_NAME, LOGIN_MANAGER_INTERFACE, "SessionRemoved", LOGIN_OBJECT_PATH, NULL,
+      G_DBUS_SIGNAL_FLAGS_NONE, handle_daemon_session_removed, &daemon, NULL);
+  guint sleep_subscription_id = g_dbus_connection_signal_subscribe(connection, LOGIN_OBJECT_NAME,
+      LOGIN_MANAGER_INTERFACE, "PrepareForSleep", LOGIN_OBJECT_PATH, NULL,
+      G_DBUS_SIGNAL_FLAGS_NONE, handle_prepare_for_sleep, NULL, NULL);
+
+  int exit_code = 0;
+  if (properties_subscription_id != 0 && new_subscription_id != 0 &&
+      removed_subscription_id != 0) {
+    // pick up the sessions that already exist after the subscriptions are in place
+    print_info("Monitoring all sessions for auto-unlock\n");
+    g_dbus_connection_call(connection, LOGIN_OBJECT_NAME, LOGIN_OBJECT_PATH,
+        LOGIN_MANAGER_INTERFACE, "ListSessions", NULL, G_VARIANT_TYPE("(a(susso))"),
+        G_DBUS_CALL_FLAGS_NONE, LOGIN_CALL_WAIT, NULL, handle_daemon_list_sessions, &daemon);
+    // run the main loop
+    g_main_loop_run(loop);
+  } else {
+    print_error("Failed to subscribe to receive D-Bus signals for %s\n", LOGIN_OBJECT_PATH);
+    exit_code = 1;
+  }
+
+  // cleanup
+  if (sleep_subscription_id != 0) {
+    g_dbus_connection_signal_unsubscribe(connection, sleep_subscription_id);
+  }
+  if (removed_subscription_id != 0) {
+    g_dbus_connection_signal_unsubscribe(connection, removed_subscription_id);
+  }
+  if (new_subscription_id != 0) {
+    g_dbus_connection_signal_unsubscribe(connection, new_subscription_id);
+  }
+  if (properties_subscription_id != 0) {
+    g_dbus_connection_signal_unsubscribe(connection, properties_subscription_id);
+  }
+  g_hash_table_unref(daemon.sessions);
+  g_hash_table_unref(daemon.pending_sessions);
+  g_hash_table_unref(daemon.configs);
+  secret_cache_wipe_all();
+  g_main_loop_unref(loop);
+  return exit_code;
+}
+
 
 int main(int argc, char *argv[]) {
   if (geteuid() != 0) {
     print_error("This program must be run as root\n");
     return 1;
   }
-  if (argc != 3) {
+  bool daemon_mode = argc == 2 && strcmp(argv[1], "--daemon") == 0;
+  if (argc != 3 && !daemon_mode) {
     show_usage(argv[0]);
     return 1;
   }
 
   // check if the first argument has a valid numeric user ID
   struct passwd *pwd = NULL;
-  char *user_end = NULL;
-  uid_t user_id = strtoul(argv[1], &user_end, 10);
-  if (argv[1][0] != '\0' && *user_end == '\0') pwd = getpwuid(user_id);
-  if (!pwd) {
-    print_error("Invalid user ID %s\n", argv[1]);
-    return 1;
-  }
-  user_id = pwd->pw_uid;
-  const char *session_path = argv[2];
+  uid_t user_id = 0;
+  const char *session_path = NULL;
+  if (!daemon_mode) {
+    char *user_end = NULL;
+    user_id = strtoul(argv[1], &user_end, 10);
+    if (argv[1][0] != '\0' && *user_end == '\0') pwd = getpwuid(user_id);
+    if (!pwd) {
+      print_error("Invalid user ID %s\n", argv[1]);
+      return 1;
+    }
+    user_id = pwd->pw_uid;
+    session_path = argv[2];
 
-  // check if there are any database configuration files for the user
-  if (!user_has_db_configs(user_id)) {
-    print_error(
-        "No configuration found for UID=%u - run 'sudo keepassxc-unlock-setup ...'\n", user_id);
-    return 0;
+    // check if there are any database configuration files for the user
+    if (!user_has_db_configs(user_id)) {
+      print_error(
+          "No configuration found for UID=%u - run 'sudo keepassxc-unlock-setup ...'\n", user_id);
+      return 0;
+    }
   }
 
   print_info("Starting %s version %s\n", argv[0], PRODUCT_VERSION);
@@ -452,43 +2558,59 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  // get the session `Type` and `Display` properties
-  gchar *display = NULL;
+  if (daemon_mode) {
+    stats_export(connection, DAEMON_STATS_NAME);
+    int exit_code = run_daemon(connection);
+    g_object_unref(connection);
+    return exit_code;
+  }
+
+  // get the session `Type`, `Display`, `Id` and `Leader` properties
+  gchar *display = NULL, *session_id = NULL;
+  guint32 leader_pid = 0;
   bool is_wayland = false;
-  if (!session_valid_for_unlock(connection, session_path, user_id, NULL, &is_wayland, &display)) {
+  if (!session_valid_for_unlock(connection, session_path, user_id, NULL, &is_wayland, &display,
+          &session_id, &leader_pid)) {
     print_error(
         "No valid X11/Wayland session found for UID=%u sessionPath='%s'\n", user_id, session_path);
     g_object_unref(connection);
     return 0;
   }
 
-  // point DBUS_SESSION_BUS_ADDRESS to the user's session dbus
-  char dbus_address[128];
-  // TODO: obtain this from /proc/<pid>/environ of the lead process of the session
-  snprintf(dbus_address, sizeof(dbus_address), "unix:path=/run/user/%u/bus", user_id);
-  setenv("DBUS_SESSION_BUS_ADDRESS", dbus_address, 1);
+  // parse the configuration files once which are then reloaded only when they change
+  user_config *config = user_config_new(user_id);
+  gchar stats_name[64];
+  snprintf(stats_name, sizeof(stats_name), USER_STATS_NAME_FORMAT, user_id);
+  stats_export(connection, stats_name);
+
+  GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+  session_loop_data *user_data = session_data_new(loop, connection, session_path, user_id, config,
+      is_wayland, display, session_id, leader_pid);
+  g_free(display);
+  g_free(session_id);
 
   // unlock on startup since this program should be invoked on user session start
   print_info("Startup: unlocking registered KeePassXC database(s) for UID=%u\n", user_id);
-  unlock_databases(user_id, connection, session_path, is_wayland, display, 60);
+  unlock_databases(user_data, 60);
 
   // start monitoring the session
   int exit_code = 0;
   print_info("Monitoring session %s for UID=%u\n", session_path, user_id);
-  GMainLoop *loop = g_main_loop_new(NULL, FALSE);
   // subscription is on the root org.freedesktop.login1 since the SessionRemoved signal has
   // also to be monitored which is only received on the root login object
-  session_loop_data user_data = {loop, session_path, user_id, is_wayland, display, false, true};
   guint session_subscription_id = g_dbus_connection_signal_subscribe(connection,
       LOGIN_OBJECT_NAME,                    // sender
       "org.freedesktop.DBus.Properties",    // interface
       "PropertiesChanged",                  // signal name
       session_path,                         // object path
-      NULL, G_DBUS_SIGNAL_FLAGS_NONE, handle_session_event, &user_data, NULL);
+      NULL, G_DBUS_SIGNAL_FLAGS_NONE, handle_session_event, user_data, NULL);
   if (session_subscription_id != 0) {
     guint login_subscription_id = g_dbus_connection_signal_subscribe(connection, LOGIN_OBJECT_NAME,
         LOGIN_MANAGER_INTERFACE, "SessionRemoved", LOGIN_OBJECT_PATH, NULL,
-        G_DBUS_SIGNAL_FLAGS_NONE, handle_session_close, &user_data, NULL);
+        G_DBUS_SIGNAL_FLAGS_NONE, handle_session_close, user_data, NULL);
+    guint sleep_subscription_id = g_dbus_connection_signal_subscribe(connection,
+        LOGIN_OBJECT_NAME, LOGIN_MANAGER_INTERFACE, "PrepareForSleep", LOGIN_OBJECT_PATH, NULL,
+        G_DBUS_SIGNAL_FLAGS_NONE, handle_prepare_for_sleep, NULL, NULL);
     if (login_subscription_id != 0) {
       // run the main loop
       g_main_loop_run(loop);
@@ -498,6 +2620,9 @@ int main(int argc, char *argv[]) {
       print_error("Failed to subscribe to receive D-Bus signals for %s\n", LOGIN_OBJECT_PATH);
       exit_code = 1;
     }
+    if (sleep_subscription_id != 0) {
+      g_dbus_connection_signal_unsubscribe(connection, sleep_subscription_id);
+    }
     g_dbus_connection_signal_unsubscribe(connection, session_subscription_id);
   } else {
     print_error("Failed to subscribe to receive D-Bus signals for %s\n", session_path);
@@ -505,9 +2630,12 @@ int main(int argc, char *argv[]) {
   }
 
   // cleanup
+  session_data_close(user_data);
+  session_data_unref(user_data);
+  user_config_free(config);
+  secret_cache_wipe_all();
   g_object_unref(connection);
   g_main_loop_unref(loop);
-  g_free(display);
 
   return exit_code;
 }
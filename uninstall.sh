@@ -10,7 +10,8 @@ fg_reset='\033[00m'
 sbin_files="keepassxc-unlock-setup keepassxc-login-monitor keepassxc-unlock"
 old_sbin_files="pam-keepassxc-auth"
 old_package="pam-keepassxc"
-service_files="keepassxc-login-monitor.service keepassxc-unlock@.service"
+service_files="keepassxc-login-monitor.service keepassxc-unlock-daemon.service keepassxc-unlock@.service"
+dbus_policy_file="/etc/dbus-1/system.d/org.keepassxc.Unlock.conf"
 doc_files="README.md LICENSE"
 config_dir=/etc/keepassxc-unlock
 
@@ -27,18 +28,21 @@ if [ "$resp" != y -a "$resp" != Y ]; then
 fi
 
 echo -e "${fg_orange}Stopping systemd services and removing the service files$fg_reset"
-for unit in $(sudo systemctl -q list-units 'keepassxc-unlock@*.service' | awk '{ print $1 }'); do
+for unit in $(sudo systemctl -q list-units 'keepassxc-unlock-*.service' 'keepassxc-unlock@*.service' |
+    awk '{ print $1 }'); do
   echo -e "$fg_orange  Stopping service '$unit'$fg_reset"
   sudo systemctl stop "$unit"
 done
-unit=keepassxc-login-monitor.service
-echo -e "$fg_orange  Stopping service '$unit'$fg_reset"
-sudo systemctl stop "$unit" || /bin/true
-echo -e "$fg_orange  Disabling service '$unit'$fg_reset"
-sudo systemctl disable "$unit" || /bin/true
+for unit in keepassxc-login-monitor.service keepassxc-unlock-daemon.service; do
+  echo -e "$fg_orange  Stopping service '$unit'$fg_reset"
+  sudo systemctl stop "$unit" || /bin/true
+  echo -e "$fg_orange  Disabling service '$unit'$fg_reset"
+  sudo systemctl disable "$unit" || /bin/true
+done
 for file in $service_files; do
   sudo rm -f /etc/systemd/system/$file
 done
+sudo rm -f $dbus_policy_file
 echo -e "${fg_orange}Reloading systemd daemon$fg_reset"
 sudo systemctl daemon-reload
 